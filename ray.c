@@ -6,15 +6,21 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "ray_ast.h"
 #include "ray_math.h"
-#include "ray.yacc.generated_h"
-#include "ray.lex.generated_h"
 #include "ray_render.h"
 #include "ray_bmp.h"
 #include "ray_physics.h"
 #include "ray_console.h"
+#include "ray_output.h"
+#include "ray_bench.h"
+#include "ray_snapshot.h"
+#include "ray_frame_parallel.h"
+#include "ray_trajectory.h"
+#include "ray_checkpoint.h"
+#include "ray_scene_bin.h"
 
 #define CHECK(x)	do { if (!(x)) { fprintf(stderr, "%s:%d CHECK failed: %s, errno %d %s\n", __FILE__, __LINE__, #x, errno, strerror(errno)); abort(); } } while(0)
 
@@ -29,102 +35,513 @@
 // user  0m18.530s
 // sys   0m0.188s
 
-void render_scene(struct framebuffer_pt4 *fb, const struct context* ctx);
+// checkpoints are written as <prefix>-%05d.ckpt every `every` frames while simulating, and read to start later
+typedef struct {
+    const char *prefix;
+    int every;
+} checkpoint_options_t;
 
 typedef struct {
-    struct framebuffer_pt4 *fb;
     struct context *ctx;
-} render_data_t;
+    struct snapshot_ring *ring;
+    int first_frame;
+    int num_frames;
+    int report_awake;
+    const struct trajectory *trajectory;    // positions come from here instead of the physics step
+    const checkpoint_options_t *checkpoints;
+    int reuse_unchanged;                    // flag frames that look like the one before, see scene_render_hash()
+    int checkpoint_failed;                  // set if a checkpoint couldn't be written; rendering goes on regardless
+} physics_data_t;
+
+typedef struct {
+    struct output *out;
+    int frame;
+    struct framebuffer_pt4 *fb;
+    struct frame_progress *progress;
+} write_data_t;
 
 
-//thread 1 velocity calcs
-void *thread_calc_vel(void *arg) {
-    struct context *ctx = (struct context *)arg;
-    calc_velocities(ctx);
+// one physics step, into frame, writing its checkpoint if one is due. returns -1 if that couldn't be written
+static int step_to_frame(struct context *ctx, int frame, const checkpoint_options_t *ck) {
+    step_physics(ctx);
+    if (ck->prefix && ck->every > 0 && frame % ck->every == 0) {
+        char path[256];
+        checkpoint_path(ck->prefix, frame, path, sizeof(path));
+        return checkpoint_write(path, ctx, frame);
+    }
+    return 0;
+}
+
+// brings the physics from the scene as parsed (frame 0) to frame, from the latest checkpoint at or before it if
+// there is one. returns the frame it started from, or -1 if a checkpoint couldn't be loaded or written
+static int seek_physics(struct context *ctx, int frame, const checkpoint_options_t *ck) {
+    int start = 0;
+    if (ck->prefix && (start = checkpoint_load_latest(ck->prefix, ctx, frame)) < 0)
+        return -1;
+    for (int f = start + 1; f <= frame; f++)
+        if (step_to_frame(ctx, f, ck) != 0)
+            return -1;
+    return start;
+}
+
+// thread 1 physics, runs ahead of rendering publishing each frame's spheres into the snapshot ring
+void *thread_physics(void *arg) {
+    physics_data_t *pd = (physics_data_t *)arg;
+    struct context *ctx = pd->ctx;
+    uint64_t last_hash = 0;
+    for (int n = 0; n < pd->num_frames; n++) {
+        int frame = pd->first_frame + n;
+        sphere *snapshot = snapshot_ring_begin_write(pd->ring);
+        physics_copy_spheres(ctx, snapshot);
+        if (pd->trajectory) {
+            const pt3 *positions = trajectory_positions(pd->trajectory, frame);
+            for (int i = 0; i < ctx->num_spheres; i++)
+                snapshot[i].position = positions[i];
+        }
+        int unchanged = 0;
+        if (pd->reuse_unchanged) {
+            struct context view = snapshot_context(ctx, snapshot);
+            uint64_t hash = scene_render_hash(&view);
+            unchanged = n > 0 && hash == last_hash;
+            last_hash = hash;
+        }
+        snapshot_ring_publish(pd->ring, unchanged);
+        if (pd->trajectory)
+            continue;
+        if (n + 1 < pd->num_frames) {
+            if (step_to_frame(ctx, frame + 1, pd->checkpoints) != 0)
+                pd->checkpoint_failed = 1;
+            if (pd->report_awake)
+                fprintf(stderr, "frame %d: %d of %d spheres awake\n", frame + 1, physics_awake_count(ctx), ctx->num_spheres);
+        }
+    }
+    return NULL;
+}
+
+// thread 2 encoding, streams rows out as soon as their band is rendered
+void *thread_write_frame(void *arg) {
+    write_data_t *wd = (write_data_t *)arg;
+    output_write_frame(wd->out, wd->frame, wd->fb, wd->progress);
     return NULL;
 }
 
-// thread 2 rendering
-void *thread_render(void *arg) {
-    render_data_t *rd = (render_data_t *)arg;
-    render_scene(rd->fb, rd->ctx);
+typedef struct {
+    struct bmp_stream *stream;
+    struct framebuffer_pt4 *fb;
+    struct frame_progress *progress;
+} band_write_data_t;
+
+void *thread_write_band(void *arg) {
+    band_write_data_t *bw = (band_write_data_t *)arg;
+    bmp_stream_write_rows(bw->stream, bw->fb, bw->progress);
     return NULL;
 }
 
+// Renders one frame into a BMP a band of rows at a time, bottom band first, so memory use is set by the size
+// of band rather than by the resolution. Each band is encoded while it is being rendered.
+static void render_frame_banded(const char *path, const struct context *ctx, int width, int height,
+        struct framebuffer_pt4 *band, struct frame_progress *progress, int nthreads) {
+    int band_rows = band->height;
+    struct bmp_stream *stream = bmp_stream_open(path, width, height);
+    for (int y_hi = height; y_hi > 0; y_hi -= band_rows) {
+        int y_lo = y_hi - band_rows > 0 ? y_hi - band_rows : 0;
+        band->height = y_hi - y_lo;
+        frame_progress_reset(progress);
+
+        pthread_t tid_write;
+        band_write_data_t bw = { stream, band, progress };
+        pthread_create(&tid_write, NULL, thread_write_band, &bw);
+        render_scene_rows(band, ctx, height, y_lo, progress, nthreads);
+        pthread_join(tid_write, NULL);
+    }
+    band->height = band_rows;
+    bmp_stream_close(stream);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [options] <scene file> <output prefix>\n"
+            "   or: %s [options] --bake <trajectory> <scene file>\n"
+            "   or: %s [options] --physics-only --checkpoint-prefix P --checkpoint-every K <scene file>\n"
+            "  -f, --format bmp|delta|pack  output one BMP per frame (default), a delta frame container or a\n"
+            "                               single preallocated file of BMP slots\n"
+            "  -k, --keyframe-interval N    frames between delta container keyframes (default 25)\n"
+            "  -p, --preview                show a live downsampled preview of each frame on the terminal\n"
+            "  -s, --size WxH               output resolution (default 1024x768)\n"
+            "  -n, --num-frames N           frames to render or bake (default 100)\n"
+            "  -F, --frames A:B             render scene frames A to B-1 only; output files keep the scene frame\n"
+            "                               numbers, so ranges rendered separately add up to the whole animation\n"
+            "      --checkpoint-prefix P    start from the latest physics checkpoint P-<frame>.ckpt at or before\n"
+            "                               the first frame, and write new ones there\n"
+            "      --checkpoint-every K     write a checkpoint every K frames while simulating (default 0, never)\n"
+            "      --physics-only           only simulate up to the last frame, e.g. to write the checkpoints that\n"
+            "                               separate frame range runs start from (use the same physics options)\n"
+            "  -B, --bake FILE              only run the physics, storing every frame's sphere positions in FILE\n"
+            "                               (always from frame 0 to the last frame)\n"
+            "  -T, --trajectory FILE        take sphere positions from a baked FILE instead of running physics\n"
+            "      --max-framebuffer-mb N   render in bands of rows if the framebuffers would exceed N MB (bmp only)\n"
+            "  -t, --physics-threads N      run the physics step on N threads (default 1); the result\n"
+            "                               is the same for any N\n"
+            "  -a, --physics-ahead K        let physics run up to K frames ahead of rendering (default 4)\n"
+            "      --sleep-threshold V      put spheres resting on a plane slower than V to sleep (default 0, off)\n"
+            "      --sleep-steps M          steps a sphere must rest before it sleeps (default 10)\n"
+            "      --max-substeps S         move spheres going over half their radius per frame in up to S\n"
+            "                               substeps, with gravity and plane contacts in each, sweeping them\n"
+            "                               so they can't pass through planes or spheres (default 0, off)\n"
+            "      --no-reuse               render every frame, even those that look exactly like the one before\n"
+            "                               (by default these are written as copies of it)\n"
+            "  -j, --threads N              render threads (default: number of cores)\n"
+            "  -P, --parallel auto|tile|frame\n"
+            "                               split each frame across threads, render whole frames concurrently,\n"
+            "                               or pick from resolution and core count (default auto)\n"
+            "      --force-isa sse2|avx2|avx512\n"
+            "                               render with this instruction set instead of the best the CPU has;\n"
+            "                               the images are the same either way\n"
+            "   or: %s compile <scene file> <compiled scene>\n"
+            "                               store a parsed scene in a binary file that loads without parsing;\n"
+            "                               pass it wherever a scene file goes\n"
+            "   or: %s bench <name> [args]\n", argv0, argv0, argv0, argv0, argv0);
+}
+
 int main(int argc, char **argv) {
-    // 2 framebuffers (double buffering)
-    struct framebuffer_pt4 *fb[2];
-    fb[0] = new_framebuffer_pt4(1024, 768);
-    fb[1] = new_framebuffer_pt4(1024, 768);
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "compile") == 0)
+        return scene_compile_main(argc - 1, argv + 1);
 
-    pthread_t file_write_thread;
+    static const struct option long_options[] = {
+        { "format",             required_argument, NULL, 'f' },
+        { "keyframe-interval",  required_argument, NULL, 'k' },
+        { "preview",            no_argument,       NULL, 'p' },
+        { "size",               required_argument, NULL, 's' },
+        { "num-frames",         required_argument, NULL, 'n' },
+        { "frames",             required_argument, NULL, 'F' },
+        { "checkpoint-prefix",  required_argument, NULL, 'C' },
+        { "checkpoint-every",   required_argument, NULL, 'E' },
+        { "physics-only",       no_argument,       NULL, 'O' },
+        { "no-reuse",           no_argument,       NULL, 'U' },
+        { "bake",               required_argument, NULL, 'B' },
+        { "trajectory",         required_argument, NULL, 'T' },
+        { "max-framebuffer-mb", required_argument, NULL, 'M' },
+        { "physics-threads",    required_argument, NULL, 't' },
+        { "physics-ahead",      required_argument, NULL, 'a' },
+        { "parallel",           required_argument, NULL, 'P' },
+        { "threads",            required_argument, NULL, 'j' },
+        { "sleep-threshold",    required_argument, NULL, 'S' },
+        { "sleep-steps",        required_argument, NULL, 'N' },
+        { "max-substeps",       required_argument, NULL, 'X' },
+        { "force-isa",          required_argument, NULL, 'I' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct output_options out_opts = { OUTPUT_BMP, NULL, 1024, 768, 100, 25, 0 };
+    int preview = 0;
+    long max_framebuffer_mb = 0;
+    int physics_threads = 1;
+    int physics_ahead = 4;
+    enum parallel_mode parallel = PARALLEL_AUTO;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    double sleep_threshold = 0;
+    int sleep_steps = 10;
+    int max_substeps = 0;
+    const char *bake_path = NULL;
+    const char *trajectory_path = NULL;
+    checkpoint_options_t checkpoints = { NULL, 0 };
+    int physics_only = 0;
+    int reuse_unchanged = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:k:ps:n:F:B:T:t:a:P:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            if (parse_output_format(optarg, &out_opts.format) != 0) {
+                fprintf(stderr, "unknown output format '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            out_opts.keyframe_interval = atoi(optarg);
+            break;
+        case 'p':
+            preview = 1;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &out_opts.width, &out_opts.height) != 2 || out_opts.width < 2 || out_opts.height < 2) {
+                fprintf(stderr, "bad size '%s', expected WxH\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            out_opts.first_frame = 0;
+            out_opts.num_frames = atoi(optarg);
+            if (out_opts.num_frames < 1) {
+                fprintf(stderr, "bad frame count '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'F': {
+            int a, b;
+            if (sscanf(optarg, "%d:%d", &a, &b) != 2 || a < 0 || b <= a) {
+                fprintf(stderr, "bad frame range '%s', expected A:B with 0 <= A < B\n", optarg);
+                return 1;
+            }
+            out_opts.first_frame = a;
+            out_opts.num_frames = b - a;
+            break;
+        }
+        case 'C':
+            checkpoints.prefix = optarg;
+            break;
+        case 'E':
+            checkpoints.every = atoi(optarg);
+            break;
+        case 'O':
+            physics_only = 1;
+            break;
+        case 'U':
+            reuse_unchanged = 0;
+            break;
+        case 'B':
+            bake_path = optarg;
+            break;
+        case 'T':
+            trajectory_path = optarg;
+            break;
+        case 'M':
+            max_framebuffer_mb = atol(optarg);
+            break;
+        case 't':
+            physics_threads = atoi(optarg);
+            break;
+        case 'a':
+            physics_ahead = atoi(optarg);
+            break;
+        case 'S':
+            sleep_threshold = atof(optarg);
+            break;
+        case 'N':
+            sleep_steps = atoi(optarg);
+            break;
+        case 'X':
+            max_substeps = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            if (nthreads < 1) nthreads = 1;
+            break;
+        case 'P':
+            if (parse_parallel_mode(optarg, &parallel) != 0) {
+                fprintf(stderr, "unknown parallel mode '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I': {
+            enum render_isa isa = render_isa_from_name(optarg);
+            if (isa == RENDER_ISA_COUNT) {
+                fprintf(stderr, "unknown instruction set '%s'\n", optarg);
+                return 1;
+            }
+            if (!render_isa_supported(isa)) {
+                fprintf(stderr, "this CPU can't run %s\n", optarg);
+                return 1;
+            }
+            render_set_isa(isa);
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // looks at the CPU now if --force-isa didn't pick a set, rather than in the first render worker
+    render_active_isa();
+    if (argc - optind < (bake_path || physics_only ? 1 : 2)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (physics_only && (checkpoints.prefix == NULL || checkpoints.every <= 0)) {
+        fprintf(stderr, "--physics-only needs --checkpoint-prefix and --checkpoint-every\n");
+        return 1;
+    }
+    const char *scene_path = argv[optind];
+    out_opts.prefix = argv[optind + 1];
 
-    for (int frame = 0; frame < 100; frame++) {
-        char prev_filepath[128];
-        snprintf(prev_filepath, sizeof(prev_filepath), "%s-%05d.bmp", argv[2], frame - 1);
+    // two whole framebuffers unless that exceeds the limit, then a single band of as many rows as fit
+    size_t row_bytes = sizeof(pt4) * out_opts.width;
+    size_t max_framebuffer_bytes = (size_t)max_framebuffer_mb << 20;
+    int band_rows = 0;
+    if (max_framebuffer_mb > 0 && 2 * row_bytes * out_opts.height > max_framebuffer_bytes) {
+        if (out_opts.format != OUTPUT_BMP) {
+            fprintf(stderr, "--max-framebuffer-mb needs the bmp output format\n");
+            return 1;
+        }
+        band_rows = max_framebuffer_bytes / row_bytes;
+        if (band_rows > out_opts.height) band_rows = out_opts.height;
+        if (band_rows > RENDER_BAND_HEIGHT) band_rows -= band_rows % RENDER_BAND_HEIGHT;
+        if (band_rows < 1) band_rows = 1;
+        if (preview) {
+            fprintf(stderr, "no preview in banded mode\n");
+            preview = 0;
+        }
+    }
+
+    FILE *finput = fopen(scene_path, "r");
+    if (finput == NULL) {
+        fprintf(stderr, "error opening scene '%s': %d %s\n", scene_path, errno, strerror(errno));
+        return 1;
+    }
+
+    struct context *ctx = new_context();
 
-        if (frame > 0) {
-            //  previous frame is written to file in separate thread
-            pthread_create(&file_write_thread, NULL, thread_write_bmp, (void*)prev_filepath);
+    // 2 framebuffers (double buffering), each with its own band tracker
+    struct framebuffer_pt4 *fb[2] = {0};
+    struct frame_progress *progress[2] = {0};
+    write_data_t wd[2];
+    struct output *output = NULL;
+    struct console_preview *console = NULL;
+    struct snapshot_ring *ring = NULL;
+    struct trajectory *trajectory = NULL;
+    int status = 1;             // until the run has got to the end without an error
+
+    int compiled = scene_bin_load(scene_path, ctx);
+    if (compiled < 0)
+        goto out;
+    if (!compiled && parse_scene(finput, scene_path, ctx) != 0) {
+        fprintf(stderr, "error parsing scene '%s'\n", scene_path);
+        goto out;
+    }
+
+    physics_set_threads(ctx, physics_threads);
+    physics_set_sleep(ctx, sleep_threshold, sleep_steps);
+    physics_set_substeps(ctx, max_substeps);
+    int end_frame = out_opts.first_frame + out_opts.num_frames;
+    if (bake_path) {
+        if (trajectory_bake(ctx, bake_path, end_frame) == 0)
+            status = 0;
+        goto out;
+    }
+    if (physics_only) {
+        double t0 = bench_now();
+        int start = seek_physics(ctx, end_frame - 1, &checkpoints);
+        if (start >= 0) {
+            fprintf(stderr, "simulated frames %d to %d in %.3f s\n", start, end_frame - 1, bench_now() - t0);
+            status = 0;
         }
+        goto out;
+    }
+    if (trajectory_path) {
+        if ((trajectory = trajectory_open(trajectory_path)) == NULL)
+            goto out;
+        if (trajectory->hdr->num_spheres != (uint32_t)ctx->num_spheres ||
+                trajectory->hdr->num_frames < (uint32_t)end_frame) {
+            fprintf(stderr, "trajectory '%s' has %u frames of %u spheres, the scene needs %d of %d\n", trajectory_path,
+                    trajectory->hdr->num_frames, trajectory->hdr->num_spheres, end_frame, ctx->num_spheres);
+            goto out;
+        }
+    } else if (seek_physics(ctx, out_opts.first_frame, &checkpoints) < 0) {
+        goto out;
+    }
+    output = output_open(&out_opts);
+    if (preview)
+        console = new_console_preview(STDOUT_FILENO);
+    if (band_rows)
+        parallel = PARALLEL_TILE;
+    parallel = choose_parallel_mode(parallel, out_opts.width, out_opts.height, out_opts.num_frames, nthreads);
+
+    // physics only ever waits for a free snapshot slot, rendering only for its frame's snapshot
+    ring = new_snapshot_ring(parallel == PARALLEL_FRAME && physics_ahead < nthreads ? nthreads : physics_ahead,
+            ctx->num_spheres);
+    physics_data_t pd = {
+        ctx, ring, out_opts.first_frame, out_opts.num_frames, sleep_threshold > 0 && !trajectory, trajectory, &checkpoints,
+        reuse_unchanged, 0,
+    };
+    pthread_t tid_physics;
+    pthread_create(&tid_physics, NULL, thread_physics, &pd);
+
+    if (parallel == PARALLEL_FRAME) {
+        struct frame_parallel_args fpa = {
+            ctx, ring, output, console, out_opts.width, out_opts.height, out_opts.num_frames, nthreads,
+        };
+        render_frames_parallel(&fpa);
+        pthread_join(tid_physics, NULL);
+        goto done;
+    }
+
+    for (int i = 0; i < (band_rows ? 1 : 2); i++) {
+        fb[i] = new_framebuffer_pt4(out_opts.width, band_rows ? band_rows : out_opts.height);
+        progress[i] = new_frame_progress(fb[i]->height, RENDER_BAND_HEIGHT);
+    }
+
+    pthread_t file_write_thread[2];
+    int writing[2] = { 0, 0 };  // buffer's encoder still running
+    int cur = 1;                // buffer of the last rendered frame
+
+    for (int frame = 0; frame < out_opts.num_frames; frame++) {
+        struct context view = snapshot_context(ctx, snapshot_ring_acquire(ring, frame));
+
+        // a frame that looks exactly like the last one is a copy of its output, once that is complete
+        if (snapshot_ring_unchanged(ring, frame)) {
+            snapshot_ring_release(ring, frame);
+            if (writing[cur]) {
+                pthread_join(file_write_thread[cur], NULL);
+                writing[cur] = 0;
+            }
+            output_repeat_frame(output, frame);
+            continue;
+        }
+
+        if (band_rows) {
+            char path[256];
+            output_frame_path(output, frame, path, sizeof(path));
+            render_frame_banded(path, &view, out_opts.width, out_opts.height, fb[0], progress[0], nthreads);
+            snapshot_ring_release(ring, frame);
+            continue;
+        }
+
+        cur = !cur;
+        frame_progress_reset(progress[cur]);
+
+        // the encoder for this frame starts right away and follows the renderer band by band
+        wd[cur] = (write_data_t){ output, frame, fb[cur], progress[cur] };
+        pthread_create(&file_write_thread[cur], NULL, thread_write_frame, &wd[cur]);
+        writing[cur] = 1;
 
         // the new frame is rendered into current buffer
-        pthread_t tid_vel, tid_render;
-        render_data_t rd = { fb[frame % 2], ctx };
-        pthread_create(&tid_render, NULL, thread_render, &rd);
-        pthread_create(&tid_vel, NULL, thread_calc_vel, ctx);
-
-        // waiting for rendering & physics calculations
-        pthread_join(tid_vel, NULL);
-        pthread_join(tid_render, NULL);
-        update_positions(ctx);
-
-        // wait for previous frame file writing to finish before continuing
-        if (frame > 0) {
-            pthread_join(file_write_thread, NULL);
+        render_scene(fb[cur], &view, progress[cur], nthreads);
+        snapshot_ring_release(ring, frame);
+        if (console)
+            console_preview_frame(console, fb[cur]);
+
+        // the previous frame's encoder must be done before its buffer is rendered into again
+        if (writing[!cur]) {
+            pthread_join(file_write_thread[!cur], NULL);
+            writing[!cur] = 0;
         }
     }
+    for (int i = 0; i < 2; i++)
+        if (writing[i])
+            pthread_join(file_write_thread[i], NULL);
+    pthread_join(tid_physics, NULL);
+
+done:
+    if (output->repeated > 0)
+        fprintf(stderr, "%d of %d frames looked like the frame before and were copied rather than rendered\n",
+                (int)output->repeated, out_opts.num_frames);
+    output_close(output);
+    if (console)
+        free_console_preview(console);
+    status = pd.checkpoint_failed ? 1 : 0;
+
 out:
-    yylex_destroy(scanner);
     if (finput) fclose(finput);
+    free_physics_state(ctx);
     free_context(ctx);
+    if (ring) free_snapshot_ring(ring);
+    if (trajectory) trajectory_close(trajectory);
 
     // Free both framebuffers (double-buffered)
-    if (fb[0]) free_framebuffer_pt4(fb[0]);
-    if (fb[1]) free_framebuffer_pt4(fb[1]);
+    for (int i = 0; i < 2; i++) {
+        if (fb[i]) free_framebuffer_pt4(fb[i]);
+        if (progress[i]) free_frame_progress(progress[i]);
+    }
 
-    return 0;
+    return status;
 
 }
-
-void render_scene(struct framebuffer_pt4 *fb, const struct context *ctx) {
-    double left_right_angle;
-    double up_down_angle;
-    int xmax = fb->width;
-    int ymax = fb->height;
-    if (xmax > ymax) {
-        left_right_angle = M_PI / 3;
-        up_down_angle    = left_right_angle / xmax * ymax;
-    } else {
-        up_down_angle    = M_PI / 3;
-        left_right_angle = up_down_angle / ymax * xmax;
-    }
-
-    double left_right_start = - left_right_angle / 2.0;
-    double left_right_step  =   left_right_angle  / (xmax - 1);
-    double up_down_start    =   up_down_angle     /  2.0;
-    double up_down_step     =   up_down_angle     / (ymax - 1);
-
-    for (int x = 0; x < xmax; x++) {
-        double xangle = -(left_right_start + left_right_step * x);
-        for (int y = 0; y < ymax; y++) {
-            double yangle = up_down_start - up_down_step * y;
-            pt3 direction = {{sin(xangle), sin(yangle), cos(yangle)*cos(xangle)}};
-            pt3_normalize_mut(&direction);
-            ray r = {{{0,0,-20}}, direction};
-            pt4 px_color = {0};
-            raytrace(ctx, &r, &px_color, 3);
-            framebuffer_pt4_set(fb, x, y, px_color);
-        }
-    }
-}
\ No newline at end of file
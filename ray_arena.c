@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ray_arena.h"
+
+void arena_init(struct arena *a) {
+	a->head = NULL;
+}
+
+void arena_free(struct arena *a) {
+	while (a->head) {
+		struct arena_block *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+}
+
+// Keeps only the oldest block, which is the common size, and zeroes what was used of it.
+void arena_reset(struct arena *a) {
+	if (a->head == NULL)
+		return;
+	while (a->head->next) {
+		struct arena_block *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+	memset(a->head->data, 0, a->head->used);
+	a->head->used = 0;
+}
+
+// size is already rounded up by arena_alloc(). Oversized requests get a block of their own.
+void *arena_alloc_slow(struct arena *a, size_t size) {
+	size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+	struct arena_block *b = calloc(1, sizeof(*b) + block);
+	b->size = block;
+	b->used = size;
+	b->next = a->head;
+	a->head = b;
+	return b->data;
+}
@@ -0,0 +1,37 @@
+#ifndef RAY_ARENA_H__
+#define RAY_ARENA_H__
+
+#include <stddef.h>
+
+// Bump allocator for short-lived nodes that all die together, such as the parser's spec lists. Allocations are
+// zeroed and never freed one by one; arena_reset() drops everything at once and keeps the first block for reuse.
+
+#define ARENA_BLOCK_SIZE	(64 * 1024)
+
+struct arena_block {
+	struct arena_block *next;	// older block
+	size_t size;
+	size_t used;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+struct arena {
+	struct arena_block *head;	// block being allocated from
+};
+
+void arena_init(struct arena *a);
+void arena_free(struct arena *a);
+void arena_reset(struct arena *a);
+void *arena_alloc_slow(struct arena *a, size_t size);
+
+static inline void *arena_alloc(struct arena *a, size_t size) {
+	size = (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+	struct arena_block *b = a->head;
+	if (b == NULL || b->size - b->used < size)
+		return arena_alloc_slow(a, size);
+	void *p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+#endif	// RAY_ARENA_H__
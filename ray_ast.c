@@ -1,3 +1,185 @@
+#include <limits.h>
+
 #include "ray_ast.h"
 
+// A generator count: a whole number from 0 up.
+static int whole_count(double c, long *n) {
+	if (c < 0 || c > INT_MAX)
+		return 0;
+	*n = (long)c;
+	return !(*n < c);
+}
+
+// Makes room for copies more repeats of the items between from and to, or returns 0 if they won't fit an int.
+static int reserve_repeats(struct context *ctx, const struct scene_mark *from, const struct scene_mark *to, long copies) {
+	long spheres = ctx->num_spheres + (long)(to->num_spheres - from->num_spheres) * copies;
+	long planes = ctx->num_planes + (long)(to->num_planes - from->num_planes) * copies;
+	long lights = ctx->num_lights + (long)(to->num_lights - from->num_lights) * copies;
+	long instances = ctx->num_instances + (long)(to->num_instances - from->num_instances) * copies;
+	if (copies > INT_MAX || spheres > INT_MAX || planes > INT_MAX || lights > INT_MAX || instances > INT_MAX)
+		return 0;
+	if (spheres > ctx->spheres_cap)
+		ctx->spheres = realloc(ctx->spheres, sizeof(*ctx->spheres) * (ctx->spheres_cap = spheres));
+	if (planes > ctx->planes_cap)
+		ctx->planes = realloc(ctx->planes, sizeof(*ctx->planes) * (ctx->planes_cap = planes));
+	if (lights > ctx->lights_cap)
+		ctx->lights = realloc(ctx->lights, sizeof(*ctx->lights) * (ctx->lights_cap = lights));
+	if (instances > ctx->instances_cap)
+		ctx->instances = realloc(ctx->instances, sizeof(*ctx->instances) * (ctx->instances_cap = instances));
+	return 1;
+}
+
+static void repeat(struct context *ctx, const struct scene_mark *from, const struct scene_mark *to, const pt3 *offset) {
+	for (int i = from->num_spheres; i < to->num_spheres; i++) {
+		sphere s = ctx->spheres[i];
+		s.position = pt3_add(&s.position, offset);
+		context_add_sphere(ctx, s);
+	}
+	for (int i = from->num_planes; i < to->num_planes; i++) {
+		plane p = ctx->planes[i];
+		p.position = pt3_add(&p.position, offset);
+		context_add_plane(ctx, p);
+	}
+	for (int i = from->num_lights; i < to->num_lights; i++) {
+		light l = ctx->lights[i];
+		l.position = pt3_add(&l.position, offset);
+		context_add_light(ctx, l);
+	}
+	for (int i = from->num_instances; i < to->num_instances; i++) {
+		instance in = ctx->instances[i];
+		in.position = pt3_add(&in.position, offset);
+		context_add_instance(ctx, in);
+	}
+}
+
+static void truncate_to(struct context *ctx, const struct scene_mark *m) {
+	ctx->num_spheres = m->num_spheres;
+	ctx->num_planes = m->num_planes;
+	ctx->num_lights = m->num_lights;
+	ctx->num_instances = m->num_instances;
+}
+
+const char *context_grid(struct context *ctx, const struct grid_params *g, const struct scene_mark *from) {
+	long n[3], total = 1;
+	for (int k = 0; k < 3; k++) {
+		if (!whole_count(g->count.v[k], &n[k]))
+			return "grid count must be whole numbers";
+		if ((total *= n[k]) > INT_MAX)
+			return "grid makes too many objects";
+	}
+	struct scene_mark to = context_mark(ctx);
+	if (total == 0) {
+		truncate_to(ctx, from);
+		return NULL;
+	}
+	if (!reserve_repeats(ctx, from, &to, total - 1))
+		return "grid makes too many objects";
+
+	for (long z = 0; z < n[2]; z++) {
+		for (long y = 0; y < n[1]; y++) {
+			for (long x = 0; x < n[0]; x++) {
+				if (x == 0 && y == 0 && z == 0)
+					continue;
+				pt3 offset = {{ x * g->step.v[0], y * g->step.v[1], z * g->step.v[2] }};
+				repeat(ctx, from, &to, &offset);
+			}
+		}
+	}
+	return NULL;
+}
+
+const char *context_scatter(struct context *ctx, const struct scatter_params *sc, const struct scene_mark *from) {
+	long n, seed;
+	if (!whole_count(sc->count, &n))
+		return "scatter count must be a whole number";
+	if (!whole_count(sc->seed, &seed))
+		return "scatter seed must be a whole number";
+	struct scene_mark to = context_mark(ctx);
+	if (n == 0) {
+		truncate_to(ctx, from);
+		return NULL;
+	}
+	if (!reserve_repeats(ctx, from, &to, n - 1))
+		return "scatter makes too many objects";
+
+	unsigned short xsubi[3] = { seed, seed >> 16, 0x330e };
+	pt3 first;
+	for (long i = 0; i < n; i++) {
+		pt3 offset = {{ 0 }};
+		for (int k = 0; k < 3; k++)
+			offset.v[k] = sc->lo.v[k] + erand48(xsubi) * (sc->hi.v[k] - sc->lo.v[k]);
+		if (i == 0)
+			first = offset;
+		else
+			repeat(ctx, from, &to, &offset);
+	}
+	// The body itself is the first copy, moved last so the others are made from it unmoved.
+	for (int i = from->num_spheres; i < to.num_spheres; i++)
+		ctx->spheres[i].position = pt3_add(&ctx->spheres[i].position, &first);
+	for (int i = from->num_planes; i < to.num_planes; i++)
+		ctx->planes[i].position = pt3_add(&ctx->planes[i].position, &first);
+	for (int i = from->num_lights; i < to.num_lights; i++)
+		ctx->lights[i].position = pt3_add(&ctx->lights[i].position, &first);
+	for (int i = from->num_instances; i < to.num_instances; i++)
+		ctx->instances[i].position = pt3_add(&ctx->instances[i].position, &first);
+	return NULL;
+}
+
+const color *scene_parser_material(const struct scene_parser *p, ident name) {
+	for (int i = 0; i < p->num_named; i++)
+		if (p->named[i].name.len == name.len && memcmp(p->named[i].name.s, name.s, name.len) == 0)
+			return &p->named[i].color;
+	return NULL;
+}
+
+int scene_parser_define_material(struct scene_parser *p, ident name, const color *c) {
+	if (scene_parser_material(p, name) != NULL)
+		return -1;
+	named_material m = { name, *c };
+	__CONTEXT_APPEND(p, named, m);
+	return 0;
+}
+
+// Colors are equal when their bits are, so -0 and 0 stay apart, which is harmless.
+static uint32_t color_hash(const color *c) {
+	uint64_t h = 0xcbf29ce484222325ull;
+	const double *v[5] = { &c->rgba.v[0], &c->rgba.v[1], &c->rgba.v[2], &c->rgba.v[3], &c->reflectance };
+	for (int i = 0; i < 5; i++) {
+		uint64_t bits;
+		memcpy(&bits, v[i], sizeof(bits));
+		h = (h ^ bits) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	return h ^ (h >> 32);
+}
+
+static int color_same(const color *a, const color *b) {
+	return memcmp(a->rgba.v, b->rgba.v, sizeof(a->rgba.v)) == 0 && memcmp(&a->reflectance, &b->reflectance, sizeof(a->reflectance)) == 0;
+}
+
+// Rebuilds the hash at twice the size, or sized for the materials already in ctx.
+static void grow_material_slots(struct scene_parser *p, const struct context *ctx) {
+	uint32_t size = p->material_slots ? (p->material_mask + 1) * 2 : 64;
+	while (size < 2 * (uint32_t)ctx->num_materials)
+		size *= 2;
+	free(p->material_slots);
+	p->material_slots = calloc(size, sizeof(*p->material_slots));
+	p->material_mask = size - 1;
+	for (int m = 0; m < ctx->num_materials; m++) {
+		uint32_t i = color_hash(&ctx->materials[m]) & p->material_mask;
+		while (p->material_slots[i] != 0)
+			i = (i + 1) & p->material_mask;
+		p->material_slots[i] = m + 1;
+	}
+}
 
+uint32_t scene_parser_intern(struct scene_parser *p, struct context *ctx, const color *c) {
+	if (p->material_slots == NULL || 2 * (uint32_t)ctx->num_materials >= p->material_mask)
+		grow_material_slots(p, ctx);
+	uint32_t i = color_hash(c) & p->material_mask;
+	for (; p->material_slots[i] != 0; i = (i + 1) & p->material_mask)
+		if (color_same(&ctx->materials[p->material_slots[i] - 1], c))
+			return p->material_slots[i] - 1;
+	p->material_slots[i] = context_add_material(ctx, *c) + 1;
+	return p->material_slots[i] - 1;
+}
@@ -6,6 +6,9 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <sys/mman.h>
+
+#include "ray_arena.h"
 
 static inline double dot(const double *a, const double *b, int n) {
 	double ret = 0;
@@ -14,20 +17,60 @@ static inline double dot(const double *a, const double *b, int n) {
 	return ret;
 }
 
+// Built with RAY_VEC4 (make VEC4=1), points are vectors of four doubles: pt3 gets a fourth lane that only pads
+// it to 32 bytes, pt3 and pt4 are 16 byte aligned, and the operations below work on whole vectors with GCC's
+// vector extensions, which become pairs of SSE2 instructions or single AVX ones, rather than on loops the
+// compiler may or may not vectorize. Lane 3 of a pt3 means nothing; operations carry it along but never mix it
+// into the other lanes. Every lane is computed with the operations, in the order, of the loops, so both builds
+// render the same pixels. RAY_FAST_RSQRT (make FAST_RSQRT=1) additionally normalizes with an approximate
+// reciprocal square root refined to about 46 bits, which changes the last bits of images.
+#ifndef RAY_VEC4
+#define RAY_VEC4	0
+#endif
+#ifndef RAY_FAST_RSQRT
+#define RAY_FAST_RSQRT	0
+#endif
+
+#if RAY_VEC4
+typedef double vec4 __attribute__((vector_size(32), aligned(16)));
+typedef int64_t vec4_mask __attribute__((vector_size(32), aligned(16)));	// comparison results, shuffle indices
+
+static inline vec4 vec4_load(const double *v) {
+	vec4 x;
+	memcpy(&x, v, sizeof(x));
+	return x;
+}
+
+static inline void vec4_store(double *v, vec4 x) {
+	memcpy(v, &x, sizeof(x));
+}
+
+#define PT3_LANES	4
+#define PT_ALIGN	_Alignas(16)
+#else
+#define PT3_LANES	3
+#define PT_ALIGN
+#endif
+
 typedef struct pt3 {
-	double v[3];
+	PT_ALIGN double v[PT3_LANES];
 } pt3;
 
 typedef struct pt4 {
-	double v[4];
+	PT_ALIGN double v[4];
 } pt4;
 
 static inline double pt3_dot(const pt3 *a, const pt3 *b) {
+#if RAY_VEC4
+	vec4 p = vec4_load(a->v) * vec4_load(b->v);
+	return 0.0 + p[0] + p[1] + p[2];	// summed from 0 like dot(), which decides the sign of a zero
+#else
 	return dot(a->v, b->v, 3);
+#endif
 }
 
 static inline double pt3_dotv(const pt3 a, const pt3 b) {
-	return dot(a.v, b.v, 3);
+	return pt3_dot(&a, &b);
 }
 
 static inline double pt4_dot(const pt4 *a, const pt4 *b) {
@@ -38,64 +81,158 @@ static inline double mag(const pt3 *a) {
 	return sqrt(pt3_dot(a, a));
 }
 
-static inline void pt3_normalize_mut(pt3 *a) {
-	double m = mag(a);
-	if (m > 0)
-		for (int i = 0; i < 3; i++)
-			a->v[i] /= m;
+#if RAY_FAST_RSQRT
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include <float.h>
+
+// 1 / sqrt(d) from the single precision estimate and two Newton steps in double.
+static inline double rsqrt_fast(double d) {
+	if (!(d >= FLT_MIN && d <= FLT_MAX))
+		return 1 / sqrt(d);
+#if defined(__SSE__)
+	double y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(d)));
+#else
+	double y = 1 / sqrtf(d);
+#endif
+	y *= 1.5 - 0.5 * d * y * y;
+	y *= 1.5 - 0.5 * d * y * y;
+	return y;
 }
+#endif
 
 static inline pt3 pt3_normalize(const pt3 *a) {
 	pt3 ret = *a;
+#if RAY_VEC4 && RAY_FAST_RSQRT
+	double d = pt3_dot(a, a);
+	if (d > 0)
+		vec4_store(ret.v, vec4_load(ret.v) * rsqrt_fast(d));
+#elif RAY_VEC4
+	double m = mag(a);
+	if (m > 0)
+		vec4_store(ret.v, vec4_load(ret.v) / m);
+#else
 	double m = mag(a);
 	if (m > 0)
 		for (int i = 0; i < 3; i++)
 			ret.v[i] /= m;
+#endif
 	return ret;
 }
 
-static inline pt3 pt3_addv(const pt3 a, const pt3 b) {
-	pt3 ret;
-	for (int i = 0; i < 3; i++)
-		ret.v[i] = a.v[i] + b.v[i];
-	return ret;
+static inline void pt3_normalize_mut(pt3 *a) {
+	*a = pt3_normalize(a);
 }
 
 static inline pt3 pt3_add(const pt3 *a, const pt3 *b) {
 	pt3 ret;
+#if RAY_VEC4
+	vec4_store(ret.v, vec4_load(a->v) + vec4_load(b->v));
+#else
 	for (int i = 0; i < 3; i++)
 		ret.v[i] = a->v[i] + b->v[i];
+#endif
 	return ret;
 }
 
+static inline pt3 pt3_addv(const pt3 a, const pt3 b) {
+	return pt3_add(&a, &b);
+}
+
 static inline pt3 pt3_sub(const pt3 *a, const pt3 *b) {
 	pt3 ret;
+#if RAY_VEC4
+	vec4_store(ret.v, vec4_load(a->v) - vec4_load(b->v));
+#else
 	for (int i = 0; i < 3; i++)
 		ret.v[i] = a->v[i] - b->v[i];
+#endif
+	return ret;
+}
+
+static inline pt3 pt3_cross(const pt3 *a, const pt3 *b) {
+#if RAY_VEC4
+	const vec4_mask yzx = { 1, 2, 0, 3 }, zxy = { 2, 0, 1, 3 };
+	vec4 va = vec4_load(a->v), vb = vec4_load(b->v);
+	pt3 ret;
+	vec4_store(ret.v, __builtin_shuffle(va, yzx) * __builtin_shuffle(vb, zxy) -
+			__builtin_shuffle(va, zxy) * __builtin_shuffle(vb, yzx));
+#else
+	pt3 ret = {{
+		a->v[1] * b->v[2] - a->v[2] * b->v[1],
+		a->v[2] * b->v[0] - a->v[0] * b->v[2],
+		a->v[0] * b->v[1] - a->v[1] * b->v[0],
+	}};
+#endif
 	return ret;
 }
 
 static inline pt3 pt3_mul(const pt3 *a, double t) {
 	pt3 ret;
+#if RAY_VEC4
+	vec4_store(ret.v, vec4_load(a->v) * t);
+#else
 	for (int i = 0; i < 3; i++)
 		ret.v[i] = a->v[i] * t;
+#endif
+	return ret;
+}
+
+// Per component a < b ? a : b, and the other way round for pt3_max(), NaNs giving b.
+static inline pt3 pt3_min(const pt3 *a, const pt3 *b) {
+	pt3 ret;
+#if RAY_VEC4
+	vec4 va = vec4_load(a->v), vb = vec4_load(b->v);
+	vec4_mask lt = va < vb;
+	vec4_store(ret.v, (vec4)(((vec4_mask)va & lt) | ((vec4_mask)vb & ~lt)));
+#else
+	for (int i = 0; i < 3; i++)
+		ret.v[i] = a->v[i] < b->v[i] ? a->v[i] : b->v[i];
+#endif
+	return ret;
+}
+
+static inline pt3 pt3_max(const pt3 *a, const pt3 *b) {
+	pt3 ret;
+#if RAY_VEC4
+	vec4 va = vec4_load(a->v), vb = vec4_load(b->v);
+	vec4_mask gt = va > vb;
+	vec4_store(ret.v, (vec4)(((vec4_mask)va & gt) | ((vec4_mask)vb & ~gt)));
+#else
+	for (int i = 0; i < 3; i++)
+		ret.v[i] = a->v[i] > b->v[i] ? a->v[i] : b->v[i];
+#endif
 	return ret;
 }
 
 static inline pt4 pt4_mul(const pt4 *a, double t) {
 	pt4 ret;
+#if RAY_VEC4
+	vec4_store(ret.v, vec4_load(a->v) * t);
+#else
 	for (int i = 0; i < 4; i++)
 		ret.v[i] = a->v[i] * t;
+#endif
 	return ret;
 }
 
 static inline void pt4_add_mut(pt4 *a, const pt4 *b) {
+#if RAY_VEC4
+	vec4_store(a->v, vec4_load(a->v) + vec4_load(b->v));
+#else
 	for (int i = 0; i < 4; i++)
 		a->v[i] += b->v[i];
+#endif
 }
 
 static inline pt4 pt4_mul_ptwise(const pt4 *a, const pt4 *b) {
+#if RAY_VEC4
+	pt4 ret;
+	vec4_store(ret.v, vec4_load(a->v) * vec4_load(b->v));
+#else
 	pt4 ret = {{ a->v[0] * b->v[0], a->v[1] * b->v[1], a->v[2] * b->v[2], a->v[3] * b->v[3] }};
+#endif
 	return ret;
 }
 
@@ -169,18 +306,20 @@ typedef struct color {
 	double reflectance;
 } color;
 
+// Spheres and planes refer to their color by index into the context's material table, so records stay small
+// and scenes that reuse a few colors share them.
 typedef struct sphere {
-	color color;
 	pt3 position;
 	pt3 velocity;
 	double mass;
 	double radius;
+	uint32_t material;
 } sphere;
 
 typedef struct plane {
-	color color;
 	pt3 position;
 	pt3 normal;
+	uint32_t material;
 } plane;
 
 typedef struct light {
@@ -188,6 +327,16 @@ typedef struct light {
 	pt3 position;
 } light;
 
+// A placement of a mesh the context shares with any other instances of it, see ray_mesh.h. Rays are taken into
+// the mesh's space with to_local rather than the mesh being moved.
+typedef struct instance {
+	pt3 position;
+	mat3 to_world;		// rotation and scale, row major
+	mat3 to_local;		// its inverse
+	uint32_t mesh;		// index into the context's meshes
+	uint32_t material;
+} instance;
+
 typedef struct spherespec {
 	color *color;
 	pt3 *position;
@@ -236,6 +385,11 @@ typedef struct colorspecs {
 	colorspec *last;
 } colorspecs;
 
+struct physics_state;
+struct render_sphere;
+struct mesh;
+struct bvh;
+
 struct context {
 	int num_spheres;
 	int num_planes;
@@ -243,13 +397,31 @@ struct context {
 	sphere *spheres;	
 	plane *planes;
 	light *lights;
+	color *materials;	// deduplicated, indexed by sphere and plane material
+	int num_materials;
+	int spheres_cap;	// allocated lengths of the arrays above, see __CONTEXT_APPEND
+	int planes_cap;
+	int lights_cap;
+	int materials_cap;
+	const struct render_sphere *render_spheres;	// set by the renderer while it renders, see ray_render.h
+	struct mesh **meshes;	// each holds a reference, see mesh_release()
+	int num_meshes;
+	int meshes_cap;
+	instance *instances;
+	int num_instances;
+	int instances_cap;
+	struct bvh *instance_bvh;	// over the instances' bounds, see context_build_instances()
+	void *map;		// compiled scene the arrays live in, see scene_bin_load(); they can't be appended to
+	size_t map_size;
+	struct physics_state *physics;	// owned by ray_physics.c, see free_physics_state()
 };
 
+// Grows the array geometrically, so appending n elements copies O(n) of them in all. Arrays filled directly
+// with a zero cap are grown from their current length.
 #define __CONTEXT_APPEND(ctx, x, v)	do {					\
-	if (ctx->x == NULL) {							\
-		ctx->x = malloc(sizeof(*ctx->x));				\
-	} else {								\
-		ctx->x = realloc(ctx->x, sizeof(*ctx->x) * (ctx->num_##x + 1));		\
+	if (ctx->num_##x >= ctx->x##_cap) {					\
+		ctx->x##_cap = ctx->num_##x < 8 ? 16 : ctx->num_##x * 2;	\
+		ctx->x = realloc(ctx->x, sizeof(*ctx->x) * ctx->x##_cap);	\
 	}									\
 	ctx->x[ctx->num_##x++] = v;						\
 } while(0)
@@ -262,16 +434,27 @@ static inline void context_add_plane(struct context *ctx, plane s) {
 }
 static inline void context_add_light(struct context *ctx, light s) {
 	__CONTEXT_APPEND(ctx, lights, s);
-}	
+}
+static inline void context_add_instance(struct context *ctx, instance s) {
+	__CONTEXT_APPEND(ctx, instances, s);
+}
+// Appends without deduplicating, returning the new material's index; the parser uses scene_parser_intern().
+static inline uint32_t context_add_material(struct context *ctx, color c) {
+	__CONTEXT_APPEND(ctx, materials, c);
+	return ctx->num_materials - 1;
+}
 
-static inline void apply_planespec(plane* p, planespec *spec) {
-	if (spec->color != NULL) p->color = *spec->color;
+struct scene_parser;
+uint32_t scene_parser_intern(struct scene_parser *parser, struct context *ctx, const color *c);
+
+static inline void apply_planespec(struct scene_parser *parser, struct context *ctx, plane* p, planespec *spec) {
+	if (spec->color != NULL) p->material = scene_parser_intern(parser, ctx, spec->color);
 	if (spec->position != NULL) p->position = *spec->position;
 	if (spec->normal != NULL) p->normal = *spec->normal;
 }
 
-static inline void apply_spherespec(sphere* p, spherespec *spec) {
-	if (spec->color != NULL) p->color = *spec->color;
+static inline void apply_spherespec(struct scene_parser *parser, struct context *ctx, sphere* p, spherespec *spec) {
+	if (spec->color != NULL) p->material = scene_parser_intern(parser, ctx, spec->color);
 	if (spec->position != NULL) p->position = *spec->position;
 	if (spec->velocity != NULL) p->velocity = *spec->velocity;
 	if (spec->mass > 0) p->mass = spec->mass;
@@ -290,9 +473,9 @@ static inline void apply_colorspec(color* p, colorspec *spec) {
 
 #define append_ll(a, b)		do { if (a->first == NULL) { a->first = a->last = b; } else { a->last->next = b; a->last = b; b->next = NULL; } } while(0)
 #define prepend_ll(a, b)	do { if (a->first == NULL) { a->first = a->last = b; } else { b->next = a->first; a->first = b; } } while(0)
-#define FREE_LL(t, x)		do { struct t *p = x->first; while (p) { struct t *next = p->next; free_##t(p); p = next; } } while(0)
 
-#define CREATE_NEW_FN(x)	static inline struct x *new_##x() { struct x *p = malloc(sizeof(struct x)); memset(p, 0, sizeof(struct x)); return p; }
+// Parse nodes live in the parser's arena, see parse_scene().
+#define CREATE_NEW_FN(x)	static inline struct x *new_##x(struct arena *a) { return arena_alloc(a, sizeof(struct x)); }
 CREATE_NEW_FN(pt3)
 CREATE_NEW_FN(pt4)
 CREATE_NEW_FN(spherespec)
@@ -304,58 +487,139 @@ CREATE_NEW_FN(lightspecs)
 CREATE_NEW_FN(color)
 CREATE_NEW_FN(colorspec)
 CREATE_NEW_FN(colorspecs)
-CREATE_NEW_FN(context)
-
-static inline void free_pt3(pt3 *p) { free(p); }
-static inline void free_pt4(pt4 *p) { free(p); }
-static inline void free_color(color *p) { free(p); }
-static inline void free_spherespec(spherespec *p) {
-	if (p->color != NULL) free(p->color);
-	if (p->position != NULL) free(p->position);
-	if (p->velocity != NULL) free(p->velocity);
-	free(p);
-}
-static inline void free_planespec(planespec *p) {
-	if (p->color != NULL) free(p->color);
-	if (p->position != NULL) free(p->position);
-	if (p->normal != NULL) free(p->normal);
-	free(p);
-}
-static inline void free_lightspec(lightspec *p) {
-	if (p->color != NULL) free(p->color);
-	if (p->position != NULL) free(p->position);
-	free(p);
-}
-static inline void free_colorspec(colorspec *p) {
-	if (p->rgba != NULL) free(p->rgba);
-	free(p);
-}
-static inline void free_spherespecs(spherespecs *ps) {
-	FREE_LL(spherespec, ps);
-	free(ps);
-}
-static inline void free_planespecs(planespecs *ps) {
-	FREE_LL(planespec, ps);
-	free(ps);
-}
-static inline void free_lightspecs(lightspecs *ls) {
-	FREE_LL(lightspec, ls);
-	free(ls);
-}
-static inline void free_colorspecs(colorspecs *ps) {
-	FREE_LL(colorspec, ps);
-	free(ps);
-}
+
+void mesh_release(struct mesh *m);
+void free_bvh(struct bvh *b);
+
+static inline struct context *new_context() { return calloc(1, sizeof(struct context)); }
 static inline void free_context(struct context *ctx) {
+	for (int i = 0; i < ctx->num_meshes; i++)
+		mesh_release(ctx->meshes[i]);
+	free(ctx->meshes);
+	free(ctx->instances);
+	free_bvh(ctx->instance_bvh);
+	if (ctx->map) {
+		munmap(ctx->map, ctx->map_size);
+		free(ctx);
+		return;
+	}
+	if (ctx->materials) free(ctx->materials);
 	if (ctx->lights) free(ctx->lights);
 	if (ctx->planes) free(ctx->planes);
 	if (ctx->spheres) free(ctx->spheres);
 	free(ctx);
 }
 
+// Identifier token, pointing into the scanner's copy of the input.
+typedef struct ident {
+	const char *s;
+	int len;
+} ident;
+
+// Array lengths of a context at some point, so generators can repeat what their body added after it.
+struct scene_mark {
+	int num_spheres;
+	int num_planes;
+	int num_lights;
+	int num_instances;
+};
+
+static inline struct scene_mark context_mark(const struct context *ctx) {
+	struct scene_mark m = { ctx->num_spheres, ctx->num_planes, ctx->num_lights, ctx->num_instances };
+	return m;
+}
+
+// grid { count { nx ny nz } step { dx dy dz } items... }: the items repeated nx * ny * nz times, copy (x, y, z)
+// moved by (x * dx, y * dy, z * dz).
+struct grid_params {
+	pt3 count;
+	pt3 step;
+};
+
+// scatter { count n seed s min { x y z } max { x y z } items... }: the items repeated n times, each copy moved
+// by an offset drawn uniformly from the box, the same ones for the same seed.
+struct scatter_params {
+	double count;
+	double seed;
+	pt3 lo;
+	pt3 hi;
+};
+
+// Both expand in place everything added to ctx since from, returning an error message or NULL.
+const char *context_grid(struct context *ctx, const struct grid_params *g, const struct scene_mark *from);
+const char *context_scatter(struct context *ctx, const struct scatter_params *sc, const struct scene_mark *from);
+
+typedef struct named_material {
+	ident name;
+	color color;
+} named_material;
+
+typedef struct named_mesh {
+	ident name;
+	struct mesh *mesh;	// kept alive by the parse, see parse_scene()
+} named_mesh;
+
+// instance { mesh name pos { x y z } rotation { yaw pitch roll } scale s color... }, angles in degrees.
+struct instance_params {
+	ident mesh;
+	pt3 position;
+	pt3 rotation;
+	double scale;
+	const color *color;
+};
+
+struct include_pool;
+struct include_job;
+
+// An included file being parsed into its own context, to go in at the point the include was.
+struct pending_include {
+	struct scene_mark at;
+	struct include_job *job;
+};
+
+// Parse time state besides the context: the node arena, the materials and meshes named so far, and a hash of the
+// context's material table so each distinct color is stored once.
+struct scene_parser {
+	struct arena arena;
+	named_material *named;
+	int num_named;
+	int named_cap;
+	named_mesh *named_meshes;
+	int num_named_meshes;
+	int named_meshes_cap;
+	uint32_t *material_slots;	// material index + 1, 0 for free
+	uint32_t material_mask;
+	const char *path;		// of the file being parsed, includes are relative to it
+	const struct include_job *file;	// the same, with the chain of files including it
+	int include_depth;
+	int generator_depth;		// includes inside generators are parsed in place, see ray_parse.c
+	struct include_pool *pool;
+	struct pending_include *includes;
+	int num_includes;
+	int includes_cap;
+};
+
+const color *scene_parser_material(const struct scene_parser *p, ident name);
+int scene_parser_define_material(struct scene_parser *p, ident name, const color *c);
+
+int scene_parser_include(struct scene_parser *p, struct context *ctx, ident path);
+// mesh name "file": loads the file once per parse however many files name it, returning 0 on success.
+int scene_parser_define_mesh(struct scene_parser *p, ident name, ident path);
+struct mesh *scene_parser_mesh(const struct scene_parser *p, ident name);
+// Adds an instance of mesh, returning an error message or NULL.
+const char *scene_parser_instance(struct scene_parser *p, struct context *ctx, struct mesh *mesh,
+		const struct instance_params *params);
+
+// Parses a scene file into ctx, returning 0 on success; path is only used to find the files it includes, which
+// are parsed concurrently. Defined in ray_parse.c.
+int parse_scene(FILE *in, const char *path, struct context *ctx);
+// Threads parsing included files, the caller's included; 0 for one per core.
+void parse_set_threads(int n);
+
 // Hacks here because the lexer and parser are co-dependent for type definitions.
 #define YY_TYPEDEF_YY_SCANNER_T
 typedef void * yyscan_t;
+struct scanner_input;	// the scanner's extra data, see ray_scanner.c
 
 #endif	// RAY_AST_H_
 
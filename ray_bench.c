@@ -0,0 +1,991 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ray_bench.h"
+#include "ray_bmp.h"
+#include "ray_output.h"
+#include "ray_physics.h"
+#include "ray_physics_soa.h"
+#include "ray_render.h"
+#include "ray_mesh.h"
+#include "ray_scanner.h"
+#include "ray.yacc.generated_h"
+#include "ray.lex.generated_h"
+
+double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// n spheres of radius 0.5 to 1.5 scattered above a floor plane at about 5% volume fraction, so the number of
+// neighbours per sphere stays the same as n grows.
+struct context *bench_random_spheres(int n, unsigned seed) {
+	struct context *ctx = new_context();
+	double side = cbrt(n * (4.0 / 3.0 * M_PI) / 0.05);
+	unsigned short xsubi[3] = { seed, seed >> 16, 0x330e };
+	color c = { {{0.5, 0.5, 0.5, 1.0}}, 0.2 };
+	uint32_t m = context_add_material(ctx, c);
+
+	ctx->spheres = malloc(sizeof(*ctx->spheres) * n);
+	ctx->spheres_cap = n;
+	for (int i = 0; i < n; i++) {
+		sphere s = { .material = m };
+		s.radius = 0.5 + erand48(xsubi);
+		for (int k = 0; k < 3; k++) {
+			s.position.v[k] = erand48(xsubi) * side;
+			s.velocity.v[k] = erand48(xsubi) * 2 - 1;
+		}
+		s.position.v[1] += s.radius;
+		ctx->spheres[ctx->num_spheres++] = s;
+	}
+	plane floor = { {{0, 0, 0}}, {{0, 1, 0}}, m };
+	context_add_plane(ctx, floor);
+	return ctx;
+}
+
+struct context *bench_copy_context(const struct context *ctx) {
+	struct context *ret = new_context();
+	for (int i = 0; i < ctx->num_spheres; i++)
+		context_add_sphere(ret, ctx->spheres[i]);
+	for (int i = 0; i < ctx->num_planes; i++)
+		context_add_plane(ret, ctx->planes[i]);
+	for (int i = 0; i < ctx->num_lights; i++)
+		context_add_light(ret, ctx->lights[i]);
+	for (int i = 0; i < ctx->num_materials; i++)
+		context_add_material(ret, ctx->materials[i]);
+	return ret;
+}
+
+// Sphere records have padding after the material, which copies needn't preserve, so compare field by field.
+static int same_spheres(const sphere *a, const sphere *b, int n) {
+	for (int i = 0; i < n; i++)
+		if (memcmp(&a[i].position, &b[i].position, sizeof(a[i].position)) != 0 ||
+				memcmp(&a[i].velocity, &b[i].velocity, sizeof(a[i].velocity)) != 0 ||
+				memcmp(&a[i].mass, &b[i].mass, sizeof(a[i].mass)) != 0 ||
+				memcmp(&a[i].radius, &b[i].radius, sizeof(a[i].radius)) != 0 || a[i].material != b[i].material)
+			return 0;
+	return 1;
+}
+
+static void free_bench_context(struct context *ctx) {
+	free_physics_state(ctx);
+	free_context(ctx);
+}
+
+// Times one physics step against sphere count, comparing with the brute force pair loop where that is feasible.
+static int bench_physics(int argc, char **argv) {
+	int max_n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int max_brute_n = 10000;
+
+	printf("%10s %14s %14s %10s\n", "spheres", "grid ms/step", "brute ms/step", "identical");
+	for (int n = 100; n <= max_n; n *= 10) {
+		struct context *start = bench_random_spheres(n, n);
+		struct context *grid = bench_copy_context(start);
+		int steps = n <= 10000 ? 10 : 3;
+
+		double t0 = bench_now();
+		for (int s = 0; s < steps; s++) {
+			calc_velocities(grid);
+			update_positions(grid);
+		}
+		double grid_ms = (bench_now() - t0) * 1000 / steps;
+
+		if (n > max_brute_n) {
+			printf("%10d %14.3f %14s %10s\n", n, grid_ms, "-", "-");
+		} else {
+			struct context *brute = bench_copy_context(start);
+			t0 = bench_now();
+			for (int s = 0; s < steps; s++) {
+				calc_velocities_bruteforce(brute);
+				update_positions(brute);
+			}
+			double brute_ms = (bench_now() - t0) * 1000 / steps;
+			physics_sync_spheres(grid);
+			physics_sync_spheres(brute);
+			int same = same_spheres(grid->spheres, brute->spheres, n);
+			printf("%10d %14.3f %14.3f %10s\n", n, grid_ms, brute_ms, same ? "yes" : "NO");
+			free_bench_context(brute);
+		}
+		free_bench_context(grid);
+		free_bench_context(start);
+	}
+	return 0;
+}
+
+// Times the physics step for 1 thread up to max threads, checking every thread count gives the same spheres.
+static int bench_physics_threads(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+	int steps = 5;
+	struct context *start = bench_random_spheres(n, n);
+	struct context *first = NULL;
+
+	printf("%8s %10s %10s\n", "threads", "ms/step", "identical");
+	for (int t = 1; t <= max_threads; t++) {
+		struct context *ctx = bench_copy_context(start);
+		physics_set_threads(ctx, t);
+		double t0 = bench_now();
+		for (int s = 0; s < steps; s++) {
+			calc_velocities(ctx);
+			update_positions(ctx);
+		}
+		double ms = (bench_now() - t0) * 1000 / steps;
+		physics_sync_spheres(ctx);
+		if (first == NULL) {
+			first = ctx;
+			printf("%8d %10.3f %10s\n", t, ms, "-");
+			continue;
+		}
+		int same = same_spheres(first->spheres, ctx->spheres, n);
+		printf("%8d %10.3f %10s\n", t, ms, same ? "yes" : "NO");
+		free_bench_context(ctx);
+	}
+	if (first)
+		free_bench_context(first);
+	free_bench_context(start);
+	return 0;
+}
+
+// A settling shot: nine in ten spheres already rest on the floor on a grid, slowly rolling, while the rest
+// rain down onto them. Times the steps with and without sleeping.
+static int bench_physics_sleep(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 10000;
+	int steps = argc > 2 ? atoi(argv[2]) : 200;
+	double threshold = argc > 3 ? atof(argv[3]) : 1.0;
+	struct context *start = bench_random_spheres(n, n);
+	int k = 1;
+	while (k * k < n)
+		k++;
+	for (int i = 0; i < n; i++) {
+		sphere *s = &start->spheres[i];
+		if (i % 10 == 0) {
+			s->position.v[0] = fmod(s->position.v[0], k * 3.5);
+			s->position.v[1] = 10 + fmod(s->position.v[1], 50);
+			s->position.v[2] = fmod(s->position.v[2], k * 3.5);
+			continue;
+		}
+		s->position = (pt3){{ (i % k) * 3.5, s->radius, (i / k) * 3.5 }};
+		s->velocity = pt3_mul(&s->velocity, 0.05);
+		s->velocity.v[1] = 0;
+	}
+
+	printf("%8s %14s %14s %10s\n", "step", "ms/step", "sleep ms/step", "awake");
+	struct context *plain = bench_copy_context(start);
+	struct context *sleepy = bench_copy_context(start);
+	physics_set_sleep(sleepy, threshold, 10);
+	double plain_total = 0, sleepy_total = 0;
+	for (int s = 1; s <= steps; s++) {
+		double t0 = bench_now();
+		calc_velocities(plain);
+		update_positions(plain);
+		double t1 = bench_now();
+		calc_velocities(sleepy);
+		update_positions(sleepy);
+		double t2 = bench_now();
+		plain_total += t1 - t0;
+		sleepy_total += t2 - t1;
+		if (s % (steps / 10 > 0 ? steps / 10 : 1) == 0)
+			printf("%8d %14.3f %14.3f %10d\n", s, (t1 - t0) * 1000, (t2 - t1) * 1000, physics_awake_count(sleepy));
+	}
+	printf("%8s %14.3f %14.3f\n", "mean", plain_total * 1000 / steps, sleepy_total * 1000 / steps);
+	free_bench_context(plain);
+	free_bench_context(sleepy);
+	free_bench_context(start);
+	return 0;
+}
+
+// Projectiles dropped fast onto spheres resting on the floor, one above each. Counts the projectiles that get
+// below their target at some step, so passed through it, with and without substepping.
+static int bench_physics_ccd(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000;
+	double speed = argc > 2 ? atof(argv[2]) : 100;
+	int steps = argc > 3 ? atoi(argv[3]) : 50;
+	int k = 1;
+	while (k * k < n)
+		k++;
+	struct context *start = new_context();
+	unsigned short xsubi[3] = { 1, 2, 0x330e };
+	color c = { {{0.5, 0.5, 0.5, 1.0}}, 0.2 };
+	uint32_t grey = context_add_material(start, c);
+	for (int i = 0; i < n; i++) {
+		double x = (i % k) * 4.0, z = (i / k) * 4.0;
+		sphere target = { .material = grey, .position = {{ x, 1.0, z }}, .radius = 1.0 };
+		sphere bullet = { .material = grey, .position = {{ x, 20.0 + erand48(xsubi) * 10, z }}, .velocity = {{ 0, -speed, 0 }}, .radius = 0.5 };
+		context_add_sphere(start, target);
+		context_add_sphere(start, bullet);
+	}
+	plane floor = { {{0, 0, 0}}, {{0, 1, 0}}, grey };
+	context_add_plane(start, floor);
+
+	printf("%10s %10s %12s %14s\n", "substeps", "ms/step", "tunnelled", "impacts/step");
+	int substeps[] = { 0, 2, 4, 8, 16 };
+	for (size_t m = 0; m < sizeof(substeps) / sizeof(substeps[0]); m++) {
+		struct context *ctx = bench_copy_context(start);
+		physics_set_substeps(ctx, substeps[m]);
+		unsigned char *through = calloc(n, 1);
+		long impacts = 0;
+		double elapsed = 0;
+		for (int s = 0; s < steps; s++) {
+			double t0 = bench_now();
+			calc_velocities(ctx);
+			update_positions(ctx);
+			elapsed += bench_now() - t0;
+			impacts += physics_impact_count(ctx);
+			physics_sync_spheres(ctx);
+			for (int i = 0; i < n; i++)
+				through[i] |= ctx->spheres[2 * i + 1].position.v[1] < ctx->spheres[2 * i].position.v[1];
+		}
+		double ms = elapsed * 1000 / steps;
+		int tunnelled = 0;
+		for (int i = 0; i < n; i++)
+			tunnelled += through[i];
+		free(through);
+		printf("%10d %10.3f %12d %14.1f\n", substeps[m], ms, tunnelled, (double)impacts / steps);
+		free_bench_context(ctx);
+	}
+	free_bench_context(start);
+	return 0;
+}
+
+// Steps spheres through calc_velocities() and update_positions(), and through step_physics(), which moves them in
+// the plane pass, checking both give the same spheres.
+static int bench_physics_fused(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int steps = argc > 2 ? atoi(argv[2]) : 5;
+	struct context *start = bench_random_spheres(n, n);
+	const char *names[2] = { "separate", "fused" };
+	struct context *ctxs[2];
+	double velocities = 0, positions = 0, total[2] = {0};
+	for (int v = 0; v < 2; v++)
+		ctxs[v] = bench_copy_context(start);
+
+	for (int s = 0; s < steps; s++) {
+		for (int v = 0; v < 2; v++) {
+			double t0 = bench_now();
+			if (v == 1) {
+				step_physics(ctxs[v]);
+			} else {
+				calc_velocities(ctxs[v]);
+				double t1 = bench_now();
+				update_positions(ctxs[v]);
+				velocities += t1 - t0;
+				positions += bench_now() - t1;
+			}
+			total[v] += bench_now() - t0;
+		}
+	}
+
+	for (int v = 0; v < 2; v++)
+		physics_sync_spheres(ctxs[v]);
+	printf("%d spheres\n", n);
+	printf("%10s %16s %16s %12s %10s\n", "", "velocities ms", "positions ms", "step ms", "identical");
+	printf("%10s %16.3f %16.3f %12.3f %10s\n", names[0], velocities * 1000 / steps, positions * 1000 / steps,
+			total[0] * 1000 / steps, "-");
+	printf("%10s %16s %16s %12.3f %10s\n", names[1], "-", "-", total[1] * 1000 / steps,
+			same_spheres(ctxs[0]->spheres, ctxs[1]->spheres, n) ? "yes" : "NO");
+	for (int v = 0; v < 2; v++)
+		free_bench_context(ctxs[v]);
+	free_bench_context(start);
+	return 0;
+}
+
+// What the per-sphere passes did on the sphere records before the physics kept its own arrays: integration, and
+// the plane pass (collide_planes()), with the step's integration fused into it or not.
+static void records_pass(sphere *spheres, int n, const struct context *scene, int planes, int integrate) {
+	const pt3 gravity = {{0, -9.8 / 25, 0}};	// as in ray_physics.c
+	const double position_step = 1.0 / 24.0;
+	for (int i = 0; i < n; i++) {
+		sphere *si = &spheres[i];
+		for (int j = 0; planes && j < scene->num_planes; j++) {
+			const plane *p = &scene->planes[j];
+			if (intersect_sphere_plane(si, p)) {
+				double d = pt3_dot(&si->velocity, &p->normal);
+				if (d < 0)
+					si->velocity = pt3_addv(si->velocity, pt3_mul(&p->normal, -1.99 * d));
+			} else {
+				si->velocity = pt3_addv(si->velocity, gravity);
+			}
+		}
+		if (integrate)
+			si->position = pt3_addv(si->position, pt3_mul(&si->velocity, position_step));
+	}
+}
+
+// The same passes through the physics' kernels on its structure of arrays, scalar or AVX2.
+static void soa_pass(struct sphere_soa *soa, const struct context *scene, int planes, int integrate) {
+	const pt3 gravity = {{0, -9.8 / 25, 0}};
+	const double position_step = 1.0 / 24.0;
+	if (planes && integrate)
+		soa_collide_planes_integrate(soa, 0, soa->n, scene->planes, scene->num_planes, &gravity, position_step);
+	else if (planes)
+		soa_collide_planes(soa, 0, soa->n, scene->planes, scene->num_planes, &gravity);
+	else
+		soa_integrate(soa, 0, soa->n, position_step);
+}
+
+// The per-sphere passes of a physics step on the sphere records, as they were, and on the physics' structure of
+// arrays with the scalar and the AVX2 kernels, checking all give the same spheres. Integration either runs as a
+// pass of its own, as update_positions() does, or rides along the plane pass, as in step_physics(). Each time is
+// the best of steps + 1 passes.
+static int bench_physics_soa(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int steps = argc > 2 ? atoi(argv[2]) : 20;
+	struct context *start = bench_random_spheres(n, n);
+	const char *pass_names[3] = { "integration", "planes", "planes+integration" };
+	const int pass_planes[3] = { 0, 1, 1 }, pass_integrate[3] = { 1, 0, 1 };
+	int bad = 0;
+
+	printf("%d spheres, best of %d passes each, AVX2 %s\n", n, steps + 1, soa_have_avx2() ? "available" : "not available");
+	printf("%20s %12s %12s %12s %10s %10s\n", "pass", "records ms", "scalar ms", "avx2 ms", "speedup", "identical");
+	double ms[3][3];
+	for (int p = 0; p < 3; p++) {
+		struct context *records = bench_copy_context(start);
+		ms[p][0] = 1e300;
+		for (int s = 0; s < steps + 1; s++) {
+			double t0 = bench_now();
+			records_pass(records->spheres, n, start, pass_planes[p], pass_integrate[p]);
+			ms[p][0] = fmin(ms[p][0], (bench_now() - t0) * 1000);
+		}
+
+		int same = 1;
+		for (int k = 0; k < 2; k++) {
+			soa_use_avx2(k);
+			struct sphere_soa soa = {0};
+			sphere_soa_load(&soa, start->spheres, n);
+			ms[p][k + 1] = 1e300;
+			for (int s = 0; s < steps + 1; s++) {
+				double t0 = bench_now();
+				soa_pass(&soa, start, pass_planes[p], pass_integrate[p]);
+				ms[p][k + 1] = fmin(ms[p][k + 1], (bench_now() - t0) * 1000);
+			}
+			sphere *out = malloc(sizeof(*out) * n);
+			sphere_soa_store(&soa, start->spheres, out);
+			same &= same_spheres(out, records->spheres, n);
+			free(out);
+			sphere_soa_free(&soa);
+		}
+		soa_use_avx2(1);
+		bad |= !same;
+		printf("%20s %12.3f %12.3f %12.3f %10.2f %10s\n", pass_names[p], ms[p][0], ms[p][1], ms[p][2],
+				ms[p][0] / ms[p][2], same ? "yes" : "NO");
+		free_bench_context(records);
+	}
+	// before the arrays a step ran the plane pass and a separate integration pass over the records; now
+	// step_physics() runs one pass over the arrays doing both
+	printf("per-sphere passes of a step: %.3f ms on the records, %.3f ms fused on the arrays (%.2fx)\n",
+			ms[1][0] + ms[0][0], ms[2][2], (ms[1][0] + ms[0][0]) / ms[2][2]);
+	free_bench_context(start);
+	return bad;
+}
+
+// Spheres from to to of gen as sphere blocks, as a hand written scene would have them.
+static void write_scene_spheres(FILE *f, const struct context *gen, int from, int to) {
+	for (int i = from; i < to; i++) {
+		const sphere *s = &gen->spheres[i];
+		const color *c = &gen->materials[s->material];
+		fprintf(f, "sphere {\n\tcolor {\n\t\trgba { %.6f %.6f %.6f %.6f }\n\t\treflectance %.6f\n\t}\n"
+				"\tpos { %.6f %.6f %.6f }\n\tvelocity { %.6f %.6f %.6f }\n\tradius %.6f\n}\n",
+				c->rgba.v[0], c->rgba.v[1], c->rgba.v[2], c->rgba.v[3], c->reflectance,
+				s->position.v[0], s->position.v[1], s->position.v[2],
+				s->velocity.v[0], s->velocity.v[1], s->velocity.v[2], s->radius);
+	}
+}
+
+// n random spheres in a scene file. The file is already unlinked and rewound; NULL if it can't be made.
+static FILE *bench_scene_file(int n, long *bytes) {
+	char path[] = "/tmp/ray-bench-scene-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return NULL;
+	}
+	unlink(path);
+	FILE *f = fdopen(fd, "w+");
+	struct context *gen = bench_random_spheres(n, n);
+	fprintf(f, "light {\n\tcolor { rgba { 1 1 1 1 } }\n\tpos { 0 100 0 }\n}\n");
+	write_scene_spheres(f, gen, 0, n);
+	fflush(f);
+	*bytes = ftell(f);
+	rewind(f);
+	free_bench_context(gen);
+	return f;
+}
+
+// Times parsing a generated scene file.
+static int bench_scene_load(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	long bytes;
+	FILE *f = bench_scene_file(n, &bytes);
+	if (f == NULL)
+		return 1;
+
+	struct context *ctx = new_context();
+	double t0 = bench_now();
+	int ret = parse_scene(f, NULL, ctx);
+	double elapsed = bench_now() - t0;
+	fclose(f);
+	printf("%d spheres, %.1f MB scene\n", n, bytes / 1e6);
+	printf("%10s %12s %14s %10s\n", "load s", "MB/s", "spheres/s", "parsed");
+	printf("%10.3f %12.1f %14.0f %10d\n", elapsed, bytes / 1e6 / elapsed, n / elapsed, ctx->num_spheres);
+	if (ret != 0 || ctx->num_spheres != n)
+		fprintf(stderr, "scene did not parse back to %d spheres\n", n);
+	int bad = ret != 0 || ctx->num_spheres != n;
+	free_context(ctx);
+	return bad;
+}
+
+// n random spheres split over a number of files included by one main file, parsed with more and more threads.
+// The result has to be the same every time.
+static int bench_scene_include(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int chunks = argc > 2 ? atoi(argv[2]) : 16;
+	if (chunks < 1)
+		chunks = 1;
+	char dir[] = "/tmp/ray-bench-include-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char path[sizeof(dir) + 32];
+	struct context *gen = bench_random_spheres(n, n);
+	snprintf(path, sizeof(path), "%s/main.txt", dir);
+	FILE *main_file = fopen(path, "w");
+	fprintf(main_file, "light {\n\tcolor { rgba { 1 1 1 1 } }\n\tpos { 0 100 0 }\n}\n");
+	long bytes = 0;
+	for (int c = 0; c < chunks; c++) {
+		fprintf(main_file, "include \"part%d.txt\"\n", c);
+		snprintf(path, sizeof(path), "%s/part%d.txt", dir, c);
+		FILE *f = fopen(path, "w");
+		write_scene_spheres(f, gen, (long)n * c / chunks, (long)n * (c + 1) / chunks);
+		bytes += ftell(f);
+		fclose(f);
+	}
+	fclose(main_file);
+	free_bench_context(gen);
+
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	printf("%d spheres in %d files, %.1f MB, %d cores\n", n, chunks, bytes / 1e6, cores);
+	printf("%10s %10s %12s %10s %10s\n", "threads", "load s", "MB/s", "speedup", "identical");
+	snprintf(path, sizeof(path), "%s/main.txt", dir);
+	struct context *first = NULL;
+	double base = 0;
+	int bad = 0;
+	for (int threads = 1; threads <= (cores > 2 ? cores : 2); threads *= 2) {
+		parse_set_threads(threads);
+		struct context *ctx = new_context();
+		FILE *f = fopen(path, "r");
+		double t0 = bench_now();
+		int ret = parse_scene(f, path, ctx);
+		double elapsed = bench_now() - t0;
+		fclose(f);
+		if (first == NULL)
+			base = elapsed;
+		int same = ret == 0 && ctx->num_spheres == n && (first == NULL || (ctx->num_materials == first->num_materials
+				&& memcmp(ctx->materials, first->materials, sizeof(color) * ctx->num_materials) == 0
+				&& same_spheres(ctx->spheres, first->spheres, n)));
+		bad |= !same;
+		printf("%10d %10.3f %12.1f %10.2f %10s\n", threads, elapsed, bytes / 1e6 / elapsed, base / elapsed,
+				first == NULL && same ? "-" : same ? "yes" : "NO");
+		if (first == NULL)
+			first = ctx;
+		else
+			free_context(ctx);
+	}
+	parse_set_threads(0);
+	free_context(first);
+
+	for (int c = 0; c < chunks; c++) {
+		snprintf(path, sizeof(path), "%s/part%d.txt", dir, c);
+		unlink(path);
+	}
+	snprintf(path, sizeof(path), "%s/main.txt", dir);
+	unlink(path);
+	rmdir(dir);
+	return bad;
+}
+
+static int same_file_contents(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	int same = fa != NULL && fb != NULL;
+	while (same) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		same = ca == cb;
+		if (ca == EOF)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return same;
+}
+
+// Renders frames into a prefix twice, first frames that look alike, so all but the first are written as copies
+// of the one before, then frames that all differ. Every file must then hold its frame of the second run.
+static int bench_output_rerender(int argc, char **argv) {
+	enum { width = 16, height = 8, frames = 3 };
+	char dir[] = "/tmp/ray-bench-rerender-XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	char prefix[sizeof(dir) + 16], path[sizeof(dir) + 32], expect[sizeof(dir) + 32];
+	snprintf(prefix, sizeof(prefix), "%s/frame", dir);
+	snprintf(expect, sizeof(expect), "%s/expect.bmp", dir);
+	struct framebuffer_pt4 *fb[frames];
+	for (int f = 0; f < frames; f++) {
+		fb[f] = new_framebuffer_pt4(width, height);
+		for (int i = 0; i < width * height; i++)
+			fb[f]->pixels[i] = (pt4){{ 0.25 * (f + 1), 0.5, 0.75, 1 }};
+	}
+
+	struct output_options opts = { OUTPUT_BMP, prefix, width, height, frames, 25, 0 };
+	struct output *out = output_open(&opts);
+	output_write_frame(out, 0, fb[0], NULL);
+	for (int f = 1; f < frames; f++)
+		output_repeat_frame(out, f);
+	output_close(out);
+	out = output_open(&opts);
+	for (int f = 0; f < frames; f++)
+		output_write_frame(out, f, fb[f], NULL);
+
+	printf("%10s %10s\n", "frame", "correct");
+	int bad = 0;
+	for (int f = 0; f < frames; f++) {
+		output_frame_path(out, f, path, sizeof(path));
+		render_bmp(fb[f], expect);
+		int same = same_file_contents(path, expect);
+		bad |= !same;
+		printf("%10d %10s\n", f, same ? "yes" : "NO");
+		unlink(path);
+		free_framebuffer_pt4(fb[f]);
+	}
+	output_close(out);
+	unlink(expect);
+	rmdir(dir);
+	return bad;
+}
+
+// Traces a small image of n random spheres through the packed render records and through the full sphere records,
+// which is what every ray did before there were render records. Hardware cache counters aren't available to us
+// everywhere, so this reports what each layout makes a ray read along with the time it takes.
+static int bench_render_spheres(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	int size = argc > 2 ? atoi(argv[2]) : 16;
+	struct context *ctx = bench_random_spheres(n, n);
+	double side = cbrt(n * (4.0 / 3.0 * M_PI) / 0.05);	// as bench_random_spheres() scatters them
+	light l = { { {{1.0, 1.0, 1.0, 1.0}}, 0 }, {{ 0, 1000, 0 }} };
+	context_add_light(ctx, l);
+	struct render_sphere *records = malloc(sizeof(*records) * n);
+	for (int i = 0; i < n; i++) {
+		records[i].position = ctx->spheres[i].position;
+		records[i].radius = ctx->spheres[i].radius;
+	}
+
+	const char *names[2] = { "sphere", "render" };
+	size_t bytes[2] = { sizeof(sphere), sizeof(struct render_sphere) };
+	pt4 *pixels[2];
+	double elapsed[2];
+	for (int v = 0; v < 2; v++) {
+		struct context view = *ctx;
+		view.render_spheres = v ? records : NULL;
+		pixels[v] = calloc(size * size, sizeof(pt4));
+		double t0 = bench_now();
+		for (int y = 0; y < size; y++) {
+			for (int x = 0; x < size; x++) {
+				pt3 direction = {{ (x - size / 2) * 0.02, (y - size / 2) * 0.02, 1 }};
+				pt3_normalize_mut(&direction);
+				ray r = { {{ side / 2, side / 2, -20 }}, direction };
+				raytrace(&view, &r, &pixels[v][y * size + x], 3);
+			}
+		}
+		elapsed[v] = bench_now() - t0;
+	}
+
+	printf("%d spheres, %d rays from the camera, %d materials\n", n, size * size, ctx->num_materials);
+	printf("%10s %14s %16s %12s %10s\n", "records", "bytes/sphere", "MB read/scan", "us/ray", "identical");
+	for (int v = 0; v < 2; v++)
+		printf("%10s %14zu %16.1f %12.1f %10s\n", names[v], bytes[v], bytes[v] * (double)n / 1e6,
+				elapsed[v] * 1e6 / (size * size), v == 0 ? "-" :
+				memcmp(pixels[0], pixels[1], sizeof(pt4) * size * size) == 0 ? "yes" : "NO");
+	free(pixels[0]);
+	free(pixels[1]);
+	free(records);
+	free_bench_context(ctx);
+	return 0;
+}
+
+// Seconds to trace a size x size frame from where the renderer's camera is, through kernel or, if NULL, raytrace().
+static double bench_trace_frame(const struct context *ctx, raytrace_kernel kernel, pt4 *pixels, int size) {
+	memset(pixels, 0, sizeof(pt4) * size * size);
+	double t0 = bench_now();
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			pt3 direction = {{ (x - size / 2) * 1.0 / size, (size / 2 - y) * 1.0 / size, 1 }};
+			pt3_normalize_mut(&direction);
+			ray r = { {{ 0, 0, -20 }}, direction };
+			if (kernel)
+				kernel(ctx, &r, &pixels[y * size + x]);
+			else
+				raytrace(ctx, &r, &pixels[y * size + x], RENDER_DEPTH);
+		}
+	}
+	return bench_now() - t0;
+}
+
+// Renders scene files through the generic raytrace() and through the kernel the renderer picks for each, which
+// must give the same pixels.
+static int bench_render_kernels(int argc, char **argv) {
+	const char *defaults[] = { "scene1.txt", "scene_plane_sphere.txt" };
+	int num_scenes = argc > 1 ? argc - 1 : 2;
+	const char *const *paths = argc > 1 ? (const char *const *)argv + 1 : defaults;
+	int size = 256;
+	int bad = 0;
+	printf("%d x %d camera rays, depth %d\n", size, size, RENDER_DEPTH);
+	printf("%24s %16s %12s %12s %10s %10s\n", "scene", "kernel", "generic ms", "kernel ms", "speedup", "identical");
+	for (int n = 0; n < num_scenes; n++) {
+		FILE *f = fopen(paths[n], "r");
+		struct context *ctx = new_context();
+		if (f == NULL || parse_scene(f, paths[n], ctx) != 0) {
+			fprintf(stderr, "can't load scene '%s'\n", paths[n]);
+			if (f)
+				fclose(f);
+			free_context(ctx);
+			bad = 1;
+			continue;
+		}
+		fclose(f);
+		raytrace_kernel kernel = raytrace_kernel_for(ctx);
+		pt4 *pixels[2] = { malloc(sizeof(pt4) * size * size), malloc(sizeof(pt4) * size * size) };
+		double elapsed[2] = { INFINITY, INFINITY };
+		// Best of a few alternating rounds, the frames being short.
+		for (int round = 0; round < 10; round++)
+			for (int v = 0; v < 2; v++)
+				elapsed[v] = fmin(elapsed[v], bench_trace_frame(ctx, v ? kernel : NULL, pixels[v], size));
+		int same = memcmp(pixels[0], pixels[1], sizeof(pt4) * size * size) == 0;
+		bad |= !same;
+		printf("%24s %16s %12.1f %12.1f %10.2f %10s\n", paths[n], raytrace_kernel_name(ctx), elapsed[0] * 1000,
+				elapsed[1] * 1000, elapsed[0] / elapsed[1], same ? "yes" : "NO");
+		free(pixels[0]);
+		free(pixels[1]);
+		free_context(ctx);
+	}
+	return bad;
+}
+
+// Converts a sweep of pixel values, out of range ones included, to BMP bytes with set isa, which must give what
+// the baseline gives.
+static int bench_convert_sweep(enum render_isa isa) {
+	int width = 1021;	// not a multiple of the four pixels the converters take at a time
+	struct framebuffer_pt4 *fb = new_framebuffer_pt4(width, 1);
+	for (int i = 0; i < 4 * width; i++)
+		fb->pixels[i / 4].v[i % 4] = -0.5 + 2.0 * i / (4 * width);
+	const double special[] = { -0.0, 1.0, nextafter(1.0, 0.0), 1 / 255.0, INFINITY, -INFINITY, 1e300, -1e300 };
+	for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++)
+		fb->pixels[i / 4].v[i % 4] = special[i];
+	uint8_t *rows[2] = { malloc(bmp_row_size(width)), malloc(bmp_row_size(width)) };
+	render_set_isa(RENDER_ISA_SSE2);
+	bmp_convert_row(fb, 0, rows[0]);
+	render_set_isa(isa);
+	bmp_convert_row(fb, 0, rows[1]);
+	int same = memcmp(rows[0], rows[1], bmp_row_size(width)) == 0;
+	free(rows[0]);
+	free(rows[1]);
+	free_framebuffer_pt4(fb);
+	return same;
+}
+
+// Self-test of the instruction set dispatch: renders scene files through render_scene() and converts them to
+// BMP rows with every set the CPU has, which must all give the same bytes and pixels, and times the renders.
+static int bench_render_isa(int argc, char **argv) {
+	const char *defaults[] = { "scene1.txt", "scene_plane_sphere.txt" };
+	int num_scenes = argc > 1 ? argc - 1 : 2;
+	const char *const *paths = argc > 1 ? (const char *const *)argv + 1 : defaults;
+	int width = 253, height = 190;
+	size_t image_bytes = (size_t)bmp_row_size(width) * height;
+	enum render_isa best = render_active_isa();
+	int bad = 0;
+
+	printf("%14s %12s\n", "isa", "conversion");
+	for (int isa = 0; isa < RENDER_ISA_COUNT; isa++) {
+		if (!render_isa_supported(isa)) {
+			printf("%14s %12s\n", render_isa_name(isa), "unsupported");
+			continue;
+		}
+		int same = bench_convert_sweep(isa);
+		bad |= !same;
+		printf("%14s %12s\n", render_isa_name(isa), same ? "identical" : "DIFFERENT");
+	}
+
+	printf("\n%d x %d frame, one thread\n", width, height);
+	printf("%24s %8s %10s %10s %10s\n", "scene", "isa", "ms", "speedup", "identical");
+	for (int n = 0; n < num_scenes; n++) {
+		FILE *f = fopen(paths[n], "r");
+		struct context *ctx = new_context();
+		if (f == NULL || parse_scene(f, paths[n], ctx) != 0) {
+			fprintf(stderr, "can't load scene '%s'\n", paths[n]);
+			if (f)
+				fclose(f);
+			free_context(ctx);
+			bad = 1;
+			continue;
+		}
+		fclose(f);
+		struct framebuffer_pt4 *fb[RENDER_ISA_COUNT] = {0};
+		uint8_t *image[RENDER_ISA_COUNT] = {0};
+		double elapsed[RENDER_ISA_COUNT];
+		for (int isa = 0; isa < RENDER_ISA_COUNT; isa++) {
+			elapsed[isa] = INFINITY;
+			if (render_isa_supported(isa)) {
+				fb[isa] = new_framebuffer_pt4(width, height);
+				image[isa] = malloc(image_bytes);
+			}
+		}
+		// Best of a few alternating rounds, the frames being short.
+		for (int round = 0; round < 5; round++) {
+			for (int isa = 0; isa < RENDER_ISA_COUNT; isa++) {
+				if (!fb[isa])
+					continue;
+				render_set_isa(isa);
+				double t0 = bench_now();
+				render_scene(fb[isa], ctx, NULL, 1);
+				elapsed[isa] = fmin(elapsed[isa], bench_now() - t0);
+			}
+		}
+		for (int isa = 0; isa < RENDER_ISA_COUNT; isa++) {
+			if (!fb[isa])
+				continue;
+			render_set_isa(isa);
+			for (int y = 0; y < height; y++)
+				bmp_convert_row(fb[isa], y, image[isa] + (size_t)bmp_row_size(width) * y);
+			int same = memcmp(fb[isa]->pixels, fb[0]->pixels, sizeof(pt4) * width * height) == 0 &&
+					memcmp(image[isa], image[0], image_bytes) == 0;
+			bad |= !same;
+			printf("%24s %8s %10.1f %10.2f %10s\n", paths[n], render_isa_name(isa), elapsed[isa] * 1000,
+					elapsed[0] / elapsed[isa], same ? "yes" : "NO");
+		}
+		for (int isa = 0; isa < RENDER_ISA_COUNT; isa++) {
+			if (fb[isa])
+				free_framebuffer_pt4(fb[isa]);
+			free(image[isa]);
+		}
+		free_context(ctx);
+	}
+	render_set_isa(best);
+	return bad;
+}
+
+// A sphere of radius 1 cut into about n triangles.
+static struct mesh *bench_sphere_mesh(int n) {
+	int slices = sqrt(n / 2.0);
+	if (slices < 3)
+		slices = 3;
+	int stacks = slices, row = slices + 1;
+	float *vertices = malloc(sizeof(float) * 3 * (stacks + 1) * row);
+	uint32_t *indices = malloc(sizeof(uint32_t) * 6 * stacks * slices);
+	for (int i = 0; i <= stacks; i++) {
+		for (int j = 0; j <= slices; j++) {
+			double theta = M_PI * i / stacks, phi = 2 * M_PI * j / slices;
+			float *v = &vertices[3 * (i * row + j)];
+			v[0] = sin(theta) * cos(phi);
+			v[1] = cos(theta);
+			v[2] = sin(theta) * sin(phi);
+		}
+	}
+	for (int i = 0; i < stacks; i++) {
+		for (int j = 0; j < slices; j++) {
+			uint32_t a = i * row + j, b = a + row, *t = &indices[6 * (i * slices + j)];
+			t[0] = a, t[1] = b, t[2] = a + 1;
+			t[3] = a + 1, t[4] = b, t[5] = b + 1;
+		}
+	}
+	struct mesh *m = mesh_build(vertices, (stacks + 1) * row, indices, 2 * stacks * slices);
+	free(vertices);
+	free(indices);
+	return m;
+}
+
+// One mesh placed many times, reporting what the instances cost in memory against copying the mesh for each,
+// and rays per second through the two levels of trees. Every few rays are checked against walking every
+// instance's tree, which must find the same hit.
+static int bench_render_instances(int argc, char **argv) {
+	int triangles = argc > 1 ? atoi(argv[1]) : 1000000;
+	int count = argc > 2 ? atoi(argv[2]) : 1000;
+	int size = argc > 3 ? atoi(argv[3]) : 64;
+	double t0 = bench_now();
+	struct mesh *m = bench_sphere_mesh(triangles);
+	double mesh_build_time = bench_now() - t0;
+
+	struct context *ctx = new_context();
+	color grey = { {{0.6, 0.6, 0.6, 1.0}}, 0.3 };
+	uint32_t material = context_add_material(ctx, grey);
+	light l = { { {{1.0, 1.0, 1.0, 1.0}}, 0 }, {{ 0, 1000, -1000 }} };
+	context_add_light(ctx, l);
+	int side = ceil(cbrt(count));
+	for (int i = 0; i < count; i++) {
+		pt3 position = {{ i % side * 3.0, i / side % side * 3.0, i / side / side * 3.0 }};
+		pt3 angles = {{ i * 0.7, i * 0.3, i * 0.1 }};
+		context_add_instance(ctx, make_instance(&position, &angles, 0.8 + 0.1 * (i % 5), context_use_mesh(ctx, m),
+				material));
+	}
+	mesh_release(m);
+	t0 = bench_now();
+	context_build_instances(ctx);
+	double instance_build_time = bench_now() - t0;
+
+	pt3 eye = {{ side * 1.5, side * 1.5, -side * 3.0 }};
+	long mismatches = 0, checked = 0;
+	double elapsed = 0;
+	for (int y = 0; y < size; y++) {
+		for (int x = 0; x < size; x++) {
+			pt3 direction = {{ (x - size / 2) * 0.5 / size, (y - size / 2) * 0.5 / size, 1 }};
+			pt3_normalize_mut(&direction);
+			ray r = { eye, direction };
+			pt4 pixel = {0};
+			t0 = bench_now();
+			raytrace(ctx, &r, &pixel, 3);
+			elapsed += bench_now() - t0;
+			if ((y * size + x) % 7 != 0)
+				continue;
+			double t = 0, brute_t = INFINITY;
+			pt3 normal, brute_normal;
+			int hit = intersect_ray_instances(ctx, &r, INFINITY, 0, &t, &normal), brute = -1;
+			for (int i = 0; i < count; i++) {
+				const instance *in = &ctx->instances[i];
+				pt3 offset = pt3_sub(&r.origin, &in->position);
+				ray local = { mat3_pt3_mul(&in->to_local, &offset), mat3_pt3_mul(&in->to_local, &r.direction) };
+				if (intersect_ray_mesh(m, &local, &brute_t, 0, &brute_normal))
+					brute = i;
+			}
+			checked++;
+			mismatches += hit != brute || (hit >= 0 && t < brute_t) || (hit >= 0 && t > brute_t);
+		}
+	}
+
+	size_t mesh_bytes_one = mesh_bytes(m);
+	size_t instance_bytes = sizeof(instance) * count + sizeof(struct bvh_node) * ctx->instance_bvh->num_nodes
+			+ sizeof(uint32_t) * count;
+	printf("%d triangles (%d bvh nodes), %d instances, %d camera rays\n", m->num_triangles, m->bvh.num_nodes, count,
+			size * size);
+	printf("%24s %12.1f\n", "mesh MB", mesh_bytes_one / 1e6);
+	printf("%24s %12.1f\n", "instances MB", instance_bytes / 1e6);
+	printf("%24s %12.1f\n", "one mesh per instance MB", (double)mesh_bytes_one * count / 1e6);
+	printf("%24s %12.3f\n", "mesh build s", mesh_build_time);
+	printf("%24s %12.6f\n", "instance tree build s", instance_build_time);
+	printf("%24s %12.0f\n", "camera rays/s", size * size / elapsed);
+	printf("%24s %9ld/%ld\n", "same hit as brute force", checked - mismatches, checked);
+	free_context(ctx);
+	return mismatches != 0;
+}
+
+// Tokens of a generated scene with every number converted by strtod, as the scanner used to, and with the fast
+// path, checking both give the same bits. Then the same check on random numbers of every length and exponent
+// the scene syntax allows, most of which are too long for the fast path and must fall back correctly.
+static int bench_scene_lex(int argc, char **argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	long bytes;
+	FILE *f = bench_scene_file(n, &bytes);
+	if (f == NULL)
+		return 1;
+
+	const char *names[2] = { "strtod", "fast" };
+	double *values[2] = { NULL, NULL };
+	long num_values[2] = { 0, 0 }, num_tokens[2] = { 0, 0 };
+	double elapsed[2];
+	for (int v = 0; v < 2; v++) {
+		yyscan_t scanner;
+		YYSTYPE lval;
+		YYLTYPE lloc;
+		long cap = 1024;
+		values[v] = malloc(sizeof(double) * cap);
+		scanner_init(&scanner);
+		scanner_set_slow_floats(v == 0, scanner);
+		double t0 = bench_now();
+		scanner_set_input(f, scanner);
+		for (int token; (token = yylex(&lval, &lloc, scanner)) != YYEOF; num_tokens[v]++) {
+			if (token != FLOAT)
+				continue;
+			if (num_values[v] == cap)
+				values[v] = realloc(values[v], sizeof(double) * (cap *= 2));
+			values[v][num_values[v]++] = lval.dblval;
+		}
+		elapsed[v] = bench_now() - t0;
+		scanner_destroy(scanner);
+	}
+	fclose(f);
+
+	printf("%d spheres, %.1f MB scene, %ld tokens, %ld numbers\n", n, bytes / 1e6, num_tokens[1], num_values[1]);
+	printf("%10s %10s %14s %10s %10s\n", "floats", "lex s", "Mtokens/s", "MB/s", "identical");
+	int same = num_values[0] == num_values[1] && memcmp(values[0], values[1], sizeof(double) * num_values[0]) == 0;
+	for (int v = 0; v < 2; v++)
+		printf("%10s %10.3f %14.1f %10.1f %10s\n", names[v], elapsed[v], num_tokens[v] / elapsed[v] / 1e6,
+				bytes / 1e6 / elapsed[v], v == 0 ? "-" : same ? "yes" : "NO");
+	free(values[0]);
+	free(values[1]);
+
+	yyscan_t fast, slow;
+	scanner_init(&fast);
+	scanner_init(&slow);
+	scanner_set_slow_floats(1, slow);
+	unsigned short xsubi[3] = { 1, 2, 3 };
+	long mismatches = 0, samples = 1000000;
+	for (long i = 0; i < samples; i++) {
+		char text[64];
+		int len = 0;
+		if (erand48(xsubi) < 0.3)
+			text[len++] = '-';
+		int int_digits = 1 + erand48(xsubi) * 12, frac_digits = erand48(xsubi) * 12;
+		for (int d = 0; d < int_digits; d++)
+			text[len++] = '0' + (int)(erand48(xsubi) * 10);
+		if (frac_digits > 0) {
+			text[len++] = '.';
+			for (int d = 0; d < frac_digits; d++)
+				text[len++] = '0' + (int)(erand48(xsubi) * 10);
+		}
+		if (erand48(xsubi) < 0.3)
+			len += sprintf(text + len, "e%s%d", erand48(xsubi) < 0.5 ? "-" : "", (int)(erand48(xsubi) * 30));
+		double a = scanner_float(fast, text, len), b = scanner_float(slow, text, len);
+		if (memcmp(&a, &b, sizeof(a)) != 0 && mismatches++ < 5)
+			fprintf(stderr, "'%.*s': fast %.17g, strtod %.17g\n", len, text, a, b);
+	}
+	printf("%ld random numbers, %ld differ from strtod\n", samples, mismatches);
+	scanner_destroy(fast);
+	scanner_destroy(slow);
+	return !same || mismatches != 0;
+}
+
+static const struct {
+	const char *name;
+	int (*fn)(int argc, char **argv);
+	const char *help;
+} benches[] = {
+	{ "physics", bench_physics, "[max spheres]  physics step time from 10^2 spheres up" },
+	{ "physics-threads", bench_physics_threads, "[spheres] [max threads]  parallel physics step per thread count" },
+	{ "physics-sleep", bench_physics_sleep, "[spheres] [steps] [threshold]  settling spheres with and without sleeping" },
+	{ "physics-fused", bench_physics_fused, "[spheres] [steps]  separate plane and integration passes against one" },
+	{ "physics-soa", bench_physics_soa, "[spheres] [steps]  per-sphere physics passes on the records and per kernel on the physics' arrays" },
+	{ "physics-ccd", bench_physics_ccd, "[pairs] [speed] [steps]  tunnelling of fast spheres per substep limit" },
+	{ "render-spheres", bench_render_spheres, "[spheres] [size]  ray time with packed render records against full spheres" },
+	{ "render-kernels", bench_render_kernels, "[scene files]  generic raytrace() against the kernel picked for each scene" },
+	{ "render-isa", bench_render_isa, "[scene files]  self-test: every instruction set renders the same images; time per set" },
+	{ "render-instances", bench_render_instances, "[triangles] [instances] [size]  one mesh placed many times: memory and rays/s" },
+	{ "output-rerender", bench_output_rerender, "self-test: rendering into a prefix again replaces frames written as copies" },
+	{ "scene-lex", bench_scene_lex, "[spheres]  scanner tokens/s with strtod and fast number conversion" },
+	{ "scene-load", bench_scene_load, "[spheres]  parse time of a generated scene file" },
+	{ "scene-include", bench_scene_include, "[spheres] [files]  parse time of a scene split over included files per thread count" },
+};
+
+int bench_main(int argc, char **argv) {
+	for (size_t i = 0; argc > 1 && i < sizeof(benches) / sizeof(benches[0]); i++)
+		if (strcmp(argv[1], benches[i].name) == 0)
+			return benches[i].fn(argc - 1, argv + 1);
+
+	fprintf(stderr, "usage: ray bench <name> [args]\n");
+	for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+		fprintf(stderr, "  %-16s %s\n", benches[i].name, benches[i].help);
+	return 1;
+}
@@ -0,0 +1,13 @@
+#ifndef RAY_BENCH_H__
+#define RAY_BENCH_H__
+
+#include "ray_ast.h"
+
+// ray bench <name> [args...]
+int bench_main(int argc, char **argv);
+
+double bench_now(void);
+struct context *bench_random_spheres(int n, unsigned seed);
+struct context *bench_copy_context(const struct context *ctx);
+
+#endif	// RAY_BENCH_H__
@@ -1,20 +1,29 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "ray_bmp.h"
+
+#if RENDER_SIMD
+#include <immintrin.h>
+#endif
 	
 #define bmp_file_header_size 14
 #define bmp_info_header_size 40
 
-int render_bmp(struct framebuffer_pt4 *fb, const char *output_filepath) {
-	FILE *f;
-	if ((f = fopen(output_filepath, "wb")) == NULL) {
-		fprintf(stderr, "error opening BMP '%s' for writing: %d %s\n", output_filepath, errno, strerror(errno));
-		exit(1);
-	}
+int bmp_row_size(int width) {
+	return (3 * width + 3) & ~3;
+}
 
-	const int filesize = bmp_file_header_size + 3 * fb->width * fb->height;
+size_t bmp_file_size(int width, int height) {
+	return BMP_HEADER_SIZE + (size_t)bmp_row_size(width) * height;
+}
+
+// Writes the BMP_HEADER_SIZE bytes of file and info header for a 24 bit width x height image.
+void bmp_fill_headers(uint8_t *out, int width, int height) {
+	const size_t filesize = bmp_file_size(width, height);
 
 	uint8_t bmp_file_header[bmp_file_header_size] = {
 		// 2	The header field used to identify the BMP and DIB file is 0x42 0x4D in hexadecimal, same as BM in ASCII.
@@ -32,9 +41,9 @@ int render_bmp(struct framebuffer_pt4 *fb, const char *output_filepath) {
 		// 4	the size of this header, in bytes (40)
 		40, 0, 0, 0,
 		// 4	the bitmap width in pixels (signed integer)
-		fb->width, fb->width >> 8, fb->width >> 16, fb->width >> 24,	
+		width, width >> 8, width >> 16, width >> 24,	
 		// 4	the bitmap height in pixels (signed integer)
-		fb->height, fb->height >> 8, fb->height >> 16, fb->height >> 24,	
+		height, height >> 8, height >> 16, height >> 24,	
 		// 2	the number of color planes (must be 1)
 		1, 0,
 		// 2	the number of bits per pixel, which is the color depth of the image. Typical values are 1, 4, 8, 16, 24 and 32.
@@ -53,28 +62,127 @@ int render_bmp(struct framebuffer_pt4 *fb, const char *output_filepath) {
 		0, 0, 0, 0,
 	};
 
-	fwrite(bmp_file_header, sizeof(bmp_file_header), 1, f);
-	fwrite(bmp_info_header, sizeof(bmp_info_header), 1, f);
-	for (int y = fb->height - 1; y >= 0; y--) {
-		int bytes_in_row = 0;
-		for (int x = 0; x < fb->width; x++) {
-			// bmp_source is source data that we convert to png
-			const pt4 *p = framebuffer_pt4_get(fb, x, y);
-			uint8_t px[3] = {
-				color_double_to_u8(p->v[2]),
-				color_double_to_u8(p->v[1]),
-				color_double_to_u8(p->v[0]),
-			};
-			bytes_in_row += sizeof(px);
-			fwrite(px, sizeof(px), 1, f);
+	memcpy(out, bmp_file_header, sizeof(bmp_file_header));
+	memcpy(out + sizeof(bmp_file_header), bmp_info_header, sizeof(bmp_info_header));
+}
+
+#if RENDER_SIMD
+// The converters below take pixels four at a time and clamp as min(max(d, 0) * 255, 255) before truncating,
+// which gives what color_double_to_u8() gives for every value. They return how many pixels they did.
+
+// red green blue alpha of four pixels, as bytes, to blue green red
+#define BGR_OF_RGBA	_mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)
+
+RENDER_TARGET_AVX2 static int convert_pixels_avx2(const pt4 *p, int n, uint8_t *out) {
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d scale = _mm256_set1_pd(255);
+	int x = 0;
+	for (; x + 4 <= n; x += 4, p += 4, out += 12) {
+		__m128i q[4];
+		for (int k = 0; k < 4; k++) {
+			__m256d d = _mm256_mul_pd(_mm256_max_pd(_mm256_loadu_pd(p[k].v), zero), scale);
+			q[k] = _mm256_cvttpd_epi32(_mm256_min_pd(d, scale));
 		}
-		while (bytes_in_row++ % 4) {
-			uint8_t pad = 0;
-			fwrite(&pad, sizeof(pad), 1, f);
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+		bytes = _mm_shuffle_epi8(bytes, BGR_OF_RGBA);
+		_mm_storel_epi64((__m128i *)out, bytes);
+		uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+		memcpy(out + 8, &last, sizeof(last));
+	}
+	return x;
+}
+
+RENDER_TARGET_AVX512 static int convert_pixels_avx512(const pt4 *p, int n, uint8_t *out) {
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d scale = _mm512_set1_pd(255);
+	int x = 0;
+	for (; x + 4 <= n; x += 4, p += 4, out += 12) {
+		__m256i q[2];
+		for (int k = 0; k < 2; k++) {
+			__m512d d = _mm512_mul_pd(_mm512_max_pd(_mm512_loadu_pd(p[2 * k].v), zero), scale);
+			q[k] = _mm512_cvttpd_epi32(_mm512_min_pd(d, scale));
 		}
+		__m128i bytes = _mm512_cvtepi32_epi8(_mm512_inserti64x4(_mm512_castsi256_si512(q[0]), q[1], 1));
+		bytes = _mm_shuffle_epi8(bytes, BGR_OF_RGBA);
+		_mm_storel_epi64((__m128i *)out, bytes);
+		uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+		memcpy(out + 8, &last, sizeof(last));
 	}
+	return x;
+}
+#endif
 
-	fclose(f);
+// Converts row y of fb to BMP's BGR byte order, zero padded to bmp_row_size(), with the instruction set the
+// renderer uses.
+void bmp_convert_row(struct framebuffer_pt4 *fb, int y, uint8_t *out) {
+	const pt4 *p = framebuffer_pt4_get(fb, 0, y);
+	int x = 0;
+#if RENDER_SIMD
+	enum render_isa isa = render_active_isa();
+	if (isa == RENDER_ISA_AVX512)
+		x = convert_pixels_avx512(p, fb->width, out);
+	else if (isa == RENDER_ISA_AVX2)
+		x = convert_pixels_avx2(p, fb->width, out);
+#endif
+	int i = 3 * x;
+	for (p += x; x < fb->width; x++, p++) {
+		out[i++] = color_double_to_u8(p->v[2]);
+		out[i++] = color_double_to_u8(p->v[1]);
+		out[i++] = color_double_to_u8(p->v[0]);
+	}
+	while (i % 4)
+		out[i++] = 0;
+}
+
+int render_bmp(struct framebuffer_pt4 *fb, const char *output_filepath) {
+	return render_bmp_progressive(fb, NULL, output_filepath);
+}
+
+// Like render_bmp, but if progress is non-NULL each row is written as soon as its band has been rendered.
+int render_bmp_progressive(struct framebuffer_pt4 *fb, struct frame_progress *progress, const char *output_filepath) {
+	struct bmp_stream *s = bmp_stream_open(output_filepath, fb->width, fb->height);
+	bmp_stream_write_rows(s, fb, progress);
+	bmp_stream_close(s);
 	return 0;
 }
 
+struct bmp_stream *bmp_stream_open(const char *output_filepath, int width, int height) {
+	struct bmp_stream *s = malloc(sizeof(*s));
+	s->path = strdup(output_filepath);
+	s->tmp = malloc(strlen(output_filepath) + sizeof(".tmp"));
+	sprintf(s->tmp, "%s.tmp", output_filepath);
+	if ((s->f = fopen(s->tmp, "wb")) == NULL) {
+		fprintf(stderr, "error opening BMP '%s' for writing: %d %s\n", s->tmp, errno, strerror(errno));
+		exit(1);
+	}
+
+	uint8_t headers[BMP_HEADER_SIZE];
+	bmp_fill_headers(headers, width, height);
+	fwrite(headers, sizeof(headers), 1, s->f);
+
+	s->row_size = bmp_row_size(width);
+	s->row = malloc(s->row_size);
+	return s;
+}
+
+// Appends the rows of fb, bottom row first, waiting on progress for each row if it is non-NULL.
+void bmp_stream_write_rows(struct bmp_stream *s, struct framebuffer_pt4 *fb, struct frame_progress *progress) {
+	for (int y = fb->height - 1; y >= 0; y--) {
+		if (progress)
+			frame_progress_wait_rows(progress, y, y + 1);
+		bmp_convert_row(fb, y, s->row);
+		fwrite(s->row, s->row_size, 1, s->f);
+	}
+}
+
+void bmp_stream_close(struct bmp_stream *s) {
+	if (fclose(s->f) != 0 || rename(s->tmp, s->path) != 0) {
+		fprintf(stderr, "error writing BMP '%s': %d %s\n", s->path, errno, strerror(errno));
+		unlink(s->tmp);
+		exit(1);
+	}
+	free(s->path);
+	free(s->tmp);
+	free(s->row);
+	free(s);
+}
@@ -1,9 +1,34 @@
 #ifndef RAY_BMP_H__
 #define RAY_BMP_H__
 
+#include <stdio.h>
+
 #include "ray_render.h"
 
+#define BMP_HEADER_SIZE (14 + 40)
+
+int bmp_row_size(int width);
+size_t bmp_file_size(int width, int height);
+void bmp_fill_headers(uint8_t *out, int width, int height);
+void bmp_convert_row(struct framebuffer_pt4 *fb, int y, uint8_t *out);
+
+// Writes a BMP incrementally from framebuffers holding consecutive bands of rows. Bands must be fed bottom
+// band first, which is the order BMP stores rows in. The rows go to a temporary file renamed over the path on
+// close, so a file already there is replaced rather than overwritten: repeated frames are hard links to the
+// frame before, see output_repeat_frame(), and rendering into the same prefix again mustn't change them all.
+struct bmp_stream {
+	FILE *f;
+	char *path;
+	char *tmp;
+	int row_size;
+	uint8_t *row;
+};
+
+struct bmp_stream *bmp_stream_open(const char *output_filepath, int width, int height);
+void bmp_stream_write_rows(struct bmp_stream *s, struct framebuffer_pt4 *fb, struct frame_progress *progress);
+void bmp_stream_close(struct bmp_stream *s);
+
 int render_bmp(struct framebuffer_pt4 *fb, const char *output_filepath);
+int render_bmp_progressive(struct framebuffer_pt4 *fb, struct frame_progress *progress, const char *output_filepath);
 
 #endif	// RAY_BMP_H__
-
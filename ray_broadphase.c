@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ray_broadphase.h"
+
+struct cell_range {
+	int64_t lo[3];
+	int64_t hi[3];
+};
+
+static void sphere_cells(const struct broadphase *bp, const struct sphere_soa *s, int i, struct cell_range *c) {
+	const double position[3] = { s->px[i], s->py[i], s->pz[i] };
+	for (int k = 0; k < 3; k++) {
+		double lo = floor((position[k] - s->r[i]) / bp->cell_size);
+		double hi = floor((position[k] + s->r[i]) / bp->cell_size);
+		c->lo[k] = (int64_t)lo;
+		c->hi[k] = (int64_t)hi;
+	}
+}
+
+static int64_t cell_range_count(const struct cell_range *c) {
+	int64_t n = 1;
+	for (int k = 0; k < 3; k++) {
+		n *= c->hi[k] - c->lo[k] + 1;
+		if (n > BROADPHASE_MAX_CELLS)
+			return n;
+	}
+	return n;
+}
+
+static inline uint32_t cell_hash(const struct broadphase *bp, int64_t x, int64_t y, int64_t z) {
+	uint64_t h = (uint64_t)x * 73856093u ^ (uint64_t)y * 19349663u ^ (uint64_t)z * 83492791u;
+	return (uint32_t)(h ^ h >> 32) & bp->mask;
+}
+
+#define FOR_EACH_CELL(bp, c, bucket)							\
+	for (int64_t x_ = (c)->lo[0]; x_ <= (c)->hi[0]; x_++)				\
+	for (int64_t y_ = (c)->lo[1]; y_ <= (c)->hi[1]; y_++)				\
+	for (int64_t z_ = (c)->lo[2]; z_ <= (c)->hi[2]; z_++)				\
+	for (uint32_t bucket = cell_hash(bp, x_, y_, z_), once_ = 1; once_; once_ = 0)
+
+struct broadphase *new_broadphase(void) {
+	return calloc(1, sizeof(struct broadphase));
+}
+
+void free_broadphase(struct broadphase *bp) {
+	free(bp->bucket_start);
+	free(bp->entries);
+	free(bp->oversized);
+	free(bp);
+}
+
+void broadphase_build(struct broadphase *bp, const struct sphere_soa *spheres) {
+	int n = spheres->n;
+	bp->num_spheres = n;
+	bp->num_oversized = 0;
+	if (n > bp->spheres_cap) {
+		bp->spheres_cap = n;
+		bp->oversized = realloc(bp->oversized, sizeof(*bp->oversized) * n);
+	}
+
+	// cells about one average diameter across, so a typical sphere overlaps at most 8 of them
+	double radius_sum = 0;
+	for (int i = 0; i < n; i++)
+		radius_sum += spheres->r[i];
+	bp->cell_size = n > 0 && radius_sum > 0 ? 2 * radius_sum / n : 1;
+
+	uint32_t table_size = 16;
+	while (table_size < 2 * (uint32_t)n)
+		table_size *= 2;
+	bp->mask = table_size - 1;
+	if (table_size > bp->table_cap) {
+		bp->table_cap = table_size;
+		bp->bucket_start = realloc(bp->bucket_start, sizeof(*bp->bucket_start) * (table_size + 1));
+	}
+	memset(bp->bucket_start, 0, sizeof(*bp->bucket_start) * (table_size + 1));
+
+	// counting sort of (cell, sphere) entries: count, prefix sum, then fill
+	size_t num_entries = 0;
+	for (int i = 0; i < n; i++) {
+		struct cell_range c;
+		sphere_cells(bp, spheres, i, &c);
+		if (cell_range_count(&c) > BROADPHASE_MAX_CELLS) {
+			bp->oversized[bp->num_oversized++] = i;
+			continue;
+		}
+		FOR_EACH_CELL(bp, &c, b) {
+			bp->bucket_start[b + 1]++;
+			num_entries++;
+		}
+	}
+	for (uint32_t b = 0; b < table_size; b++)
+		bp->bucket_start[b + 1] += bp->bucket_start[b];
+
+	if (num_entries > bp->entries_cap) {
+		bp->entries_cap = num_entries;
+		bp->entries = realloc(bp->entries, sizeof(*bp->entries) * num_entries);
+	}
+	int next_oversized = 0;
+	for (int i = 0; i < n; i++) {
+		if (next_oversized < bp->num_oversized && bp->oversized[next_oversized] == i) {
+			next_oversized++;
+			continue;
+		}
+		struct cell_range c;
+		sphere_cells(bp, spheres, i, &c);
+		FOR_EACH_CELL(bp, &c, b)
+			bp->entries[bp->bucket_start[b]++] = i;
+	}
+	// the fill advanced every start to the next bucket's start, shift them back
+	for (uint32_t b = table_size; b > 0; b--)
+		bp->bucket_start[b] = bp->bucket_start[b - 1];
+	bp->bucket_start[0] = 0;
+}
+
+void broadphase_scratch_init(struct broadphase_scratch *sc) {
+	memset(sc, 0, sizeof(*sc));
+}
+
+void broadphase_scratch_free(struct broadphase_scratch *sc) {
+	free(sc->stamp);
+	free(sc->candidates);
+}
+
+static int cmp_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static inline void add_candidate(struct broadphase_scratch *sc, int *n, int i, int j, int all) {
+	if ((all ? j != i : j > i) && sc->stamp[j] != sc->generation) {
+		sc->stamp[j] = sc->generation;
+		sc->candidates[(*n)++] = j;
+	}
+}
+
+static void prepare_scratch(const struct broadphase *bp, struct broadphase_scratch *sc) {
+	if (sc->cap < bp->num_spheres) {
+		sc->cap = bp->num_spheres;
+		sc->stamp = realloc(sc->stamp, sizeof(*sc->stamp) * sc->cap);
+		sc->candidates = realloc(sc->candidates, sizeof(*sc->candidates) * sc->cap);
+		memset(sc->stamp, 0, sizeof(*sc->stamp) * sc->cap);
+		sc->generation = 0;
+	}
+	if (++sc->generation == 0) {
+		memset(sc->stamp, 0, sizeof(*sc->stamp) * sc->cap);
+		sc->generation = 1;
+	}
+}
+
+static void sort_candidates(struct broadphase_scratch *sc, int n) {
+	// candidates must come in the same order as the brute force pair loop visits them
+	if (n < 16) {
+		for (int a = 1; a < n; a++) {
+			int v = sc->candidates[a], b = a;
+			for (; b > 0 && sc->candidates[b - 1] > v; b--)
+				sc->candidates[b] = sc->candidates[b - 1];
+			sc->candidates[b] = v;
+		}
+	} else {
+		qsort(sc->candidates, n, sizeof(*sc->candidates), cmp_int);
+	}
+}
+
+// Candidates from the cells of c; with all == 0 only j > i, otherwise every j != i.
+static int query_cells(const struct broadphase *bp, const struct cell_range *c, int i, struct broadphase_scratch *sc, int all) {
+	int n = 0;
+	if (cell_range_count(c) > BROADPHASE_MAX_CELLS) {
+		// too big to walk the cells, pair with everything (after i)
+		for (int j = all ? 0 : i + 1; j < bp->num_spheres; j++)
+			if (j != i)
+				sc->candidates[n++] = j;
+		return n;
+	}
+
+	FOR_EACH_CELL(bp, c, b)
+		for (uint32_t e = bp->bucket_start[b]; e < bp->bucket_start[b + 1]; e++)
+			add_candidate(sc, &n, i, bp->entries[e], all);
+	for (int k = 0; k < bp->num_oversized; k++)
+		add_candidate(sc, &n, i, bp->oversized[k], all);
+	sort_candidates(sc, n);
+	return n;
+}
+
+static int query(const struct broadphase *bp, const struct sphere_soa *spheres, int i, struct broadphase_scratch *sc, int all) {
+	prepare_scratch(bp, sc);
+	struct cell_range c;
+	sphere_cells(bp, spheres, i, &c);
+	return query_cells(bp, &c, i, sc, all);
+}
+
+int broadphase_query(const struct broadphase *bp, const struct sphere_soa *spheres, int i, struct broadphase_scratch *sc) {
+	return query(bp, spheres, i, sc, 0);
+}
+
+int broadphase_query_all(const struct broadphase *bp, const struct sphere_soa *spheres, int i, struct broadphase_scratch *sc) {
+	return query(bp, spheres, i, sc, 1);
+}
+
+int broadphase_query_box(const struct broadphase *bp, const pt3 *lo, const pt3 *hi, struct broadphase_scratch *sc) {
+	prepare_scratch(bp, sc);
+	struct cell_range c;
+	for (int k = 0; k < 3; k++) {
+		double l = floor(lo->v[k] / bp->cell_size);
+		double h = floor(hi->v[k] / bp->cell_size);
+		c.lo[k] = (int64_t)l;
+		c.hi[k] = (int64_t)h;
+	}
+	return query_cells(bp, &c, -1, sc, 1);
+}
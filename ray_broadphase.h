@@ -0,0 +1,49 @@
+#ifndef RAY_BROADPHASE_H__
+#define RAY_BROADPHASE_H__
+
+#include <stdint.h>
+
+#include "ray_ast.h"
+#include "ray_physics_soa.h"
+
+// Uniform grid broadphase for sphere-sphere collisions. Every sphere is entered into each grid cell its
+// bounding box overlaps, cells being hashed into a table that is rebuilt from scratch each step with a
+// counting sort. Spheres overlapping too many cells are kept on a separate list and paired with everything.
+
+#define BROADPHASE_MAX_CELLS	64	// cells a sphere may span before it is treated as oversized
+
+struct broadphase {
+	int num_spheres;
+	double cell_size;
+	uint32_t mask;			// table size - 1, a power of two
+	uint32_t *bucket_start;		// mask + 2 prefix sums into entries
+	uint32_t *entries;		// sphere indices, ascending within each bucket
+	size_t entries_cap;
+	int *oversized;
+	int num_oversized;
+	int spheres_cap;
+	uint32_t table_cap;
+};
+
+// Per-thread query state.
+struct broadphase_scratch {
+	uint32_t *stamp;		// stamp[j] == generation if j is already a candidate in this query
+	uint32_t generation;
+	int *candidates;
+	int cap;
+};
+
+struct broadphase *new_broadphase(void);
+void free_broadphase(struct broadphase *bp);
+void broadphase_build(struct broadphase *bp, const struct sphere_soa *spheres);
+
+void broadphase_scratch_init(struct broadphase_scratch *sc);
+void broadphase_scratch_free(struct broadphase_scratch *sc);
+// Fills sc->candidates with every j > i whose bounding box may overlap sphere i's, in ascending order.
+int broadphase_query(const struct broadphase *bp, const struct sphere_soa *spheres, int i, struct broadphase_scratch *sc);
+// Same, but for every j != i.
+int broadphase_query_all(const struct broadphase *bp, const struct sphere_soa *spheres, int i, struct broadphase_scratch *sc);
+// Every sphere whose bounding box may overlap the box from lo to hi, in ascending order.
+int broadphase_query_box(const struct broadphase *bp, const pt3 *lo, const pt3 *hi, struct broadphase_scratch *sc);
+
+#endif	// RAY_BROADPHASE_H__
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ray_checkpoint.h"
+#include "ray_physics.h"
+
+void checkpoint_path(const char *prefix, int frame, char *path, size_t size) {
+	snprintf(path, size, "%s-%05d.ckpt", prefix, frame);
+}
+
+// Written to a temporary file that is synced and then renamed over path, so a run killed while writing one leaves
+// the previous checkpoint of that frame, if any, rather than a truncated file that would stop the next run resuming.
+int checkpoint_write(const char *path, struct context *ctx, int frame) {
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "error opening checkpoint '%s' for writing: %d %s\n", tmp, errno, strerror(errno));
+		return -1;
+	}
+	struct checkpoint_file_header hdr = { {0}, CHECKPOINT_VERSION, frame, ctx->num_spheres };
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	int ret = fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+	physics_sync_spheres(ctx);
+	for (int i = 0; ret == 0 && i < ctx->num_spheres; i++) {
+		// zeroed first, as built with RAY_VEC4 the record ends in padding
+		struct checkpoint_sphere cs;
+		memset(&cs, 0, sizeof(cs));
+		cs.position = ctx->spheres[i].position;
+		cs.velocity = ctx->spheres[i].velocity;
+		int asleep, still_steps;
+		physics_get_sleep_state(ctx, i, &asleep, &still_steps);
+		cs.asleep = asleep;
+		cs.still_steps = still_steps;
+		if (fwrite(&cs, sizeof(cs), 1, f) != 1)
+			ret = -1;
+	}
+	if (ret == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0))
+		ret = -1;
+	if (fclose(f) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp, path) != 0)
+		ret = -1;
+	if (ret != 0) {
+		fprintf(stderr, "error writing checkpoint '%s': %d %s\n", path, errno, strerror(errno));
+		unlink(tmp);
+	}
+	return ret;
+}
+
+int checkpoint_read(const char *path, struct context *ctx, int *frame) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "error opening checkpoint '%s': %d %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	struct checkpoint_file_header hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.version != CHECKPOINT_VERSION) {
+		fprintf(stderr, "'%s' is not a version %d checkpoint\n", path, CHECKPOINT_VERSION);
+		fclose(f);
+		return -1;
+	}
+	if (hdr.num_spheres != (uint32_t)ctx->num_spheres) {
+		fprintf(stderr, "checkpoint '%s' has %u spheres, the scene %d\n", path, hdr.num_spheres, ctx->num_spheres);
+		fclose(f);
+		return -1;
+	}
+	// Record sizes differ between builds with and without RAY_VEC4.
+	struct stat st;
+	if (fstat(fileno(f), &st) != 0 ||
+			(size_t)st.st_size != sizeof(hdr) + sizeof(struct checkpoint_sphere) * hdr.num_spheres) {
+		fprintf(stderr, "'%s' is truncated or was written by a build with other point records\n", path);
+		fclose(f);
+		return -1;
+	}
+	physics_spheres_changed(ctx);
+	for (int i = 0; i < ctx->num_spheres; i++) {
+		struct checkpoint_sphere cs;
+		if (fread(&cs, sizeof(cs), 1, f) != 1) {
+			fprintf(stderr, "'%s' is truncated\n", path);
+			fclose(f);
+			return -1;
+		}
+		ctx->spheres[i].position = cs.position;
+		ctx->spheres[i].velocity = cs.velocity;
+		physics_set_sleep_state(ctx, i, cs.asleep, cs.still_steps);
+	}
+	fclose(f);
+	*frame = hdr.frame;
+	return 0;
+}
+
+int checkpoint_load_latest(const char *prefix, struct context *ctx, int frame) {
+	for (int f = frame; f > 0; f--) {
+		char path[256];
+		checkpoint_path(prefix, f, path, sizeof(path));
+		if (access(path, R_OK) != 0)
+			continue;
+		int loaded;
+		if (checkpoint_read(path, ctx, &loaded) != 0)
+			return -1;
+		return loaded;
+	}
+	return 0;
+}
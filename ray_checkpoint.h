@@ -0,0 +1,40 @@
+#ifndef RAY_CHECKPOINT_H__
+#define RAY_CHECKPOINT_H__
+
+#include <stdint.h>
+
+#include "ray_ast.h"
+
+// Physics state of a scene at one frame: everything that carries over from one step to the next, so loading a
+// checkpoint and stepping on gives exactly the frames a run from the start would. Layout:
+//
+//	struct checkpoint_file_header
+//	struct checkpoint_sphere spheres[num_spheres]
+//
+// Checkpoints are named <prefix>-%05d.ckpt after their frame.
+
+#define CHECKPOINT_MAGIC	"RCKP"
+#define CHECKPOINT_VERSION	1
+
+struct checkpoint_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t frame;
+	uint32_t num_spheres;
+};
+
+struct checkpoint_sphere {
+	pt3 position;
+	pt3 velocity;
+	uint32_t asleep;
+	int32_t still_steps;
+};
+
+void checkpoint_path(const char *prefix, int frame, char *path, size_t size);
+int checkpoint_write(const char *path, struct context *ctx, int frame);
+int checkpoint_read(const char *path, struct context *ctx, int *frame);
+// Loads the latest checkpoint at or before frame and returns its frame; 0 if there is none, as the scene as
+// parsed is frame 0, or -1 if it can't be read.
+int checkpoint_load_latest(const char *prefix, struct context *ctx, int frame);
+
+#endif	// RAY_CHECKPOINT_H__
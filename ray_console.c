@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 
-#include "ray_render.h"
+#include "ray_console.h"
 
 void render_console(struct framebuffer_pt4 *fb) {
 	for (int y = 0; y < fb->height; y++) {
@@ -15,3 +18,124 @@ void render_console(struct framebuffer_pt4 *fb) {
 		printf("\n");
 	}
 }
+
+static void write_all(int fd, const char *p, size_t n) {
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return;
+		p += w;
+		n -= w;
+	}
+}
+
+struct console_preview *new_console_preview(int fd) {
+	struct console_preview *cp = calloc(1, sizeof(*cp));
+	cp->fd = fd;
+	struct winsize ws;
+	if (ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 1) {
+		cp->cols = ws.ws_col;
+		cp->rows = ws.ws_row - 1;	// keep the last line free so the terminal never scrolls
+	} else {
+		cp->cols = 80;
+		cp->rows = 24;
+	}
+	cp->cells = malloc(6 * cp->cols * cp->rows);
+	cp->next = malloc(6 * cp->cols * cp->rows);
+	// worst case every cell needs a cursor move, both colors and the glyph
+	cp->buf_size = (size_t)cp->cols * cp->rows * 64 + 64;
+	cp->buf = malloc(cp->buf_size);
+	return cp;
+}
+
+void free_console_preview(struct console_preview *cp) {
+	if (cp->drawn) {
+		static const char reset[] = "\033[0m\033[?25h\n";
+		write_all(cp->fd, reset, sizeof(reset) - 1);
+	}
+	free(cp->cells);
+	free(cp->next);
+	free(cp->buf);
+	free(cp);
+}
+
+// Averages the fb pixels that land in preview pixel (px, py).
+static void box_filter(struct framebuffer_pt4 *fb, int pw, int ph, int px, int py, uint8_t *out) {
+	int x0 = px * fb->width / pw, x1 = (px + 1) * fb->width / pw;
+	int y0 = py * fb->height / ph, y1 = (py + 1) * fb->height / ph;
+	if (x1 <= x0) x1 = x0 + 1;
+	if (y1 <= y0) y1 = y0 + 1;
+	double sum[3] = {0};
+	for (int y = y0; y < y1; y++) {
+		const pt4 *p = framebuffer_pt4_get(fb, x0, y);
+		for (int x = x0; x < x1; x++, p++)
+			for (int c = 0; c < 3; c++)
+				sum[c] += p->v[c];
+	}
+	double n = (x1 - x0) * (y1 - y0);
+	for (int c = 0; c < 3; c++)
+		out[c] = color_double_to_u8(sum[c] / n);
+}
+
+void console_preview_frame(struct console_preview *cp, struct framebuffer_pt4 *fb) {
+	// fit the image, keeping its aspect ratio; half-blocks make preview pixels roughly square
+	int pw = cp->cols;
+	int ph = (int)((double)fb->height * pw / fb->width);
+	if (ph > 2 * cp->rows) {
+		ph = 2 * cp->rows;
+		pw = (int)((double)fb->width * ph / fb->height);
+	}
+	if (pw != cp->width || ph != cp->height) {
+		cp->width = pw;
+		cp->height = ph;
+		cp->drawn = 0;
+	}
+
+	int cell_rows = (ph + 1) / 2;
+	for (int r = 0; r < cell_rows; r++) {
+		for (int c = 0; c < pw; c++) {
+			uint8_t *cell = &cp->next[6 * (r * cp->cols + c)];
+			box_filter(fb, pw, ph, c, 2 * r, cell);
+			if (2 * r + 1 < ph)
+				box_filter(fb, pw, ph, c, 2 * r + 1, cell + 3);
+			else
+				memset(cell + 3, 0, 3);
+		}
+	}
+
+	char *o = cp->buf;
+	if (!cp->drawn)
+		o += sprintf(o, "\033[?25l\033[2J");
+	int last_r = -1, last_c = -1;
+	int fg = -1, bg = -1;
+	for (int r = 0; r < cell_rows; r++) {
+		for (int c = 0; c < pw; c++) {
+			const uint8_t *cell = &cp->next[6 * (r * cp->cols + c)];
+			if (cp->drawn && memcmp(cell, &cp->cells[6 * (r * cp->cols + c)], 6) == 0)
+				continue;
+			if (r != last_r || c != last_c + 1)
+				o += sprintf(o, "\033[%d;%dH", r + 1, c + 1);
+			int cell_fg = cell[0] << 16 | cell[1] << 8 | cell[2];
+			int cell_bg = cell[3] << 16 | cell[4] << 8 | cell[5];
+			if (cell_fg != fg)
+				o += sprintf(o, "\033[38;2;%u;%u;%um", cell[0], cell[1], cell[2]);
+			if (cell_bg != bg)
+				o += sprintf(o, "\033[48;2;%u;%u;%um", cell[3], cell[4], cell[5]);
+			fg = cell_fg;
+			bg = cell_bg;
+			o += sprintf(o, "▀");	// upper half block: foreground on top, background below
+			last_r = r;
+			last_c = c;
+		}
+	}
+	o += sprintf(o, "\033[0m\033[%d;1H", cell_rows + 1);
+
+	write_all(cp->fd, cp->buf, o - cp->buf);
+
+	uint8_t *tmp = cp->cells;
+	cp->cells = cp->next;
+	cp->next = tmp;
+	cp->drawn = 1;
+}
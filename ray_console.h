@@ -5,5 +5,23 @@
 
 void render_console(struct framebuffer_pt4 *fb);
 
-#endif	// RAY_CONSOLE_H__
+// Live preview: the frame is box filtered down to the terminal size, drawn two pixel rows per cell with
+// half-block characters, and only the cells that changed since the previous frame are redrawn.
+struct console_preview {
+	int fd;
+	int cols;
+	int rows;
+	int width;			// preview size in pixels, rows are 2 pixels tall
+	int height;
+	int drawn;			// cells holds what is on screen
+	uint8_t *cells;			// per cell, rgb of the upper then the lower pixel
+	uint8_t *next;
+	char *buf;			// the escape sequences for one frame, written with a single write()
+	size_t buf_size;
+};
+
+struct console_preview *new_console_preview(int fd);
+void console_preview_frame(struct console_preview *cp, struct framebuffer_pt4 *fb);
+void free_console_preview(struct console_preview *cp);
 
+#endif	// RAY_CONSOLE_H__
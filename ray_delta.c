@@ -0,0 +1,244 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "ray_delta.h"
+#include "ray_bmp.h"
+
+static void tile_rect(int tiles_x, int tile_size, int width, int height, uint32_t index, int *x0, int *y0, int *w, int *h) {
+	*x0 = (index % tiles_x) * tile_size;
+	*y0 = (index / tiles_x) * tile_size;
+	*w = width - *x0 < tile_size ? width - *x0 : tile_size;
+	*h = height - *y0 < tile_size ? height - *y0 : tile_size;
+}
+
+// Offset of pixel (x, y), counted from the top left, in an image held in BMP pixel layout.
+static inline size_t bmp_pixel_offset(int row_size, int height, int x, int y) {
+	return (size_t)(height - 1 - y) * row_size + 3 * x;
+}
+
+// A container cut short can't be read past the gap, so a failed write ends the run as a failed open does.
+static void write_or_exit(struct delta_writer *w, const void *data, size_t size, size_t count) {
+	if (fwrite(data, size, count, w->f) != count) {
+		fprintf(stderr, "error writing delta container '%s': %d %s\n", w->path, errno, strerror(errno));
+		exit(1);
+	}
+}
+
+struct delta_writer *delta_writer_open(const char *path, int width, int height, int keyframe_interval) {
+	struct delta_writer *w = calloc(1, sizeof(*w));
+	if ((w->f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "error opening delta container '%s' for writing: %d %s\n", path, errno, strerror(errno));
+		exit(1);
+	}
+	w->path = strdup(path);
+	memcpy(w->hdr.magic, DELTA_MAGIC, sizeof(w->hdr.magic));
+	w->hdr.version = DELTA_VERSION;
+	w->hdr.width = width;
+	w->hdr.height = height;
+	w->hdr.tile_size = DELTA_TILE_SIZE;
+	w->hdr.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+	write_or_exit(w, &w->hdr, sizeof(w->hdr), 1);
+
+	w->tiles_x = (width + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE;
+	w->tiles_y = (height + DELTA_TILE_SIZE - 1) / DELTA_TILE_SIZE;
+	w->row_size = bmp_row_size(width);
+	w->prev = calloc(height, w->row_size);
+	w->cur = calloc(height, w->row_size);
+	w->changed = malloc(sizeof(*w->changed) * w->tiles_x * w->tiles_y);
+	w->payload = malloc((size_t)w->tiles_x * w->tiles_y * DELTA_TILE_SIZE * DELTA_TILE_SIZE * 3);
+	return w;
+}
+
+static int tile_changed(const struct delta_writer *w, int x0, int y0, int tw, int th) {
+	for (int y = y0; y < y0 + th; y++) {
+		size_t off = bmp_pixel_offset(w->row_size, w->hdr.height, x0, y);
+		if (memcmp(w->prev + off, w->cur + off, 3 * tw) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+// Writes the frame in cur: every tile for keyframes, otherwise the tiles that differ from prev.
+static void write_tiles(struct delta_writer *w) {
+	const int width = w->hdr.width;
+	const int height = w->hdr.height;
+	const int ts = w->hdr.tile_size;
+	int keyframe = w->hdr.num_frames % w->hdr.keyframe_interval == 0;
+
+	struct delta_frame_header fh = { w->hdr.num_frames, keyframe ? DELTA_KEYFRAME : 0, 0, 0 };
+	size_t payload_size = 0;
+	for (uint32_t i = 0; i < (uint32_t)(w->tiles_x * w->tiles_y); i++) {
+		int x0, y0, tw, th;
+		tile_rect(w->tiles_x, ts, width, height, i, &x0, &y0, &tw, &th);
+		if (!keyframe && !tile_changed(w, x0, y0, tw, th))
+			continue;
+		w->changed[fh.num_tiles++] = i;
+		for (int y = y0; y < y0 + th; y++) {
+			memcpy(w->payload + payload_size, w->cur + bmp_pixel_offset(w->row_size, height, x0, y), 3 * tw);
+			payload_size += 3 * tw;
+		}
+	}
+
+	write_or_exit(w, &fh, sizeof(fh), 1);
+	write_or_exit(w, w->changed, sizeof(*w->changed), fh.num_tiles);
+	write_or_exit(w, w->payload, 1, payload_size);
+
+	uint8_t *tmp = w->prev;
+	w->prev = w->cur;
+	w->cur = tmp;
+	w->hdr.num_frames++;
+}
+
+// Converts fb tile row by tile row, bottom first, as its bands complete, then writes the changed tiles.
+void delta_writer_write_frame(struct delta_writer *w, struct framebuffer_pt4 *fb, struct frame_progress *progress) {
+	const int height = w->hdr.height;
+	const int ts = w->hdr.tile_size;
+	for (int ty = w->tiles_y - 1; ty >= 0; ty--) {
+		int y0 = ty * ts;
+		int y1 = y0 + ts < height ? y0 + ts : height;
+		if (progress)
+			frame_progress_wait_rows(progress, y0, y1);
+		for (int y = y0; y < y1; y++)
+			bmp_convert_row(fb, y, w->cur + bmp_pixel_offset(w->row_size, height, 0, y));
+	}
+	write_tiles(w);
+}
+
+// Writes the previous frame again: no tiles, or all of them if a keyframe is due.
+void delta_writer_repeat_frame(struct delta_writer *w) {
+	memcpy(w->cur, w->prev, (size_t)w->row_size * w->hdr.height);
+	write_tiles(w);
+}
+
+void delta_writer_close(struct delta_writer *w) {
+	if (fseek(w->f, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "error writing delta container '%s': %d %s\n", w->path, errno, strerror(errno));
+		exit(1);
+	}
+	write_or_exit(w, &w->hdr, sizeof(w->hdr), 1);
+	if (fclose(w->f) != 0) {
+		fprintf(stderr, "error writing delta container '%s': %d %s\n", w->path, errno, strerror(errno));
+		exit(1);
+	}
+	free(w->path);
+	free(w->prev);
+	free(w->cur);
+	free(w->changed);
+	free(w->payload);
+	free(w);
+}
+
+// Largest width, height and tile size the reader accepts; keeps tile counts and buffer sizes of a corrupt header in range.
+#define DELTA_MAX_DIMENSION	32768
+
+// Whether a frame's tile list is what the writer produces: indices of tiles in the image, ascending. Anything
+// else comes from a corrupt file and would have its tiles copied outside the image.
+static int tiles_valid(const struct delta_reader *r, const uint32_t *index, uint32_t n) {
+	uint32_t num_tiles = (uint32_t)r->tiles_x * r->tiles_y;
+	for (uint32_t i = 0; i < n; i++)
+		if (index[i] >= num_tiles || (i > 0 && index[i] <= index[i - 1]))
+			return 0;
+	return 1;
+}
+
+static size_t tiles_payload_size(const struct delta_reader *r, const uint32_t *index, uint32_t n) {
+	size_t size = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		int x0, y0, tw, th;
+		tile_rect(r->tiles_x, r->hdr.tile_size, r->hdr.width, r->hdr.height, index[i], &x0, &y0, &tw, &th);
+		size += 3 * tw * th;
+	}
+	return size;
+}
+
+struct delta_reader *delta_reader_open(const char *path) {
+	struct delta_reader *r = calloc(1, sizeof(*r));
+	if ((r->f = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "error opening delta container '%s': %d %s\n", path, errno, strerror(errno));
+		free(r);
+		return NULL;
+	}
+	if (fread(&r->hdr, sizeof(r->hdr), 1, r->f) != 1 || memcmp(r->hdr.magic, DELTA_MAGIC, sizeof(r->hdr.magic)) != 0 ||
+			r->hdr.version != DELTA_VERSION || r->hdr.tile_size == 0 || r->hdr.tile_size > DELTA_MAX_DIMENSION ||
+			r->hdr.width == 0 || r->hdr.width > DELTA_MAX_DIMENSION || r->hdr.height == 0 ||
+			r->hdr.height > DELTA_MAX_DIMENSION || r->hdr.keyframe_interval == 0) {
+		fprintf(stderr, "'%s' is not a version %d delta container\n", path, DELTA_VERSION);
+		delta_reader_close(r);
+		return NULL;
+	}
+
+	r->tiles_x = (r->hdr.width + r->hdr.tile_size - 1) / r->hdr.tile_size;
+	r->tiles_y = (r->hdr.height + r->hdr.tile_size - 1) / r->hdr.tile_size;
+	r->row_size = bmp_row_size(r->hdr.width);
+	r->image = calloc(r->hdr.height, r->row_size);
+	r->index = malloc(sizeof(*r->index) * r->tiles_x * r->tiles_y);
+	r->payload = malloc((size_t)r->tiles_x * r->tiles_y * 3 * r->hdr.tile_size * r->hdr.tile_size);
+	r->frame_offsets = malloc(sizeof(*r->frame_offsets) * (r->hdr.num_frames + 1));
+
+	// index the frames up front so any frame can be reached from its keyframe
+	for (uint32_t i = 0; i < r->hdr.num_frames; i++) {
+		struct delta_frame_header fh;
+		r->frame_offsets[i] = ftell(r->f);
+		if (fread(&fh, sizeof(fh), 1, r->f) != 1 || fh.num_tiles > (uint32_t)(r->tiles_x * r->tiles_y) ||
+				fread(r->index, sizeof(*r->index), fh.num_tiles, r->f) != fh.num_tiles ||
+				!tiles_valid(r, r->index, fh.num_tiles)) {
+			fprintf(stderr, "'%s' is truncated or corrupt at frame %u\n", path, i);
+			r->hdr.num_frames = i;
+			break;
+		}
+		fseek(r->f, tiles_payload_size(r, r->index, fh.num_tiles), SEEK_CUR);
+	}
+	delta_reader_seek(r, 0);
+	return r;
+}
+
+// Positions r so that the next delta_reader_next() leaves frame in r->image.
+int delta_reader_seek(struct delta_reader *r, int frame) {
+	if (frame < 0 || (uint32_t)frame >= r->hdr.num_frames)
+		return -1;
+	int keyframe = frame - frame % r->hdr.keyframe_interval;
+	fseek(r->f, r->frame_offsets[keyframe], SEEK_SET);
+	r->next_frame = keyframe;
+	while (r->next_frame < frame)
+		if (delta_reader_next(r) < 0)
+			return -1;
+	return 0;
+}
+
+// Decodes the next frame into r->image. Returns the frame number, or -1 at the end of the container.
+int delta_reader_next(struct delta_reader *r) {
+	if ((uint32_t)r->next_frame >= r->hdr.num_frames)
+		return -1;
+
+	struct delta_frame_header fh;
+	if (fread(&fh, sizeof(fh), 1, r->f) != 1)
+		return -1;
+	uint32_t *index = r->index;
+	const uint8_t *data = r->payload;
+	if (fh.num_tiles > (uint32_t)(r->tiles_x * r->tiles_y) || fread(index, sizeof(*index), fh.num_tiles, r->f) != fh.num_tiles ||
+			!tiles_valid(r, index, fh.num_tiles))
+		return -1;
+	size_t size = tiles_payload_size(r, index, fh.num_tiles);
+	if (fread(r->payload, 1, size, r->f) != size)
+		return -1;
+
+	for (uint32_t i = 0; i < fh.num_tiles; i++) {
+		int x0, y0, tw, th;
+		tile_rect(r->tiles_x, r->hdr.tile_size, r->hdr.width, r->hdr.height, index[i], &x0, &y0, &tw, &th);
+		for (int y = y0; y < y0 + th; y++) {
+			memcpy(r->image + bmp_pixel_offset(r->row_size, r->hdr.height, x0, y), data, 3 * tw);
+			data += 3 * tw;
+		}
+	}
+	return r->next_frame++;
+}
+
+void delta_reader_close(struct delta_reader *r) {
+	if (r->f) fclose(r->f);
+	free(r->frame_offsets);
+	free(r->image);
+	free(r->index);
+	free(r->payload);
+	free(r);
+}
@@ -0,0 +1,79 @@
+#ifndef RAY_DELTA_H__
+#define RAY_DELTA_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "ray_render.h"
+
+// Delta frame container. A keyframe every keyframe_interval frames stores every tile, the frames in between
+// only store the tiles whose 8 bit pixels differ from the previous frame. Layout:
+//
+//	struct delta_file_header
+//	per frame:	struct delta_frame_header
+//			uint32_t tile index[num_tiles]		(row-major, tile x + tile y * tiles_x, ascending)
+//			tile payloads in index order		(tile rows top to bottom, 3 * tile width bytes each, BGR)
+//
+// Decoded images are kept in BMP pixel layout (bottom-up rows of bmp_row_size() bytes) so they can be written
+// out behind a BMP header as is.
+
+#define DELTA_MAGIC		"RDLT"
+#define DELTA_VERSION		1
+#define DELTA_TILE_SIZE		16
+#define DELTA_KEYFRAME		1
+
+struct delta_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t tile_size;
+	uint32_t keyframe_interval;
+	uint32_t num_frames;		// patched in when the writer is closed
+	uint32_t first_frame;		// scene frame of the container's frame 0, for runs of a frame range
+};
+
+struct delta_frame_header {
+	uint32_t frame;
+	uint32_t flags;
+	uint32_t num_tiles;
+	uint32_t reserved;
+};
+
+struct delta_writer {
+	FILE *f;
+	char *path;
+	struct delta_file_header hdr;
+	int tiles_x;
+	int tiles_y;
+	int row_size;
+	uint8_t *prev;			// previous frame, BMP pixel layout
+	uint8_t *cur;
+	uint32_t *changed;		// tile indices of the frame being written
+	uint8_t *payload;
+};
+
+struct delta_writer *delta_writer_open(const char *path, int width, int height, int keyframe_interval);
+void delta_writer_write_frame(struct delta_writer *w, struct framebuffer_pt4 *fb, struct frame_progress *progress);
+void delta_writer_repeat_frame(struct delta_writer *w);
+void delta_writer_close(struct delta_writer *w);
+
+struct delta_reader {
+	FILE *f;
+	struct delta_file_header hdr;
+	int tiles_x;
+	int tiles_y;
+	int row_size;
+	long *frame_offsets;		// file offset of every frame header
+	int next_frame;			// frame that image will hold after the next delta_reader_next()
+	uint8_t *image;			// BMP pixel layout
+	uint32_t *index;
+	uint8_t *payload;
+};
+
+struct delta_reader *delta_reader_open(const char *path);
+int delta_reader_seek(struct delta_reader *r, int frame);
+int delta_reader_next(struct delta_reader *r);
+void delta_reader_close(struct delta_reader *r);
+
+#endif	// RAY_DELTA_H__
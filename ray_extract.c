@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ray_bmp.h"
+#include "ray_delta.h"
+#include "ray_pack.h"
+
+// Turns the frames of a multi-frame output container back into BMPs, named by scene frame like the bmp output
+// format, so containers from runs over different frame ranges extract into one sequence.
+
+static int write_bmp_image(const char *path, int width, int height, const uint8_t *image) {
+	FILE *f;
+	if ((f = fopen(path, "wb")) == NULL) {
+		fprintf(stderr, "error opening BMP '%s' for writing: %d %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	uint8_t headers[BMP_HEADER_SIZE];
+	bmp_fill_headers(headers, width, height);
+	fwrite(headers, sizeof(headers), 1, f);
+	fwrite(image, bmp_row_size(width), height, f);
+	fclose(f);
+	return 0;
+}
+
+static int extract_delta(const char *container, const char *prefix, int only_frame) {
+	struct delta_reader *r = delta_reader_open(container);
+	if (r == NULL)
+		return 1;
+
+	int first = 0;
+	int base = r->hdr.first_frame;
+	if (only_frame >= 0) {
+		only_frame -= base;
+		if (only_frame < 0 || delta_reader_seek(r, only_frame) != 0) {
+			fprintf(stderr, "'%s' has no frame %d\n", container, only_frame + base);
+			delta_reader_close(r);
+			return 1;
+		}
+		first = only_frame;
+	}
+
+	int frame;
+	while ((frame = delta_reader_next(r)) >= first) {
+		char path[256];
+		snprintf(path, sizeof(path), "%s-%05d.bmp", prefix, base + frame);
+		if (write_bmp_image(path, r->hdr.width, r->hdr.height, r->image) != 0)
+			break;
+		if (frame == only_frame)
+			break;
+	}
+	delta_reader_close(r);
+	return 0;
+}
+
+static int extract_pack(const char *container, const char *prefix, int only_frame) {
+	struct pack_file *p = pack_open(container);
+	if (p == NULL)
+		return 1;
+
+	int ret = 0;
+	uint32_t base = p->hdr->first_frame;
+	for (uint32_t frame = 0; frame < p->hdr->num_frames; frame++) {
+		if (only_frame >= 0 && base + frame != (uint32_t)only_frame)
+			continue;
+		char path[256];
+		snprintf(path, sizeof(path), "%s-%05u.bmp", prefix, base + frame);
+		FILE *f;
+		if ((f = fopen(path, "wb")) == NULL) {
+			fprintf(stderr, "error opening BMP '%s' for writing: %d %s\n", path, errno, strerror(errno));
+			ret = 1;
+			break;
+		}
+		fwrite(pack_frame(p, frame), p->hdr->frame_size, 1, f);
+		fclose(f);
+	}
+	if (only_frame >= 0 && ((uint32_t)only_frame < base || (uint32_t)only_frame - base >= p->hdr->num_frames)) {
+		fprintf(stderr, "'%s' has no frame %d\n", container, only_frame);
+		ret = 1;
+	}
+	pack_close(p);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <container> <output prefix> [frame]\n", argv[0]);
+		return 1;
+	}
+	int only_frame = argc > 3 ? atoi(argv[3]) : -1;
+
+	FILE *f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "error opening '%s': %d %s\n", argv[1], errno, strerror(errno));
+		return 1;
+	}
+	char magic[4] = {0};
+	size_t n = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+
+	if (n == sizeof(magic) && memcmp(magic, DELTA_MAGIC, sizeof(magic)) == 0)
+		return extract_delta(argv[1], argv[2], only_frame);
+	if (n == sizeof(magic) && memcmp(magic, PACK_MAGIC, sizeof(magic)) == 0)
+		return extract_pack(argv[1], argv[2], only_frame);
+
+	fprintf(stderr, "'%s' is not a known container\n", argv[1]);
+	return 1;
+}
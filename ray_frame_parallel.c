@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ray_frame_parallel.h"
+
+int parse_parallel_mode(const char *name, enum parallel_mode *mode) {
+	if (strcmp(name, "auto") == 0) {
+		*mode = PARALLEL_AUTO;
+	} else if (strcmp(name, "tile") == 0) {
+		*mode = PARALLEL_TILE;
+	} else if (strcmp(name, "frame") == 0) {
+		*mode = PARALLEL_FRAME;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// Tile parallelism loses out when a frame has too few bands to keep every core busy, or so few pixels that the
+// per-frame setup and joins dominate; then there have to be enough frames to go round instead.
+enum parallel_mode choose_parallel_mode(enum parallel_mode requested, int width, int height, int num_frames, int nthreads) {
+	if (requested != PARALLEL_AUTO)
+		return requested;
+	if (nthreads < 2 || num_frames < 2 * nthreads)
+		return PARALLEL_TILE;
+	int num_bands = (height + RENDER_BAND_HEIGHT - 1) / RENDER_BAND_HEIGHT;
+	if ((long)width * height <= FRAME_PARALLEL_MAX_PIXELS || num_bands < 4 * nthreads)
+		return PARALLEL_FRAME;
+	return PARALLEL_TILE;
+}
+
+struct frame_scheduler {
+	const struct frame_parallel_args *args;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next_frame;			// next frame a worker will take
+	int pool_size;
+	struct framebuffer_pt4 **free_fbs;
+	int num_free;
+	struct framebuffer_pt4 **ready;	// finished frame f waits in ready[f % pool_size] until it is written
+	unsigned char *unchanged;	// per ready slot, the frame wasn't rendered as it repeats the one before
+};
+
+static void *frame_worker(void *arg) {
+	struct frame_scheduler *fs = arg;
+	const struct frame_parallel_args *a = fs->args;
+	for (;;) {
+		pthread_mutex_lock(&fs->lock);
+		while (fs->next_frame < a->num_frames && fs->num_free == 0)
+			pthread_cond_wait(&fs->cond, &fs->lock);
+		if (fs->next_frame >= a->num_frames) {
+			pthread_mutex_unlock(&fs->lock);
+			return NULL;
+		}
+		int frame = fs->next_frame++;
+		struct framebuffer_pt4 *fb = fs->free_fbs[--fs->num_free];
+		pthread_mutex_unlock(&fs->lock);
+
+		// unchanged frames still hold a buffer until written, so the frames in flight stay bounded
+		struct context view = snapshot_context(a->ctx, snapshot_ring_acquire(a->ring, frame));
+		int unchanged = snapshot_ring_unchanged(a->ring, frame);
+		if (!unchanged)
+			render_scene(fb, &view, NULL, 1);
+		snapshot_ring_release(a->ring, frame);
+
+		pthread_mutex_lock(&fs->lock);
+		fs->unchanged[frame % fs->pool_size] = unchanged;
+		fs->ready[frame % fs->pool_size] = fb;
+		pthread_cond_broadcast(&fs->cond);
+		pthread_mutex_unlock(&fs->lock);
+	}
+}
+
+void render_frames_parallel(const struct frame_parallel_args *a) {
+	struct frame_scheduler fs = { .args = a };
+	pthread_mutex_init(&fs.lock, NULL);
+	pthread_cond_init(&fs.cond, NULL);
+
+	// a frame in flight holds its buffer until written, so frames in flight stay below pool_size and
+	// frame % pool_size is unique among them
+	fs.pool_size = 2 * a->nthreads;
+	fs.free_fbs = malloc(sizeof(*fs.free_fbs) * fs.pool_size);
+	fs.ready = calloc(fs.pool_size, sizeof(*fs.ready));
+	fs.unchanged = calloc(fs.pool_size, 1);
+	for (int i = 0; i < fs.pool_size; i++)
+		fs.free_fbs[fs.num_free++] = new_framebuffer_pt4(a->width, a->height);
+
+	pthread_t *tids = malloc(sizeof(*tids) * a->nthreads);
+	for (int t = 0; t < a->nthreads; t++)
+		pthread_create(&tids[t], NULL, frame_worker, &fs);
+
+	for (int frame = 0; frame < a->num_frames; frame++) {
+		pthread_mutex_lock(&fs.lock);
+		while (fs.ready[frame % fs.pool_size] == NULL)
+			pthread_cond_wait(&fs.cond, &fs.lock);
+		struct framebuffer_pt4 *fb = fs.ready[frame % fs.pool_size];
+		int unchanged = fs.unchanged[frame % fs.pool_size];
+		fs.ready[frame % fs.pool_size] = NULL;
+		pthread_mutex_unlock(&fs.lock);
+
+		if (unchanged) {
+			output_repeat_frame(a->output, frame);
+		} else {
+			output_write_frame(a->output, frame, fb, NULL);
+			if (a->console)
+				console_preview_frame(a->console, fb);
+		}
+
+		pthread_mutex_lock(&fs.lock);
+		fs.free_fbs[fs.num_free++] = fb;
+		pthread_cond_broadcast(&fs.cond);
+		pthread_mutex_unlock(&fs.lock);
+	}
+
+	for (int t = 0; t < a->nthreads; t++)
+		pthread_join(tids[t], NULL);
+	free(tids);
+	for (int i = 0; i < fs.num_free; i++)
+		free_framebuffer_pt4(fs.free_fbs[i]);
+	free(fs.free_fbs);
+	free(fs.ready);
+	free(fs.unchanged);
+	pthread_cond_destroy(&fs.cond);
+	pthread_mutex_destroy(&fs.lock);
+}
@@ -0,0 +1,36 @@
+#ifndef RAY_FRAME_PARALLEL_H__
+#define RAY_FRAME_PARALLEL_H__
+
+#include "ray_ast.h"
+#include "ray_output.h"
+#include "ray_snapshot.h"
+#include "ray_console.h"
+
+// Frame parallel rendering: every worker renders whole frames, single threaded, into a framebuffer from a
+// shared pool, and the calling thread hands finished frames to the output strictly in frame order.
+
+enum parallel_mode {
+	PARALLEL_AUTO,
+	PARALLEL_TILE,		// all threads work on the bands of one frame at a time
+	PARALLEL_FRAME,		// each thread renders its own frame
+};
+
+// Frames at most this many pixels are rendered frame parallel in PARALLEL_AUTO mode.
+#define FRAME_PARALLEL_MAX_PIXELS	(640 * 480)
+
+struct frame_parallel_args {
+	const struct context *ctx;
+	struct snapshot_ring *ring;
+	struct output *output;
+	struct console_preview *console;
+	int width;
+	int height;
+	int num_frames;
+	int nthreads;
+};
+
+int parse_parallel_mode(const char *name, enum parallel_mode *mode);
+enum parallel_mode choose_parallel_mode(enum parallel_mode requested, int width, int height, int num_frames, int nthreads);
+void render_frames_parallel(const struct frame_parallel_args *args);
+
+#endif	// RAY_FRAME_PARALLEL_H__
@@ -4,7 +4,46 @@
 #include "ray_ast.h"
 
 int intersect_ray_sphere(const ray *r, const sphere *s, double *t, pt3 *q);
-int intersect_ray_plane(const ray *r, const plane *p, double *t, pt3 *q);
+
+// The ray tests are inline so that every render kernel, whatever instruction set it is built for, has its own
+// copy of them.
+static inline int intersect_ray_sphere_at(const ray *r, const pt3 *center, double radius, double *t, pt3 *q) {
+	pt3 m = pt3_sub(&r->origin, center);
+	double b = pt3_dot(&m, &r->direction);
+	double c = pt3_dot(&m, &m) - radius * radius;
+
+	// Exit if r’s origin outside s (c > 0) and r pointing away from s (b > 0) 
+	if (c > 0.0f && b > 0.0f) return 0; 
+	double discr = b*b - c; 
+
+	// A negative discriminant corresponds to ray missing sphere
+	if (discr < 0.0f) return 0; 
+
+	// Ray now found to intersect sphere, compute smallest t value of intersection
+	double t1 = -b - sqrt(discr);
+
+	// If t is negative, ray started inside sphere so clamp t to zero 
+	if (t1 < 0.0f) t1 = 0.0f; 
+	*t = t1;
+	*q = ray_project(r, t1);
+
+	return 1;
+}
+
+static inline int intersect_ray_plane(const ray *r, const plane *p, double *t, pt3 *q) {
+	double d = pt3_dot(&r->direction, &p->normal);
+	if (d > 0.000001 || d < -0.000001) {
+		pt3 origin_diff = pt3_sub(&p->position, &r->origin);
+		*t = pt3_dot(&origin_diff, &p->normal) / d;
+		if (*t > 0) {
+			*q = ray_project(r, *t);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
 int intersect_sphere_sphere(const sphere *a, const sphere *b, pt3 *pos, pt3 *normal);
 int intersect_sphere_plane(const sphere *a, const plane *b);
 
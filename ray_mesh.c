@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ray_mesh.h"
+
+#define BVH_BINS	16
+
+struct bvh_range {
+	uint32_t node;
+	uint32_t first;
+	uint32_t count;
+	int depth;
+};
+
+static float half_area(const float *lo, const float *hi) {
+	float d[3];
+	for (int k = 0; k < 3; k++)
+		d[k] = hi[k] > lo[k] ? hi[k] - lo[k] : 0;
+	return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+static void bounds_empty(float *lo, float *hi) {
+	for (int k = 0; k < 3; k++) {
+		lo[k] = INFINITY;
+		hi[k] = -INFINITY;
+	}
+}
+
+static void bounds_grow(float *lo, float *hi, const float *plo, const float *phi) {
+	for (int k = 0; k < 3; k++) {
+		if (plo[k] < lo[k])
+			lo[k] = plo[k];
+		if (phi[k] > hi[k])
+			hi[k] = phi[k];
+	}
+}
+
+static float centroid(const float (*lo)[3], const float (*hi)[3], uint32_t i, int k) {
+	return (lo[i][k] + hi[i][k]) * 0.5f;
+}
+
+static inline int bin_of(float c, float lo, float scale) {
+	int b = (int)((c - lo) * scale);
+	return b < BVH_BINS ? b : BVH_BINS - 1;
+}
+
+// Splits the range by binning centroids along its longest axis, returning how many primitives go left, or 0 to
+// make it a leaf.
+static uint32_t bvh_split(uint32_t *order, const float (*lo)[3], const float (*hi)[3], const struct bvh_node *node,
+		uint32_t count) {
+	float clo[3], chi[3];
+	bounds_empty(clo, chi);
+	for (uint32_t i = 0; i < count; i++) {
+		float c[3] = { centroid(lo, hi, order[i], 0), centroid(lo, hi, order[i], 1), centroid(lo, hi, order[i], 2) };
+		bounds_grow(clo, chi, c, c);
+	}
+	int axis = 0;
+	for (int k = 1; k < 3; k++)
+		if (chi[k] - clo[k] > chi[axis] - clo[axis])
+			axis = k;
+	float extent = chi[axis] - clo[axis];
+	if (!(extent > 0))
+		return count <= BVH_LEAF_SIZE ? 0 : count / 2;
+
+	uint32_t bin_count[BVH_BINS] = {0};
+	float bin_lo[BVH_BINS][3], bin_hi[BVH_BINS][3];
+	for (int b = 0; b < BVH_BINS; b++)
+		bounds_empty(bin_lo[b], bin_hi[b]);
+	float scale = BVH_BINS / extent;
+#define BIN_OF(i)	bin_of(centroid(lo, hi, (i), axis), clo[axis], scale)
+	for (uint32_t i = 0; i < count; i++) {
+		int b = BIN_OF(order[i]);
+		bin_count[b]++;
+		bounds_grow(bin_lo[b], bin_hi[b], lo[order[i]], hi[order[i]]);
+	}
+
+	// Cost of splitting after bin s - 1 is the area weighted primitive count on both sides.
+	float right_cost[BVH_BINS];
+	float acc_lo[3], acc_hi[3];
+	bounds_empty(acc_lo, acc_hi);
+	uint32_t n = 0;
+	for (int s = BVH_BINS - 1; s > 0; s--) {
+		bounds_grow(acc_lo, acc_hi, bin_lo[s], bin_hi[s]);
+		n += bin_count[s];
+		right_cost[s] = half_area(acc_lo, acc_hi) * n;
+	}
+	bounds_empty(acc_lo, acc_hi);
+	n = 0;
+	int best = 0;
+	float best_cost = INFINITY;
+	for (int s = 1; s < BVH_BINS; s++) {
+		bounds_grow(acc_lo, acc_hi, bin_lo[s - 1], bin_hi[s - 1]);
+		n += bin_count[s - 1];
+		float cost = half_area(acc_lo, acc_hi) * n + right_cost[s];
+		if (n > 0 && n < count && cost < best_cost) {
+			best_cost = cost;
+			best = s;
+		}
+	}
+	// Splitting costs a node visit on top, taken as one intersection test.
+	float area = half_area(node->lo, node->hi);
+	if (best == 0 || (count <= BVH_LEAF_SIZE && best_cost + area >= area * count))
+		return count <= BVH_LEAF_SIZE ? 0 : count / 2;
+
+	uint32_t left = 0, right = count;
+	while (left < right) {
+		if (BIN_OF(order[left]) < best) {
+			left++;
+		} else {
+			uint32_t t = order[left];
+			order[left] = order[--right];
+			order[right] = t;
+		}
+	}
+#undef BIN_OF
+	return left;
+}
+
+void bvh_build(struct bvh *b, const float (*lo)[3], const float (*hi)[3], int n) {
+	b->order = malloc(sizeof(*b->order) * (n > 0 ? n : 1));
+	for (int i = 0; i < n; i++)
+		b->order[i] = i;
+	b->nodes = malloc(sizeof(*b->nodes) * (n > 0 ? 2 * n - 1 : 1));
+	b->num_nodes = 1;
+
+	// Depth first, so at most one range per level waits on the stack besides the one being split.
+	struct bvh_range stack[BVH_MAX_DEPTH + 2];
+	int sp = 0;
+	stack[sp++] = (struct bvh_range){ 0, 0, n, 0 };
+	while (sp > 0) {
+		struct bvh_range r = stack[--sp];
+		struct bvh_node *node = &b->nodes[r.node];
+		uint32_t *order = b->order + r.first;
+		bounds_empty(node->lo, node->hi);
+		for (uint32_t i = 0; i < r.count; i++)
+			bounds_grow(node->lo, node->hi, lo[order[i]], hi[order[i]]);
+		uint32_t left = r.count > 1 && r.depth < BVH_MAX_DEPTH ? bvh_split(order, lo, hi, node, r.count) : 0;
+		if (left == 0) {
+			node->index = r.first;
+			node->count = r.count;
+			continue;
+		}
+		node->index = b->num_nodes;
+		node->count = 0;
+		b->num_nodes += 2;
+		stack[sp++] = (struct bvh_range){ node->index + 1, r.first + left, r.count - left, r.depth + 1 };
+		stack[sp++] = (struct bvh_range){ node->index, r.first, left, r.depth + 1 };
+	}
+	b->nodes = realloc(b->nodes, sizeof(*b->nodes) * b->num_nodes);
+}
+
+void free_bvh(struct bvh *b) {
+	if (b == NULL)
+		return;
+	free(b->nodes);
+	free(b->order);
+	free(b);
+}
+
+struct mesh *mesh_build(const float *vertices, int num_vertices, const uint32_t *indices, int num_triangles) {
+	if (num_triangles <= 0)
+		return NULL;
+	for (long i = 0; i < 3L * num_triangles; i++)
+		if (indices[i] >= (uint32_t)num_vertices)
+			return NULL;
+
+	float (*lo)[3] = malloc(sizeof(*lo) * num_triangles);
+	float (*hi)[3] = malloc(sizeof(*hi) * num_triangles);
+	for (int i = 0; i < num_triangles; i++) {
+		bounds_empty(lo[i], hi[i]);
+		for (int c = 0; c < 3; c++) {
+			const float *v = &vertices[3 * indices[3 * i + c]];
+			bounds_grow(lo[i], hi[i], v, v);
+		}
+	}
+	struct mesh *m = calloc(1, sizeof(*m));
+	atomic_init(&m->refs, 1);
+	m->num_triangles = num_triangles;
+	bvh_build(&m->bvh, (const float (*)[3])lo, (const float (*)[3])hi, num_triangles);
+	free(lo);
+	free(hi);
+
+	// Leaves then cover ranges of the triangles themselves, with no index to follow.
+	m->triangles = malloc(sizeof(*m->triangles) * num_triangles);
+	for (int i = 0; i < num_triangles; i++) {
+		const uint32_t *t = &indices[3 * m->bvh.order[i]];
+		for (int c = 0; c < 3; c++)
+			memcpy(m->triangles[i].v[c], &vertices[3 * t[c]], sizeof(float) * 3);
+	}
+	free(m->bvh.order);
+	m->bvh.order = NULL;
+	return m;
+}
+
+void mesh_acquire(struct mesh *m) {
+	atomic_fetch_add(&m->refs, 1);
+}
+
+void mesh_release(struct mesh *m) {
+	if (m == NULL || atomic_fetch_sub(&m->refs, 1) != 1)
+		return;
+	free(m->triangles);
+	free(m->bvh.nodes);
+	free(m);
+}
+
+size_t mesh_bytes(const struct mesh *m) {
+	return sizeof(*m) + sizeof(*m->triangles) * m->num_triangles + sizeof(*m->bvh.nodes) * m->bvh.num_nodes;
+}
+
+struct mesh_arrays {
+	float *vertices;
+	long num_vertices;
+	long vertices_cap;
+	uint32_t *indices;
+	long num_indices;
+	long indices_cap;
+};
+
+static void add_vertex(struct mesh_arrays *a, const float *v) {
+	if (a->num_vertices == a->vertices_cap) {
+		a->vertices_cap = a->vertices_cap < 1024 ? 1024 : a->vertices_cap * 2;
+		a->vertices = realloc(a->vertices, sizeof(float) * 3 * a->vertices_cap);
+	}
+	memcpy(&a->vertices[3 * a->num_vertices++], v, sizeof(float) * 3);
+}
+
+static void add_triangle(struct mesh_arrays *a, uint32_t i0, uint32_t i1, uint32_t i2) {
+	if (a->num_indices + 3 > a->indices_cap) {
+		a->indices_cap = a->indices_cap < 3072 ? 3072 : a->indices_cap * 2;
+		a->indices = realloc(a->indices, sizeof(uint32_t) * a->indices_cap);
+	}
+	a->indices[a->num_indices++] = i0;
+	a->indices[a->num_indices++] = i1;
+	a->indices[a->num_indices++] = i2;
+}
+
+// One v or f line of an OBJ file; every other kind of line is skipped. Returns 0 if the line is malformed.
+static int parse_obj_line(struct mesh_arrays *a, const char *p) {
+	while (*p == ' ' || *p == '\t')
+		p++;
+	if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+		float v[3];
+		char *end;
+		p++;
+		for (int k = 0; k < 3; k++, p = end) {
+			v[k] = strtof(p, &end);
+			if (end == p)
+				return 0;
+		}
+		add_vertex(a, v);
+		return 1;
+	}
+	if (!(p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')))
+		return 1;
+	uint32_t first = 0, prev = 0;
+	int corners = 0;
+	for (p++;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == 0 || *p == '\n' || *p == '\r' || *p == '#')
+			break;
+		char *end;
+		long i = strtol(p, &end, 10);
+		if (end == p)
+			return 0;
+		// Texture and normal indices after the slashes are not used.
+		for (p = end; *p && !isspace((unsigned char)*p); p++)
+			;
+		i = i > 0 ? i - 1 : a->num_vertices + i;
+		if (i < 0 || i > UINT32_MAX)
+			return 0;
+		if (corners == 0)
+			first = i;
+		else if (corners >= 2)
+			add_triangle(a, first, prev, i);
+		prev = i;
+		corners++;
+	}
+	return corners >= 3;
+}
+
+static int read_obj(FILE *f, const char *path, struct mesh_arrays *a) {
+	char *line = NULL;
+	size_t cap = 0;
+	int lineno = 0, ok = 1;
+	while (ok && getline(&line, &cap, f) > 0) {
+		lineno++;
+		if (!parse_obj_line(a, line)) {
+			fprintf(stderr, "mesh '%s': bad line %d\n", path, lineno);
+			ok = 0;
+		}
+	}
+	free(line);
+	return ok;
+}
+
+static int read_mesh_bin(FILE *f, const char *path, struct mesh_arrays *a) {
+	struct mesh_file_header h;
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.version != MESH_VERSION) {
+		fprintf(stderr, "mesh '%s': unknown binary mesh version\n", path);
+		return 0;
+	}
+	long start = ftell(f);
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f) - start;
+	fseek(f, start, SEEK_SET);
+	if ((uint64_t)h.num_vertices * 12 + (uint64_t)h.num_triangles * 12 != (uint64_t)size) {
+		fprintf(stderr, "mesh '%s': binary mesh is %ld bytes, not the %u vertices and %u triangles it claims\n",
+				path, size, h.num_vertices, h.num_triangles);
+		return 0;
+	}
+	a->num_vertices = a->vertices_cap = h.num_vertices;
+	a->num_indices = a->indices_cap = 3L * h.num_triangles;
+	a->vertices = malloc(sizeof(float) * 3 * (a->num_vertices > 0 ? a->num_vertices : 1));
+	a->indices = malloc(sizeof(uint32_t) * (a->num_indices > 0 ? a->num_indices : 1));
+	if (fread(a->vertices, sizeof(float) * 3, a->num_vertices, f) != (size_t)a->num_vertices
+	    || fread(a->indices, sizeof(uint32_t), a->num_indices, f) != (size_t)a->num_indices) {
+		fprintf(stderr, "mesh '%s': short read\n", path);
+		return 0;
+	}
+	return 1;
+}
+
+struct mesh *mesh_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "error opening mesh '%s': %d %s\n", path, errno, strerror(errno));
+		return NULL;
+	}
+	struct mesh_arrays a = {0};
+	char magic[4];
+	int binary = fread(magic, 1, 4, f) == 4 && memcmp(magic, MESH_MAGIC, 4) == 0;
+	rewind(f);
+	int ok = binary ? read_mesh_bin(f, path, &a) : read_obj(f, path, &a);
+	fclose(f);
+
+	struct mesh *m = NULL;
+	if (ok && (a.num_vertices > INT32_MAX || a.num_indices / 3 > INT32_MAX)) {
+		fprintf(stderr, "mesh '%s' is too big\n", path);
+	} else if (ok && a.num_indices == 0) {
+		fprintf(stderr, "mesh '%s' has no triangles\n", path);
+	} else if (ok) {
+		m = mesh_build(a.vertices, a.num_vertices, a.indices, a.num_indices / 3);
+		if (m == NULL)
+			fprintf(stderr, "mesh '%s' refers to vertices it does not have\n", path);
+	}
+	free(a.vertices);
+	free(a.indices);
+	return m;
+}
+
+uint32_t context_use_mesh(struct context *ctx, struct mesh *m) {
+	for (int i = 0; i < ctx->num_meshes; i++)
+		if (ctx->meshes[i] == m)
+			return i;
+	mesh_acquire(m);
+	__CONTEXT_APPEND(ctx, meshes, m);
+	return ctx->num_meshes - 1;
+}
+
+instance make_instance(const pt3 *position, const pt3 *angles, double scale, uint32_t mesh, uint32_t material) {
+	mat3 r = rotation(angles->v[0], angles->v[1], angles->v[2]);
+	instance in = { .position = *position, .mesh = mesh, .material = material };
+	// A rotation's inverse is its transpose.
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			in.to_world.m[3 * i + j] = r.m[3 * i + j] * scale;
+			in.to_local.m[3 * i + j] = r.m[3 * j + i] / scale;
+		}
+	}
+	return in;
+}
+
+static float round_down(double x) {
+	float f = (float)x;
+	return f > x ? nextafterf(f, -INFINITY) : f;
+}
+
+static float round_up(double x) {
+	float f = (float)x;
+	return f < x ? nextafterf(f, INFINITY) : f;
+}
+
+void context_build_instances(struct context *ctx) {
+	free_bvh(ctx->instance_bvh);
+	ctx->instance_bvh = NULL;
+	int n = ctx->num_instances;
+	if (n == 0)
+		return;
+	float (*lo)[3] = malloc(sizeof(*lo) * n);
+	float (*hi)[3] = malloc(sizeof(*hi) * n);
+	for (int i = 0; i < n; i++) {
+		const instance *in = &ctx->instances[i];
+		const struct bvh_node *root = &ctx->meshes[in->mesh]->bvh.nodes[0];
+		pt3 wlo = {{ INFINITY, INFINITY, INFINITY }}, whi = {{ -INFINITY, -INFINITY, -INFINITY }};
+		for (int c = 0; c < 8; c++) {
+			pt3 corner = {{ c & 1 ? root->hi[0] : root->lo[0], c & 2 ? root->hi[1] : root->lo[1],
+					c & 4 ? root->hi[2] : root->lo[2] }};
+			pt3 moved = mat3_pt3_mul(&in->to_world, &corner);
+			moved = pt3_add(&moved, &in->position);
+			wlo = pt3_min(&wlo, &moved);
+			whi = pt3_max(&whi, &moved);
+		}
+		for (int k = 0; k < 3; k++) {
+			lo[i][k] = round_down(wlo.v[k]);
+			hi[i][k] = round_up(whi.v[k]);
+		}
+	}
+	ctx->instance_bvh = calloc(1, sizeof(*ctx->instance_bvh));
+	bvh_build(ctx->instance_bvh, (const float (*)[3])lo, (const float (*)[3])hi, n);
+	free(lo);
+	free(hi);
+}
+
+// Slab test, t_enter being where the ray enters the box. Directions with a zero component give infinities,
+// and the NaNs of a ray in a box face fail every comparison so are ignored.
+static inline int hit_box(const struct bvh_node *n, const double *o, const double *inv, double t_max, double *t_enter) {
+	double t0 = 0, t1 = t_max;
+	for (int k = 0; k < 3; k++) {
+		double a = (n->lo[k] - o[k]) * inv[k];
+		double b = (n->hi[k] - o[k]) * inv[k];
+		if (a > b) {
+			double t = a;
+			a = b;
+			b = t;
+		}
+		if (a > t0)
+			t0 = a;
+		if (b < t1)
+			t1 = b;
+	}
+	*t_enter = t0;
+	return t0 <= t1;
+}
+
+struct bvh_stack_entry {
+	uint32_t node;
+	double t_enter;
+};
+
+// Pushes the children of n that r hits before t_max, the nearer one last so it is visited first.
+static inline int push_children(const struct bvh_node *nodes, const struct bvh_node *n, const double *o,
+		const double *inv, double t_max, struct bvh_stack_entry *stack, int sp) {
+	double t[2];
+	int hit[2];
+	for (int c = 0; c < 2; c++)
+		hit[c] = hit_box(&nodes[n->index + c], o, inv, t_max, &t[c]);
+	int near = t[1] < t[0];
+	if (hit[!near])
+		stack[sp++] = (struct bvh_stack_entry){ n->index + !near, t[!near] };
+	if (hit[near])
+		stack[sp++] = (struct bvh_stack_entry){ n->index + near, t[near] };
+	return sp;
+}
+
+// Möller-Trumbore, in doubles like the rest of the renderer.
+static inline int intersect_ray_triangle(const ray *r, const struct mesh_triangle *tri, double t_max, double *t,
+		pt3 *normal) {
+	pt3 v0 = {{ tri->v[0][0], tri->v[0][1], tri->v[0][2] }};
+	pt3 e1 = {{ tri->v[1][0] - v0.v[0], tri->v[1][1] - v0.v[1], tri->v[1][2] - v0.v[2] }};
+	pt3 e2 = {{ tri->v[2][0] - v0.v[0], tri->v[2][1] - v0.v[1], tri->v[2][2] - v0.v[2] }};
+	pt3 p = pt3_cross(&r->direction, &e2);
+	double det = pt3_dot(&e1, &p);
+	if (fabs(det) < 1e-20)
+		return 0;
+	double inv = 1.0 / det;
+	pt3 s = pt3_sub(&r->origin, &v0);
+	double u = pt3_dot(&s, &p) * inv;
+	if (u < 0 || u > 1)
+		return 0;
+	pt3 q = pt3_cross(&s, &e1);
+	double v = pt3_dot(&r->direction, &q) * inv;
+	if (v < 0 || u + v > 1)
+		return 0;
+	double hit_t = pt3_dot(&e2, &q) * inv;
+	if (!(hit_t > 1e-9 && hit_t < t_max))
+		return 0;
+	*t = hit_t;
+	*normal = pt3_cross(&e1, &e2);
+	return 1;
+}
+
+int intersect_ray_mesh(const struct mesh *m, const ray *r, double *t_max, int any, pt3 *normal) {
+	double o[3], inv[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = r->origin.v[k];
+		inv[k] = 1.0 / r->direction.v[k];
+	}
+	const struct bvh_node *nodes = m->bvh.nodes;
+	struct bvh_stack_entry stack[BVH_MAX_DEPTH + 2];
+	int sp = 0, hit = 0;
+	double t;
+	if (hit_box(&nodes[0], o, inv, *t_max, &t))
+		stack[sp++] = (struct bvh_stack_entry){ 0, t };
+	while (sp > 0) {
+		struct bvh_stack_entry e = stack[--sp];
+		if (e.t_enter > *t_max)
+			continue;
+		const struct bvh_node *n = &nodes[e.node];
+		if (n->count == 0) {
+			sp = push_children(nodes, n, o, inv, *t_max, stack, sp);
+			continue;
+		}
+		for (uint32_t i = n->index; i < n->index + n->count; i++) {
+			if (intersect_ray_triangle(r, &m->triangles[i], *t_max, &t, normal)) {
+				*t_max = t;
+				hit = 1;
+				if (any)
+					return 1;
+			}
+		}
+	}
+	return hit;
+}
+
+int intersect_ray_instances(const struct context *ctx, const ray *r, double t_max, int any, double *t, pt3 *normal) {
+	const struct bvh *b = ctx->instance_bvh;
+	if (b == NULL)
+		return -1;
+	double o[3], inv[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = r->origin.v[k];
+		inv[k] = 1.0 / r->direction.v[k];
+	}
+	struct bvh_stack_entry stack[BVH_MAX_DEPTH + 2];
+	int sp = 0, best = -1;
+	double enter;
+	pt3 local_normal = {0};
+	if (hit_box(&b->nodes[0], o, inv, t_max, &enter))
+		stack[sp++] = (struct bvh_stack_entry){ 0, enter };
+	while (sp > 0 && !(any && best >= 0)) {
+		struct bvh_stack_entry e = stack[--sp];
+		if (e.t_enter > t_max)
+			continue;
+		const struct bvh_node *n = &b->nodes[e.node];
+		if (n->count == 0) {
+			sp = push_children(b->nodes, n, o, inv, t_max, stack, sp);
+			continue;
+		}
+		for (uint32_t i = n->index; i < n->index + n->count; i++) {
+			const instance *in = &ctx->instances[b->order[i]];
+			// A linear map keeps the ray parameter, so local hits compare with world ones as they are.
+			pt3 offset = pt3_sub(&r->origin, &in->position);
+			ray local = { mat3_pt3_mul(&in->to_local, &offset), mat3_pt3_mul(&in->to_local, &r->direction) };
+			if (intersect_ray_mesh(ctx->meshes[in->mesh], &local, &t_max, any, &local_normal)) {
+				best = b->order[i];
+				if (any)
+					break;
+			}
+		}
+	}
+	if (best < 0)
+		return -1;
+	// Rotation and uniform scale take normals along with everything else.
+	*normal = mat3_pt3_mul(&ctx->instances[best].to_world, &local_normal);
+	pt3_normalize_mut(normal);
+	if (pt3_dot(normal, &r->direction) > 0)
+		*normal = pt3_mul(normal, -1);
+	*t = t_max;
+	return best;
+}
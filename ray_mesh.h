@@ -0,0 +1,87 @@
+#ifndef RAY_MESH_H__
+#define RAY_MESH_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "ray_ast.h"
+
+// Triangle meshes, loaded once and placed any number of times by instances. Every mesh has a bounding volume
+// hierarchy over its triangles built when it is loaded, and the context has one over its instances' bounds, so
+// a ray walks the instance tree, takes itself into the space of each instance it reaches and walks that mesh's
+// tree there. Memory goes with the distinct meshes, not with how often they are placed.
+//
+// Meshes are read from Wavefront OBJ (v and f lines; faces with more than three corners are fanned) or from
+// this binary layout, all little endian:
+//
+//	struct mesh_file_header
+//	float vertices[num_vertices][3]
+//	uint32_t triangles[num_triangles][3]	indices into vertices
+
+#define MESH_MAGIC	"RMSH"
+#define MESH_VERSION	1
+
+struct mesh_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_vertices;
+	uint32_t num_triangles;
+};
+
+#define BVH_LEAF_SIZE	4	// primitives a leaf is split below
+#define BVH_MAX_DEPTH	48	// deeper ranges become leaves, so traversal stacks have a fixed size
+
+// Bounds are floats, rounded outward where they come from doubles, so a node is half a cache line. An inner
+// node's children are next to each other, the first at index.
+struct bvh_node {
+	float lo[3];
+	float hi[3];
+	uint32_t index;		// first primitive for a leaf, first child otherwise
+	uint32_t count;		// primitives in a leaf, 0 otherwise
+};
+
+struct bvh {
+	struct bvh_node *nodes;
+	int num_nodes;
+	uint32_t *order;	// primitive indices, leaves hold ranges of it
+};
+
+// Builds b over n primitives with the given bounds, splitting by the surface area heuristic.
+void bvh_build(struct bvh *b, const float (*lo)[3], const float (*hi)[3], int n);
+
+struct mesh_triangle {
+	float v[3][3];
+};
+
+struct mesh {
+	atomic_int refs;
+	int num_triangles;
+	struct mesh_triangle *triangles;	// in bvh leaf order
+	struct bvh bvh;				// without order, the triangles are sorted instead
+};
+
+// A mesh of the given triangles with one reference, NULL if there are no triangles or an index is out of range.
+struct mesh *mesh_build(const float *vertices, int num_vertices, const uint32_t *indices, int num_triangles);
+// Reads an OBJ or binary mesh file, printing what is wrong with it and returning NULL if it can't be used.
+struct mesh *mesh_load(const char *path);
+void mesh_acquire(struct mesh *m);
+size_t mesh_bytes(const struct mesh *m);
+
+// Index of m in ctx->meshes, adding it with a new reference if it isn't there yet.
+uint32_t context_use_mesh(struct context *ctx, struct mesh *m);
+
+// An instance of the context's mesh, angles in radians as rotation() takes them.
+instance make_instance(const pt3 *position, const pt3 *angles, double scale, uint32_t mesh, uint32_t material);
+
+// Rebuilds ctx->instance_bvh after the instances changed.
+void context_build_instances(struct context *ctx);
+
+// Nearest triangle of m that r, in the mesh's space, hits before *t_max, which it then moves to the hit. With any
+// set, stops at the first hit. normal is the triangle's, unnormalized.
+int intersect_ray_mesh(const struct mesh *m, const ray *r, double *t_max, int any, pt3 *normal);
+
+// Nearest instance r hits before t_max, or with any set just some instance it hits, returning the instance's
+// index or -1. normal is the hit triangle's, in world space and facing the ray.
+int intersect_ray_instances(const struct context *ctx, const ray *r, double t_max, int any, double *t, pt3 *normal);
+
+#endif	// RAY_MESH_H__
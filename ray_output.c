@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "ray_output.h"
+#include "ray_bmp.h"
+
+int parse_output_format(const char *name, enum output_format *format) {
+	if (strcmp(name, "bmp") == 0) {
+		*format = OUTPUT_BMP;
+	} else if (strcmp(name, "delta") == 0) {
+		*format = OUTPUT_DELTA;
+	} else if (strcmp(name, "pack") == 0) {
+		*format = OUTPUT_PACK;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+struct output *output_open(const struct output_options *opts) {
+	struct output *out = calloc(1, sizeof(*out));
+	out->opts = *opts;
+	pthread_mutex_init(&out->lock, NULL);
+	pthread_cond_init(&out->cond, NULL);
+
+	char path[256];
+	switch (opts->format) {
+	case OUTPUT_BMP:
+		break;
+	case OUTPUT_DELTA:
+		snprintf(path, sizeof(path), "%s.rdlt", opts->prefix);
+		out->delta = delta_writer_open(path, opts->width, opts->height, opts->keyframe_interval);
+		out->delta->hdr.first_frame = opts->first_frame;
+		break;
+	case OUTPUT_PACK:
+		snprintf(path, sizeof(path), "%s.rpak", opts->prefix);
+		out->pack = pack_create(path, opts->width, opts->height, opts->num_frames);
+		out->pack->hdr->first_frame = opts->first_frame;
+		break;
+	}
+	return out;
+}
+
+// Path of the BMP written for frame in the bmp format. Files are named by scene frame, so the outputs of runs
+// over different frame ranges can simply be put together.
+void output_frame_path(const struct output *out, int frame, char *path, size_t size) {
+	snprintf(path, size, "%s-%05d.bmp", out->opts.prefix, out->opts.first_frame + frame);
+}
+
+// the delta format depends on the previous frame, so frames take their turn in order
+static void delta_turn_begin(struct output *out, int frame) {
+	pthread_mutex_lock(&out->lock);
+	while (out->next_frame != frame)
+		pthread_cond_wait(&out->cond, &out->lock);
+	pthread_mutex_unlock(&out->lock);
+}
+
+static void delta_turn_end(struct output *out) {
+	pthread_mutex_lock(&out->lock);
+	out->next_frame++;
+	pthread_cond_broadcast(&out->cond);
+	pthread_mutex_unlock(&out->lock);
+}
+
+// Writes frame from fb. May be called from several threads at once; if progress is non-NULL fb may still be
+// being rendered and rows are consumed as their bands complete.
+void output_write_frame(struct output *out, int frame, struct framebuffer_pt4 *fb, struct frame_progress *progress) {
+	char path[256];
+	switch (out->opts.format) {
+	case OUTPUT_BMP:
+		output_frame_path(out, frame, path, sizeof(path));
+		render_bmp_progressive(fb, progress, path);
+		return;
+	case OUTPUT_PACK:
+		pack_write_frame(out->pack, frame, fb, progress);
+		return;
+	case OUTPUT_DELTA:
+		break;
+	}
+
+	delta_turn_begin(out, frame);
+	delta_writer_write_frame(out->delta, fb, progress);
+	delta_turn_end(out);
+}
+
+static int copy_file(const char *from, const char *to) {
+	FILE *in = fopen(from, "rb"), *o = in ? fopen(to, "wb") : NULL;
+	char buf[1 << 16];
+	size_t n;
+	int ret = in && o ? 0 : -1;
+	while (ret == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0)
+		if (fwrite(buf, 1, n, o) != n)
+			ret = -1;
+	if (in)
+		fclose(in);
+	if (o && fclose(o) != 0)
+		ret = -1;
+	return ret;
+}
+
+// Writes frame as a copy of frame - 1, which must already have been written (or be written before frame in the
+// delta format): a hard link for BMP files where the file system allows, a copy of the slot or an empty delta.
+void output_repeat_frame(struct output *out, int frame) {
+	char prev[256], path[256];
+	atomic_fetch_add(&out->repeated, 1);
+	switch (out->opts.format) {
+	case OUTPUT_BMP:
+		output_frame_path(out, frame - 1, prev, sizeof(prev));
+		output_frame_path(out, frame, path, sizeof(path));
+		unlink(path);
+		if (link(prev, path) != 0 && copy_file(prev, path) != 0)
+			fprintf(stderr, "error copying '%s' to '%s': %d %s\n", prev, path, errno, strerror(errno));
+		return;
+	case OUTPUT_PACK:
+		pack_repeat_frame(out->pack, frame);
+		return;
+	case OUTPUT_DELTA:
+		break;
+	}
+
+	delta_turn_begin(out, frame);
+	delta_writer_repeat_frame(out->delta);
+	delta_turn_end(out);
+}
+
+void output_close(struct output *out) {
+	if (out->delta)
+		delta_writer_close(out->delta);
+	if (out->pack)
+		pack_close(out->pack);
+	pthread_cond_destroy(&out->cond);
+	pthread_mutex_destroy(&out->lock);
+	free(out);
+}
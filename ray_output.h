@@ -0,0 +1,48 @@
+#ifndef RAY_OUTPUT_H__
+#define RAY_OUTPUT_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "ray_render.h"
+#include "ray_delta.h"
+#include "ray_pack.h"
+
+enum output_format {
+	OUTPUT_BMP,		// one <prefix>-%05d.bmp per frame, numbered by scene frame
+	OUTPUT_DELTA,		// <prefix>.rdlt delta frame container, see ray_delta.h
+	OUTPUT_PACK,		// <prefix>.rpak preallocated single file of BMP slots, see ray_pack.h
+};
+
+struct output_options {
+	enum output_format format;
+	const char *prefix;
+	int width;
+	int height;
+	int num_frames;
+	int keyframe_interval;
+	int first_frame;	// scene frame of output frame 0
+};
+
+struct output {
+	struct output_options opts;
+	struct delta_writer *delta;
+	struct pack_file *pack;
+
+	// formats that depend on the previous frame take their turn in frame order
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next_frame;
+
+	atomic_int repeated;	// frames written as copies of the one before, see output_repeat_frame()
+};
+
+int parse_output_format(const char *name, enum output_format *format);
+
+struct output *output_open(const struct output_options *opts);
+void output_frame_path(const struct output *out, int frame, char *path, size_t size);
+void output_write_frame(struct output *out, int frame, struct framebuffer_pt4 *fb, struct frame_progress *progress);
+void output_repeat_frame(struct output *out, int frame);
+void output_close(struct output *out);
+
+#endif	// RAY_OUTPUT_H__
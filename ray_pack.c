@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ray_pack.h"
+#include "ray_bmp.h"
+
+static size_t round_up(size_t n, size_t to) {
+	return (n + to - 1) / to * to;
+}
+
+struct pack_file *pack_create(const char *path, int width, int height, int num_frames) {
+	struct pack_file *p = calloc(1, sizeof(*p));
+	if ((p->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "error opening pack '%s' for writing: %d %s\n", path, errno, strerror(errno));
+		exit(1);
+	}
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t frame_size = bmp_file_size(width, height);
+	size_t slot_size = round_up(frame_size, page);
+	size_t data_offset = round_up(sizeof(struct pack_file_header) + sizeof(uint64_t) * num_frames, page);
+	p->map_size = data_offset + slot_size * num_frames;
+
+	// reserve all the blocks now rather than growing the file one frame at a time
+	if (fallocate(p->fd, 0, 0, p->map_size) != 0 && ftruncate(p->fd, p->map_size) != 0) {
+		fprintf(stderr, "error sizing pack '%s' to %zu bytes: %d %s\n", path, p->map_size, errno, strerror(errno));
+		exit(1);
+	}
+	p->map = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+	if (p->map == MAP_FAILED) {
+		fprintf(stderr, "error mapping pack '%s': %d %s\n", path, errno, strerror(errno));
+		exit(1);
+	}
+
+	p->hdr = (struct pack_file_header *)p->map;
+	p->frame_offsets = (uint64_t *)(p->hdr + 1);
+	memcpy(p->hdr->magic, PACK_MAGIC, sizeof(p->hdr->magic));
+	p->hdr->version = PACK_VERSION;
+	p->hdr->width = width;
+	p->hdr->height = height;
+	p->hdr->num_frames = num_frames;
+	p->hdr->frame_size = frame_size;
+	p->hdr->slot_size = slot_size;
+	for (int i = 0; i < num_frames; i++)
+		p->frame_offsets[i] = data_offset + slot_size * i;
+	return p;
+}
+
+// Converts fb straight into the frame's slot. Slots are independent, so frames may be written concurrently.
+void pack_write_frame(struct pack_file *p, int frame, struct framebuffer_pt4 *fb, struct frame_progress *progress) {
+	uint8_t *slot = p->map + p->frame_offsets[frame];
+	int row_size = bmp_row_size(fb->width);
+	bmp_fill_headers(slot, fb->width, fb->height);
+	uint8_t *row = slot + BMP_HEADER_SIZE;
+	for (int y = fb->height - 1; y >= 0; y--, row += row_size) {
+		if (progress)
+			frame_progress_wait_rows(progress, y, y + 1);
+		bmp_convert_row(fb, y, row);
+	}
+}
+
+// Copies the previous frame's slot into frame's, which must come after it.
+void pack_repeat_frame(struct pack_file *p, int frame) {
+	memcpy(p->map + p->frame_offsets[frame], p->map + p->frame_offsets[frame - 1], p->hdr->frame_size);
+}
+
+struct pack_file *pack_open(const char *path) {
+	struct pack_file *p = calloc(1, sizeof(*p));
+	struct stat st;
+	if ((p->fd = open(path, O_RDONLY)) < 0 || fstat(p->fd, &st) != 0) {
+		fprintf(stderr, "error opening pack '%s': %d %s\n", path, errno, strerror(errno));
+		pack_close(p);
+		return NULL;
+	}
+	p->map_size = st.st_size;
+	if (p->map_size < sizeof(struct pack_file_header) ||
+			(p->map = mmap(NULL, p->map_size, PROT_READ, MAP_SHARED, p->fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "error mapping pack '%s'\n", path);
+		p->map = NULL;
+		pack_close(p);
+		return NULL;
+	}
+
+	p->hdr = (struct pack_file_header *)p->map;
+	p->frame_offsets = (uint64_t *)(p->hdr + 1);
+	if (memcmp(p->hdr->magic, PACK_MAGIC, sizeof(p->hdr->magic)) != 0 || p->hdr->version != PACK_VERSION ||
+			sizeof(*p->hdr) + sizeof(uint64_t) * p->hdr->num_frames > p->map_size) {
+		fprintf(stderr, "'%s' is not a version %d pack\n", path, PACK_VERSION);
+		pack_close(p);
+		return NULL;
+	}
+	for (uint32_t i = 0; i < p->hdr->num_frames; i++) {
+		if (p->frame_offsets[i] + p->hdr->frame_size > p->map_size) {
+			fprintf(stderr, "'%s' is truncated at frame %u\n", path, i);
+			pack_close(p);
+			return NULL;
+		}
+	}
+	return p;
+}
+
+// Returns the BMP file bytes of frame, hdr->frame_size long.
+const uint8_t *pack_frame(const struct pack_file *p, int frame) {
+	if (frame < 0 || (uint32_t)frame >= p->hdr->num_frames)
+		return NULL;
+	return p->map + p->frame_offsets[frame];
+}
+
+void pack_close(struct pack_file *p) {
+	if (p->map)
+		munmap(p->map, p->map_size);
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p);
+}
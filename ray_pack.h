@@ -0,0 +1,46 @@
+#ifndef RAY_PACK_H__
+#define RAY_PACK_H__
+
+#include <stdint.h>
+
+#include "ray_render.h"
+
+// Single file holding every frame of a run, preallocated and mapped up front. Every frame gets a fixed size,
+// page aligned slot holding a complete BMP file, so converted pixels are written straight into the mapping and
+// extraction is a plain copy. Layout:
+//
+//	struct pack_file_header
+//	uint64_t frame_offsets[num_frames]
+//	(padding to a page boundary)
+//	slots, slot_size bytes apart, the first frame_size bytes of each being the BMP
+
+#define PACK_MAGIC	"RPAK"
+#define PACK_VERSION	1
+
+struct pack_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_frames;
+	uint32_t first_frame;		// scene frame of slot 0, for runs of a frame range
+	uint64_t frame_size;
+	uint64_t slot_size;
+};
+
+struct pack_file {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	struct pack_file_header *hdr;
+	uint64_t *frame_offsets;
+};
+
+struct pack_file *pack_create(const char *path, int width, int height, int num_frames);
+void pack_write_frame(struct pack_file *p, int frame, struct framebuffer_pt4 *fb, struct frame_progress *progress);
+void pack_repeat_frame(struct pack_file *p, int frame);
+struct pack_file *pack_open(const char *path);
+const uint8_t *pack_frame(const struct pack_file *p, int frame);
+void pack_close(struct pack_file *p);
+
+#endif	// RAY_PACK_H__
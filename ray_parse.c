@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ray_ast.h"
+#include "ray_mesh.h"
+#include "ray.yacc.generated_h"
+#include "ray_scanner.h"
+
+// Scene files and the files they include. Every included file is parsed into a context of its own, on a pool of
+// threads shared by the whole parse, while the including file carries on; when a file is done its includes are
+// spliced in at the points they were included, in file order, so the result does not depend on which parse
+// finished first. Includes inside a grid or scatter are parsed in place instead, since the generator has to
+// repeat them as soon as its body ends.
+
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+struct include_job {
+	struct include_job *next;	// in the pool's queue
+	const struct include_job *parent;
+	char *path;			// resolved
+	named_material *named;		// the including file's materials at the include, the file may use them
+	int num_named;
+	named_mesh *named_meshes;	// and its meshes
+	int num_named_meshes;
+	int depth;
+	struct context *ctx;
+	int state;
+	int ret;
+};
+
+// Every mesh file named during a parse, loaded by the first file to name it.
+struct cached_mesh {
+	char *path;
+	struct mesh *mesh;
+};
+
+struct include_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct include_job *head;
+	struct include_job *tail;
+	pthread_t *threads;
+	int num_threads;
+	int max_threads;
+	int idle;
+	int stop;
+	pthread_mutex_t meshes_lock;
+	struct cached_mesh *meshes;
+	int num_meshes;
+	int meshes_cap;
+};
+
+static int parse_threads;
+
+void parse_set_threads(int n) {
+	parse_threads = n;
+}
+
+static int parse_file(FILE *in, struct include_job *file, struct include_pool *pool);
+
+static void run_job(struct include_job *job, struct include_pool *pool) {
+	job->ctx = new_context();
+	FILE *in = fopen(job->path, "r");
+	if (in == NULL) {
+		fprintf(stderr, "error opening included scene '%s'\n", job->path);
+		job->ret = -1;
+		return;
+	}
+	job->ret = parse_file(in, job, pool);
+	fclose(in);
+}
+
+static void free_job(struct include_job *job) {
+	if (job->ctx)
+		free_context(job->ctx);
+	free(job->named);
+	free(job->named_meshes);
+	free(job->path);
+	free(job);
+}
+
+// Takes the next queued job, preferring want if it is still queued. Called with the lock held.
+static struct include_job *pool_take(struct include_pool *pool, struct include_job *want) {
+	struct include_job *prev = NULL, *job = pool->head;
+	if (want && want->state == JOB_QUEUED)
+		while (job != want) {
+			prev = job;
+			job = job->next;
+		}
+	if (job == NULL)
+		return NULL;
+	if (prev)
+		prev->next = job->next;
+	else
+		pool->head = job->next;
+	if (pool->tail == job)
+		pool->tail = prev;
+	job->next = NULL;
+	job->state = JOB_RUNNING;
+	return job;
+}
+
+static void pool_run(struct include_pool *pool, struct include_job *job) {
+	pthread_mutex_unlock(&pool->lock);
+	run_job(job, pool);
+	pthread_mutex_lock(&pool->lock);
+	job->state = JOB_DONE;
+	pthread_cond_broadcast(&pool->cond);
+}
+
+static void *pool_thread(void *arg) {
+	struct include_pool *pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		struct include_job *job = pool_take(pool, NULL);
+		if (job) {
+			pool_run(pool, job);
+			continue;
+		}
+		if (pool->stop)
+			break;
+		pool->idle++;
+		pthread_cond_wait(&pool->cond, &pool->lock);
+		pool->idle--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void pool_submit(struct include_pool *pool, struct include_job *job) {
+	pthread_mutex_lock(&pool->lock);
+	job->state = JOB_QUEUED;
+	if (pool->tail)
+		pool->tail->next = job;
+	else
+		pool->head = job;
+	pool->tail = job;
+	// Threads start as includes turn up, a scene without any never starts one.
+	if (pool->idle == 0 && pool->num_threads < pool->max_threads
+	    && pthread_create(&pool->threads[pool->num_threads], NULL, pool_thread, pool) == 0)
+		pool->num_threads++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for job, running queued jobs meanwhile: the job itself if nobody took it yet, so a file waiting on its
+// includes never blocks a thread the includes need.
+static void pool_wait(struct include_pool *pool, struct include_job *job) {
+	pthread_mutex_lock(&pool->lock);
+	while (job->state != JOB_DONE) {
+		struct include_job *other = pool_take(pool, job);
+		if (other)
+			pool_run(pool, other);
+		else
+			pthread_cond_wait(&pool->cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_init(struct include_pool *pool) {
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_mutex_init(&pool->meshes_lock, NULL);
+	int n = parse_threads > 0 ? parse_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	pool->max_threads = n > 1 ? n - 1 : 0;
+	pool->threads = calloc(pool->max_threads > 0 ? pool->max_threads : 1, sizeof(*pool->threads));
+}
+
+static void pool_free(struct include_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool->threads);
+	for (int i = 0; i < pool->num_meshes; i++) {
+		mesh_release(pool->meshes[i].mesh);
+		free(pool->meshes[i].path);
+	}
+	free(pool->meshes);
+	pthread_mutex_destroy(&pool->meshes_lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+// A path named in a scene file, relative to that file's directory, resolved so the same file is known however
+// it is named.
+static char *resolve_path(const char *from, ident name, const char *what) {
+	int dir = 0;
+	if (from && name.s[0] != '/') {
+		const char *slash = strrchr(from, '/');
+		dir = slash ? (int)(slash - from) + 1 : 0;
+	}
+	char *joined = malloc(dir + name.len + 1);
+	if (dir > 0)
+		memcpy(joined, from, dir);
+	memcpy(joined + dir, name.s, name.len);
+	joined[dir + name.len] = 0;
+	char *resolved = realpath(joined, NULL);
+	if (resolved == NULL)
+		fprintf(stderr, "error opening %s '%s'\n", what, joined);
+	free(joined);
+	return resolved;
+}
+
+static struct include_job *new_job(struct scene_parser *p, ident name) {
+	char *path = resolve_path(p->path, name, "included scene");
+	if (path == NULL)
+		return NULL;
+	for (const struct include_job *f = p->file; f; f = f->parent)
+		if (f->path && strcmp(f->path, path) == 0) {
+			fprintf(stderr, "scene '%s' includes itself\n", path);
+			free(path);
+			return NULL;
+		}
+	struct include_job *job = calloc(1, sizeof(*job));
+	job->parent = p->file;
+	job->path = path;
+	job->depth = p->include_depth + 1;
+	job->num_named = p->num_named;
+	if (p->num_named > 0) {
+		job->named = malloc(sizeof(*job->named) * p->num_named);
+		memcpy(job->named, p->named, sizeof(*job->named) * p->num_named);
+	}
+	job->num_named_meshes = p->num_named_meshes;
+	if (p->num_named_meshes > 0) {
+		job->named_meshes = malloc(sizeof(*job->named_meshes) * p->num_named_meshes);
+		memcpy(job->named_meshes, p->named_meshes, sizeof(*job->named_meshes) * p->num_named_meshes);
+	}
+	return job;
+}
+
+static void remap_materials(struct scene_parser *p, struct context *ctx, const struct context *from, uint32_t *map) {
+	for (int i = 0; i < from->num_materials; i++)
+		map[i] = scene_parser_intern(p, ctx, &from->materials[i]);
+}
+
+// Splices the contexts of n finished includes into ctx, each at its mark, the marks being in order, and points
+// their records at ctx's materials.
+#define SPLICE(type, x, fix) do {								\
+	int total = ctx->num_##x;							\
+	for (int k = 0; k < n; k++)							\
+		total += inc[k].job->ctx->num_##x;					\
+	type *merged = malloc(sizeof(*merged) * (total > 0 ? total : 1));	\
+	int done = 0, out = 0;								\
+	for (int k = 0; k < n; k++) {							\
+		const struct context *child = inc[k].job->ctx;				\
+		int upto = inc[k].at.num_##x;						\
+		if (upto > done)							\
+			memcpy(merged + out, ctx->x + done, sizeof(*merged) * (upto - done));	\
+		out += upto - done;							\
+		done = upto;								\
+		for (int j = 0; j < child->num_##x; j++) {				\
+			merged[out] = child->x[j];					\
+			fix(merged[out]);						\
+			out++;								\
+		}									\
+	}										\
+	if (ctx->num_##x > done)							\
+		memcpy(merged + out, ctx->x + done, sizeof(*merged) * (ctx->num_##x - done));	\
+	free(ctx->x);									\
+	ctx->x = merged;								\
+	ctx->num_##x = total;								\
+	ctx->x##_cap = total;								\
+} while (0)
+
+#define REMAP(r)	((r).material = maps[k][(r).material])
+#define REMAP_INSTANCE(r)	((r).material = maps[k][(r).material], (r).mesh = mesh_maps[k][(r).mesh])
+#define KEEP(r)		((void)(r))
+
+static void splice_includes(struct scene_parser *p, struct context *ctx, const struct pending_include *inc, int n) {
+	uint32_t **maps = malloc(sizeof(*maps) * n);
+	uint32_t **mesh_maps = malloc(sizeof(*mesh_maps) * n);
+	for (int k = 0; k < n; k++) {
+		const struct context *child = inc[k].job->ctx;
+		maps[k] = malloc(sizeof(**maps) * (child->num_materials > 0 ? child->num_materials : 1));
+		remap_materials(p, ctx, child, maps[k]);
+		mesh_maps[k] = malloc(sizeof(**mesh_maps) * (child->num_meshes > 0 ? child->num_meshes : 1));
+		for (int i = 0; i < child->num_meshes; i++)
+			mesh_maps[k][i] = context_use_mesh(ctx, child->meshes[i]);
+	}
+	SPLICE(sphere, spheres, REMAP);
+	SPLICE(plane, planes, REMAP);
+	SPLICE(light, lights, KEEP);
+	SPLICE(instance, instances, REMAP_INSTANCE);
+	for (int k = 0; k < n; k++) {
+		free(maps[k]);
+		free(mesh_maps[k]);
+	}
+	free(maps);
+	free(mesh_maps);
+}
+
+int scene_parser_include(struct scene_parser *p, struct context *ctx, ident name) {
+	struct include_job *job = new_job(p, name);
+	if (job == NULL)
+		return -1;
+	struct pending_include inc = { context_mark(ctx), job };
+	if (p->generator_depth > 0) {
+		run_job(job, p->pool);
+		job->state = JOB_DONE;
+		int ret = job->ret;
+		if (ret == 0)
+			splice_includes(p, ctx, &inc, 1);
+		free_job(job);
+		return ret;
+	}
+	__CONTEXT_APPEND(p, includes, inc);
+	pool_submit(p->pool, job);
+	return 0;
+}
+
+struct mesh *scene_parser_mesh(const struct scene_parser *p, ident name) {
+	for (int i = 0; i < p->num_named_meshes; i++)
+		if (p->named_meshes[i].name.len == name.len && memcmp(p->named_meshes[i].name.s, name.s, name.len) == 0)
+			return p->named_meshes[i].mesh;
+	return NULL;
+}
+
+int scene_parser_define_mesh(struct scene_parser *p, ident name, ident path) {
+	char *resolved = resolve_path(p->path, path, "mesh");
+	if (resolved == NULL)
+		return -1;
+	struct include_pool *pool = p->pool;
+	struct mesh *m = NULL;
+	// Held while loading, so two files naming the same mesh at once load it once.
+	pthread_mutex_lock(&pool->meshes_lock);
+	for (int i = 0; i < pool->num_meshes && m == NULL; i++)
+		if (strcmp(pool->meshes[i].path, resolved) == 0)
+			m = pool->meshes[i].mesh;
+	if (m == NULL && (m = mesh_load(resolved)) != NULL) {
+		struct cached_mesh c = { resolved, m };
+		resolved = NULL;
+		__CONTEXT_APPEND(pool, meshes, c);
+	}
+	pthread_mutex_unlock(&pool->meshes_lock);
+	free(resolved);
+	if (m == NULL)
+		return -1;
+	named_mesh nm = { name, m };
+	__CONTEXT_APPEND(p, named_meshes, nm);
+	return 0;
+}
+
+const char *scene_parser_instance(struct scene_parser *p, struct context *ctx, struct mesh *mesh,
+		const struct instance_params *params) {
+	if (!(params->scale > 0))
+		return "instance scale must be positive";
+	pt3 angles = pt3_mul(&params->rotation, M_PI / 180);
+	color none = {0};
+	uint32_t material = scene_parser_intern(p, ctx, params->color ? params->color : &none);
+	context_add_instance(ctx, make_instance(&params->position, &angles, params->scale, context_use_mesh(ctx, mesh),
+			material));
+	return NULL;
+}
+
+static int parse_file(FILE *in, struct include_job *file, struct include_pool *pool) {
+	struct context *ctx = file->ctx;
+	yyscan_t scanner;
+	if (scanner_init(&scanner) != 0)
+		return -1;
+	if (scanner_set_input(in, scanner) != 0) {
+		fprintf(stderr, "error reading scene\n");
+		scanner_destroy(scanner);
+		return -1;
+	}
+	struct scene_parser parser = {0};
+	arena_init(&parser.arena);
+	parser.path = file->path;
+	parser.file = file;
+	parser.include_depth = file->depth;
+	parser.pool = pool;
+	parser.named = file->named;
+	parser.num_named = parser.named_cap = file->num_named;
+	file->named = NULL;
+	parser.named_meshes = file->named_meshes;
+	parser.num_named_meshes = parser.named_meshes_cap = file->num_named_meshes;
+	file->named_meshes = NULL;
+	// Material 0 is black, for spheres and planes without a color.
+	color none = {0};
+	scene_parser_intern(&parser, ctx, &none);
+	int ret = yyparse(ctx, &parser, scanner);
+	// Includes are waited for even after an error, they may point into this file's text.
+	for (int k = 0; k < parser.num_includes; k++) {
+		struct include_job *job = parser.includes[k].job;
+		pool_wait(pool, job);
+		if (job->ret != 0)
+			ret = -1;
+	}
+	if (ret == 0 && parser.num_includes > 0)
+		splice_includes(&parser, ctx, parser.includes, parser.num_includes);
+	for (int k = 0; k < parser.num_includes; k++)
+		free_job(parser.includes[k].job);
+	free(parser.includes);
+	arena_free(&parser.arena);
+	free(parser.named);
+	free(parser.named_meshes);
+	free(parser.material_slots);
+	scanner_destroy(scanner);
+	return ret;
+}
+
+int parse_scene(FILE *in, const char *path, struct context *ctx) {
+	struct include_pool pool;
+	pool_init(&pool);
+	struct include_job top = {0};
+	top.ctx = ctx;
+	if (path) {
+		top.path = realpath(path, NULL);
+		if (top.path == NULL)
+			top.path = strdup(path);
+	}
+	int ret = parse_file(in, &top, &pool);
+	if (ret == 0)
+		context_build_instances(ctx);
+	pool_free(&pool);
+	free(top.path);
+	return ret;
+}
@@ -1,63 +1,735 @@
 
 #include "ray_physics.h"
 #include "ray_math.h"
+#include "ray_broadphase.h"
+#include "ray_physics_soa.h"
 #include <math.h>  
+#include <pthread.h>
+#include <string.h>
 
 static const double framerate = 25;
 static const pt3 gravity = {{0, -9.8 / framerate, 0}};
+static const double position_step = 1.0 / 24.0;
+
+// most impacts a swept sphere resolves in one substep before it stops moving for the rest of it
+#define MAX_SUBSTEP_IMPACTS 4
+
+// a touching pair, i < j, and the normal pointing from j to i
+struct contact {
+    int i;
+    int j;
+    pt3 normal;
+    int batch;                  // see schedule_contacts()
+};
+
+struct physics_worker {
+    struct context *ctx;
+    int index;
+    int lo;                     // spheres [lo, hi) belong to this worker
+    int hi;
+    struct broadphase_scratch scratch;
+    struct contact *contacts;   // touching pairs found for spheres [lo, hi), in pair loop order
+    int num_contacts;
+    int contacts_cap;
+    int *batch_fill;            // where its next pair of each batch goes in batched, see schedule_contacts()
+    int batch_fill_cap;
+};
+
+struct physics_state {
+    // the spheres as the physics works on them, kept from step to step. ctx->spheres lags behind
+    // until physics_sync_spheres()
+    struct sphere_soa soa;
+    int soa_loaded;             // 0 until the first step and after physics_spheres_changed()
+    int soa_ahead;              // soa has moved on since it was last stored into ctx->spheres
+
+    struct broadphase *bp;
+    int nthreads;
+    struct physics_worker *workers;
+    pthread_barrier_t barrier;
+
+    // the pairs are applied in batches that have no sphere twice, see schedule_contacts()
+    int *next_batch;            // per sphere: the batch after the last one with a pair of it
+    int spheres_cap;
+    struct contact *batched;    // every pair, grouped by batch
+    int batched_cap;
+    int *batch_start;           // batch b is batched[batch_start[b]] to batched[batch_start[b + 1] - 1]
+    int batches_cap;
+    int num_batches;
+
+    // sleeping: a sphere resting on a plane below sleep_threshold speed for sleep_steps steps stops moving
+    double sleep_threshold;     // 0 disables sleeping
+    int sleep_steps;
+    unsigned char *asleep;
+    int *still_steps;
+    int sleep_cap;
+    int num_awake;
+
+    // substepping: spheres moving over half their radius per step are swept in up to max_substeps pieces
+    int max_substeps;           // 0 disables substepping
+    unsigned char *fast;        // marked by the plane pass, which leaves their planes to the sweep
+    int *fast_list;
+    struct sphere_soa swept;    // what the broadphase sees during the sweep, see sweep_fast_spheres()
+    int fast_cap;
+    int num_impacts;            // swept impacts found in the last update_positions()
+
+    int integrate_with_planes;  // set by step_physics(): the plane pass also moves the spheres
+};
+
+static struct physics_state *get_physics_state(struct context *ctx) {
+    if (ctx->physics == NULL)
+        physics_set_threads(ctx, 1);
+    return ctx->physics;
+}
+
+// the physics state, with the spheres loaded for a step that is about to change them
+static struct physics_state *begin_step(struct context *ctx) {
+    struct physics_state *ps = get_physics_state(ctx);
+    if (!ps->soa_loaded || ps->soa.n != ctx->num_spheres) {
+        sphere_soa_load(&ps->soa, ctx->spheres, ctx->num_spheres);
+        ps->soa_loaded = 1;
+    }
+    ps->soa_ahead = 1;
+    return ps;
+}
+
+/**
+ * stores the positions and velocities the physics has reached into ctx->spheres
+ */
+void physics_sync_spheres(struct context *ctx) {
+    struct physics_state *ps = ctx->physics;
+    if (ps != NULL && ps->soa_ahead) {
+        sphere_soa_store(&ps->soa, ctx->spheres, ctx->spheres);
+        ps->soa_ahead = 0;
+    }
+}
+
+/**
+ * ctx->spheres as they would be after physics_sync_spheres(), into out, in one pass
+ */
+void physics_copy_spheres(struct context *ctx, sphere *out) {
+    struct physics_state *ps = ctx->physics;
+    if (ps != NULL && ps->soa_ahead)
+        sphere_soa_store(&ps->soa, ctx->spheres, out);
+    else
+        memcpy(out, ctx->spheres, sizeof(*out) * ctx->num_spheres);
+}
+
+void physics_copy_positions(struct context *ctx, pt3 *out) {
+    struct physics_state *ps = ctx->physics;
+    for (int i = 0; i < ctx->num_spheres; i++)
+        out[i] = ps != NULL && ps->soa_ahead ? sphere_soa_get(&ps->soa, i).position : ctx->spheres[i].position;
+}
+
+/**
+ * the next step starts from ctx->spheres again, e.g. after a checkpoint was loaded into them
+ */
+void physics_spheres_changed(struct context *ctx) {
+    struct physics_state *ps = ctx->physics;
+    if (ps != NULL)
+        ps->soa_loaded = ps->soa_ahead = 0;
+}
+
+/**
+ * calc_velocities looks for touching pairs on nthreads threads. the result is the same for any count
+ */
+void physics_set_threads(struct context *ctx, int nthreads) {
+    struct physics_state *ps = ctx->physics;
+    if (ps == NULL) {
+        ps = ctx->physics = calloc(1, sizeof(*ctx->physics));
+        ps->bp = new_broadphase();
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    for (int t = 0; t < ps->nthreads; t++) {
+        broadphase_scratch_free(&ps->workers[t].scratch);
+        free(ps->workers[t].contacts);
+        free(ps->workers[t].batch_fill);
+    }
+    if (ps->nthreads > 0)
+        pthread_barrier_destroy(&ps->barrier);
+
+    ps->nthreads = nthreads;
+    ps->workers = realloc(ps->workers, sizeof(*ps->workers) * nthreads);
+    memset(ps->workers, 0, sizeof(*ps->workers) * nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        ps->workers[t].index = t;
+        broadphase_scratch_init(&ps->workers[t].scratch);
+    }
+    pthread_barrier_init(&ps->barrier, NULL, nthreads);
+}
+
+/**
+ * threshold 0 (the default) disables sleeping
+ */
+void physics_set_sleep(struct context *ctx, double threshold, int steps) {
+    struct physics_state *ps = get_physics_state(ctx);
+    ps->sleep_threshold = threshold;
+    ps->sleep_steps = steps > 0 ? steps : 1;
+}
+
+/**
+ * 0 (the default) moves every sphere by one whole step of its velocity, see update_positions().
+ * otherwise fast spheres get gravity and plane contacts once per substep, see sweep_fast_spheres()
+ */
+void physics_set_substeps(struct context *ctx, int max_substeps) {
+    struct physics_state *ps = get_physics_state(ctx);
+    ps->max_substeps = max_substeps > 0 ? max_substeps : 0;
+}
+
+/**
+ * impacts the swept spheres had during the last update_positions()
+ */
+int physics_impact_count(struct context *ctx) {
+    return get_physics_state(ctx)->num_impacts;
+}
+
+/**
+ * spheres that were awake after the last step, or all of them if sleeping is disabled
+ */
+int physics_awake_count(struct context *ctx) {
+    struct physics_state *ps = get_physics_state(ctx);
+    return ps->sleep_threshold > 0 ? ps->num_awake : ctx->num_spheres;
+}
+
+static void prepare_sleep_state(struct physics_state *ps, int n) {
+    if (ps->sleep_threshold <= 0 || n <= ps->sleep_cap)
+        return;
+    ps->asleep = realloc(ps->asleep, n);
+    ps->still_steps = realloc(ps->still_steps, sizeof(*ps->still_steps) * n);
+    memset(ps->asleep + ps->sleep_cap, 0, n - ps->sleep_cap);
+    memset(ps->still_steps + ps->sleep_cap, 0, sizeof(*ps->still_steps) * (n - ps->sleep_cap));
+    ps->sleep_cap = n;
+}
+
+static inline int is_asleep(const struct physics_state *ps, int i) {
+    return ps->sleep_threshold > 0 && ps->asleep[i];
+}
+
+static inline void wake(struct physics_state *ps, int i) {
+    if (is_asleep(ps, i)) {
+        ps->asleep[i] = 0;
+        ps->still_steps[i] = 0;
+    }
+}
+
+// after an awake sphere's velocity is final for the step, count it towards falling asleep
+static void update_sleep(struct physics_state *ps, sphere *s, int i, int touching_plane) {
+    if (ps->sleep_threshold <= 0)
+        return;
+    if (touching_plane && pt3_dot(&s->velocity, &s->velocity) < ps->sleep_threshold * ps->sleep_threshold) {
+        if (++ps->still_steps[i] >= ps->sleep_steps) {
+            ps->asleep[i] = 1;
+            s->velocity = (pt3){{0, 0, 0}};
+        }
+    } else {
+        ps->still_steps[i] = 0;
+    }
+}
+
+/**
+ * sleeping state carried from step to step, for checkpoints. all zero with sleeping disabled
+ */
+void physics_get_sleep_state(struct context *ctx, int i, int *asleep, int *still_steps) {
+    struct physics_state *ps = get_physics_state(ctx);
+    prepare_sleep_state(ps, ctx->num_spheres);
+    *asleep = is_asleep(ps, i);
+    *still_steps = ps->sleep_threshold > 0 ? ps->still_steps[i] : 0;
+}
+
+void physics_set_sleep_state(struct context *ctx, int i, int asleep, int still_steps) {
+    struct physics_state *ps = get_physics_state(ctx);
+    prepare_sleep_state(ps, ctx->num_spheres);
+    if (ps->sleep_threshold <= 0)
+        return;
+    ps->asleep[i] = asleep != 0;
+    ps->still_steps[i] = still_steps;
+}
+
+static int count_awake(const struct physics_state *ps, int n) {
+    int awake = 0;
+    for (int i = 0; i < n; i++)
+        awake += !ps->asleep[i];
+    return awake;
+}
+
+void free_physics_state(struct context *ctx) {
+    struct physics_state *ps = ctx->physics;
+    if (ps == NULL)
+        return;
+    physics_sync_spheres(ctx);
+    for (int t = 0; t < ps->nthreads; t++) {
+        broadphase_scratch_free(&ps->workers[t].scratch);
+        free(ps->workers[t].contacts);
+        free(ps->workers[t].batch_fill);
+    }
+    pthread_barrier_destroy(&ps->barrier);
+    free(ps->workers);
+    free(ps->next_batch);
+    free(ps->batched);
+    free(ps->batch_start);
+    free(ps->asleep);
+    free(ps->still_steps);
+    free(ps->fast);
+    free(ps->fast_list);
+    sphere_soa_free(&ps->swept);
+    sphere_soa_free(&ps->soa);
+    free_broadphase(ps->bp);
+    free(ps);
+    ctx->physics = NULL;
+}
+
+// velocity changes for si and sj meeting along normal (pointing from sj to si)
+static void sphere_impulse(const sphere *si, const sphere *sj, const pt3 *normal, pt3 *dvi, pt3 *dvj) {
+    pt3 vdiff = pt3_sub(&si->velocity, &sj->velocity);
+
+    // mass ~ volume = 4/3*pi*r^3
+    double ri = si->radius;
+    double rj = sj->radius;
+    double mi = 4.0 / 3.0 * M_PI * ri * ri * ri;
+    double mj = 4.0 / 3.0 * M_PI * rj * rj * rj;
+
+    double a = pt3_dotv(pt3_mul(normal, 2.0), vdiff) / (1.0/mi + 1.0/mj);
+
+    *dvi = pt3_mul(normal, -a / mi);
+    *dvj = pt3_mul(normal, a / mj);
+}
+
+// velocity changes for a touching pair, or 0 if they are already heading away from each other
+static int touching_impulse(const sphere *si, const sphere *sj, const pt3 *normal, pt3 *dvi, pt3 *dvj) {
+    pt3 vdiff = pt3_sub(&si->velocity, &sj->velocity);
+    if (pt3_dot(&vdiff, normal) >= 0) {
+        return 0;
+    }
+    sphere_impulse(si, sj, normal, dvi, dvj);
+    return 1;
+}
+
+// velocity changes from a sphere-sphere collision, or 0 if the pair isn't colliding
+static int contact_impulse(const sphere *si, const sphere *sj, pt3 *dvi, pt3 *dvj) {
+    // checks collision. the normal is the direction from sj to si, so it tells whether they approach too
+    pt3 hit, normal;
+    if (!intersect_sphere_sphere(si, sj, &hit, &normal)) {
+        return 0;
+    }
+    return touching_impulse(si, sj, &normal, dvi, dvj);
+}
+
+// sphere-sphere collision response, updates both velocities
+static void collide_spheres(sphere *si, sphere *sj) {
+    pt3 dvi, dvj;
+    if (contact_impulse(si, sj, &dvi, &dvj)) {
+        si->velocity = pt3_addv(si->velocity, dvi);
+        sj->velocity = pt3_addv(sj->velocity, dvj);
+    }
+}
+
+// for collisions with planes + gravity g, returns whether si touches any plane
+static int collide_planes_with(struct context *ctx, sphere *si, const pt3 *g) {
+    pt3 *vi = &si->velocity;
+    int touching = 0;
+    for (int j = 0; j < ctx->num_planes; j++) {
+        plane *p = &ctx->planes[j];
+        if (intersect_sphere_plane(si, p)) {
+            touching = 1;
+            double d = pt3_dot(vi, &p->normal);
+            if (d < 0) {
+                *vi = pt3_addv(*vi, pt3_mul(&p->normal, -1.99 * d));
+            }
+        } else {
+            // Apply gravity to velocity
+            // (only if we’re not touching the plane)
+            *vi = pt3_addv(*vi, *g);
+        }
+    }
+    return touching;
+}
+
+// collide_planes_with() for one whole step's gravity
+static int collide_planes(struct context *ctx, sphere *si) {
+    return collide_planes_with(ctx, si, &gravity);
+}
+
+static void prepare_fast_state(struct physics_state *ps, int n) {
+    if (ps->max_substeps <= 0)
+        return;
+    if (n > ps->fast_cap) {
+        ps->fast = realloc(ps->fast, n);
+        ps->fast_list = realloc(ps->fast_list, sizeof(*ps->fast_list) * n);
+        ps->fast_cap = n;
+    }
+    memset(ps->fast, 0, n);
+}
+
+// with substepping, marks sphere i fast if its velocity after the pairs takes it more than half its radius
+// in a step. the plane pass skips fast spheres: sweep_fast_spheres() gives them their planes and gravity
+static int mark_fast(struct physics_state *ps, const sphere *s, int i) {
+    if (ps->max_substeps <= 0)
+        return 0;
+    double reach = 0.5 * s->radius / position_step;
+    ps->fast[i] = pt3_dot(&s->velocity, &s->velocity) > reach * reach;
+    return ps->fast[i];
+}
+
+// appends the pairs of sphere i with the candidates the broadphase found that touch
+static void find_contacts(struct context *ctx, struct physics_worker *w, int i, int n) {
+    struct physics_state *ps = ctx->physics;
+    sphere si = sphere_soa_get_shape(&ps->soa, i);
+    for (int k = 0; k < n; k++) {
+        int j = w->scratch.candidates[k];
+        if (j < i && !is_asleep(ps, j))
+            continue;   // found by j, which is awake so has its turn first
+        struct contact ct = { i < j ? i : j, i < j ? j : i, {{0}}, 0 };
+        sphere sj = sphere_soa_get_shape(&ps->soa, j);
+        pt3 hit;
+        if (!intersect_sphere_sphere(i < j ? &si : &sj, i < j ? &sj : &si, &hit, &ct.normal))
+            continue;
+        if (w->num_contacts == w->contacts_cap) {
+            w->contacts_cap = w->contacts_cap ? 2 * w->contacts_cap : 64;
+            w->contacts = realloc(w->contacts, sizeof(*w->contacts) * w->contacts_cap);
+        }
+        w->contacts[w->num_contacts++] = ct;
+    }
+}
+
+// a pair that collides wakes its sleeper, if it has one
+static void apply_contact(const struct contact *ct, struct physics_state *ps) {
+    sphere si = sphere_soa_get(&ps->soa, ct->i);
+    sphere sj = sphere_soa_get(&ps->soa, ct->j);
+    pt3 dvi, dvj;
+    if (touching_impulse(&si, &sj, &ct->normal, &dvi, &dvj)) {
+        wake(ps, ct->i);
+        wake(ps, ct->j);
+        si.velocity = pt3_addv(si.velocity, dvi);
+        sj.velocity = pt3_addv(sj.velocity, dvj);
+        sphere_soa_set_velocity(&ps->soa, ct->i, &si.velocity);
+        sphere_soa_set_velocity(&ps->soa, ct->j, &sj.velocity);
+    }
+}
+
+// makes room for counts[0] to counts[n - 1], zeroing any added ones
+static void reserve_counts(int **counts, int *cap, int n) {
+    if (n <= *cap)
+        return;
+    int new_cap = *cap ? 2 * *cap : 64;
+    if (new_cap < n)
+        new_cap = n;
+    *counts = realloc(*counts, sizeof(**counts) * new_cap);
+    memset(*counts + *cap, 0, sizeof(**counts) * (new_cap - *cap));
+    *cap = new_cap;
+}
+
+/**
+ * groups the pairs the workers found into batches for the parallel solve. each pair goes into the batch
+ * after the last one holding a pair of either of its spheres, so no batch has a sphere twice and every
+ * sphere meets its pairs in pair loop order, one batch after another. the batches applied in turn thus
+ * compute exactly what applying the pairs one by one in pair loop order (Gauss-Seidel) does, whatever
+ * the thread count: a pair reads velocities only its own spheres' earlier pairs have written.
+ * this is the serial part of the solve and only picks batches; each worker then copies its own pairs
+ * to batch_fill[] positions, and the impulses are left to all threads
+ */
+static void schedule_contacts(struct physics_state *ps) {
+    ps->num_batches = 0;
+    for (int t = 0; t < ps->nthreads; t++) {
+        struct physics_worker *w = &ps->workers[t];
+        memset(w->batch_fill, 0, sizeof(*w->batch_fill) * w->batch_fill_cap);
+        for (int c = 0; c < w->num_contacts; c++) {
+            struct contact *ct = &w->contacts[c];
+            int b = ps->next_batch[ct->i] > ps->next_batch[ct->j] ? ps->next_batch[ct->i] : ps->next_batch[ct->j];
+            ct->batch = b;
+            ps->next_batch[ct->i] = ps->next_batch[ct->j] = b + 1;
+            reserve_counts(&w->batch_fill, &w->batch_fill_cap, b + 1);
+            w->batch_fill[b]++;
+            if (b + 1 > ps->num_batches)
+                ps->num_batches = b + 1;
+        }
+    }
+
+    // batches in order, and within a batch the workers' pairs in worker order
+    reserve_counts(&ps->batch_start, &ps->batches_cap, ps->num_batches + 1);
+    int pos = 0;
+    for (int b = 0; b < ps->num_batches; b++) {
+        ps->batch_start[b] = pos;
+        for (int t = 0; t < ps->nthreads; t++) {
+            struct physics_worker *w = &ps->workers[t];
+            if (b < w->batch_fill_cap) {
+                int count = w->batch_fill[b];
+                w->batch_fill[b] = pos;
+                pos += count;
+            }
+        }
+    }
+    ps->batch_start[ps->num_batches] = pos;
+    if (pos > ps->batched_cap) {
+        ps->batched_cap = pos;
+        ps->batched = realloc(ps->batched, sizeof(*ps->batched) * pos);
+    }
+}
+
+static void *physics_worker_run(void *arg) {
+    struct physics_worker *w = arg;
+    struct context *ctx = w->ctx;
+    struct physics_state *ps = ctx->physics;
+    int sleeping = ps->sleep_threshold > 0;
+
+    // 1. broadphase queries and the touching test, which only read positions. with sleeping, sleepers
+    // don't query and the awake sphere of a pair with a sleeper records it
+    w->num_contacts = 0;
+    for (int i = w->lo; i < w->hi; i++) {
+        ps->next_batch[i] = 0;
+        if (sleeping && ps->asleep[i])
+            continue;
+        int n = sleeping ? broadphase_query_all(ps->bp, &ps->soa, i, &w->scratch)
+                         : broadphase_query(ps->bp, &ps->soa, i, &w->scratch);
+        find_contacts(ctx, w, i, n);
+    }
+    pthread_barrier_wait(&ps->barrier);
+
+    // 2. the impulses, batch after batch, each batch split between the threads. the same whatever the
+    // thread count, see schedule_contacts(). a sleeper a pair wakes here finds its pairs with other
+    // sleepers from the next step on
+    if (w->index == 0)
+        schedule_contacts(ps);
+    pthread_barrier_wait(&ps->barrier);
+    for (int c = 0; c < w->num_contacts; c++)
+        ps->batched[w->batch_fill[w->contacts[c].batch]++] = w->contacts[c];
+    pthread_barrier_wait(&ps->barrier);
+    for (int b = 0; b < ps->num_batches; b++) {
+        int lo = ps->batch_start[b];
+        int len = ps->batch_start[b + 1] - lo;
+        int end = lo + (int)((long)len * (w->index + 1) / ps->nthreads);
+        for (int c = lo + (int)((long)len * w->index / ps->nthreads); c < end; c++)
+            apply_contact(&ps->batched[c], ps);
+        pthread_barrier_wait(&ps->barrier);
+    }
+
+    // 3. planes and gravity, and for step_physics() integration as well; no sphere is written by two
+    // threads. no pair changes a sphere's velocity after its own turn, so this gives the same as running
+    // each sphere's planes right after its pairs. without sleeping or substeps every sphere goes the
+    // same way, through the kernels; otherwise spheres still asleep stay put and fast ones are marked
+    if (!sleeping && ps->max_substeps <= 0) {
+        if (ps->integrate_with_planes)
+            soa_collide_planes_integrate(&ps->soa, w->lo, w->hi, ctx->planes, ctx->num_planes, &gravity, position_step);
+        else
+            soa_collide_planes(&ps->soa, w->lo, w->hi, ctx->planes, ctx->num_planes, &gravity);
+        return NULL;
+    }
+    for (int i = w->lo; i < w->hi; i++) {
+        if (is_asleep(ps, i))
+            continue;
+        sphere si = sphere_soa_get(&ps->soa, i);
+        int touching = !mark_fast(ps, &si, i) && collide_planes(ctx, &si);
+        update_sleep(ps, &si, i, touching);
+        sphere_soa_set_velocity(&ps->soa, i, &si.velocity);
+    }
+    return NULL;
+}
 
 /**
  * this will calculate collisions & updates velocities in-place
  * this does NOT apply velocity to sphere positions.
+ * only pairs the broadphase finds close enough to touch are tested. threads look for the touching
+ * pairs of their range of spheres, then apply the impulses in batches that keep each sphere's pairs in
+ * the order of the brute force loop below, so the results are identical, whatever the number of threads.
+ * with sleeping, only pairs with an awake sphere are found at the start of the step, so a sleeper that
+ * gets woken up only meets its sleeping neighbours from the next step on.
  */
 void calc_velocities(struct context *ctx) {
+    struct physics_state *ps = begin_step(ctx);
+    int n = ctx->num_spheres;
+    prepare_sleep_state(ps, n);
+    prepare_fast_state(ps, n);
+    if (n > ps->spheres_cap) {
+        ps->spheres_cap = n;
+        ps->next_batch = realloc(ps->next_batch, sizeof(*ps->next_batch) * n);
+    }
+    broadphase_build(ps->bp, &ps->soa);
+
+    pthread_t *tids = malloc(sizeof(*tids) * ps->nthreads);
+    for (int t = 0; t < ps->nthreads; t++) {
+        struct physics_worker *w = &ps->workers[t];
+        w->ctx = ctx;
+        w->lo = (long)n * t / ps->nthreads;
+        w->hi = (long)n * (t + 1) / ps->nthreads;
+        if (t > 0)
+            pthread_create(&tids[t], NULL, physics_worker_run, w);
+    }
+    physics_worker_run(&ps->workers[0]);
+    for (int t = 1; t < ps->nthreads; t++)
+        pthread_join(tids[t], NULL);
+    free(tids);
+    if (ps->sleep_threshold > 0)
+        ps->num_awake = count_awake(ps, n);
+}
+
+/**
+ * reference version of calc_velocities, testing every pair. works on ctx->spheres themselves
+ */
+void calc_velocities_bruteforce(struct context *ctx) {
+    struct physics_state *ps = ctx->physics;
+    physics_sync_spheres(ctx);
+    physics_spheres_changed(ctx);
+    if (ps != NULL)
+        prepare_fast_state(ps, ctx->num_spheres);
     for (int i = 0; i < ctx->num_spheres; i++) {
         sphere *si = &ctx->spheres[i];
-        pt3 *vi = &si->velocity;
-
         for (int j = i + 1; j < ctx->num_spheres; j++) {
-            sphere *sj = &ctx->spheres[j];
-            pt3 pdiff = pt3_sub(&si->position, &sj->position);
-            pt3_normalize_mut(&pdiff);
+            collide_spheres(si, &ctx->spheres[j]);
+        }
+        if (ps == NULL || !mark_fast(ps, si, i))
+            collide_planes(ctx, si);
+    }
+}
 
-            pt3 vdiff = pt3_sub(vi, &sj->velocity);
+// lists the spheres the plane pass marked fast, returns how many
+static int list_fast_spheres(struct context *ctx) {
+    struct physics_state *ps = ctx->physics;
+    int nfast = 0;
+    for (int i = 0; i < ctx->num_spheres && ctx->num_spheres <= ps->fast_cap; i++)
+        if (ps->fast[i])
+            ps->fast_list[nfast++] = i;
+    return nfast;
+}
 
-            //  heading away? skip
-            if (pt3_dot(&vdiff, &pdiff) >= 0) {
-                continue;
-            }
+// time until s moving at v hits plane p from its front side, or -1 if it doesn't
+static double plane_time_of_impact(const sphere *s, const pt3 *v, const plane *p) {
+    pt3 rel = pt3_sub(&s->position, &p->position);
+    double dist = pt3_dot(&rel, &p->normal) - s->radius;
+    double vn = pt3_dot(v, &p->normal);
+    // already touching is collide_planes()' job
+    if (dist < 0 || vn >= 0)
+        return -1;
+    return dist / -vn;
+}
 
-            // checks collision
-            pt3 hit, normal;
-            if (!intersect_sphere_sphere(si, sj, &hit, &normal)) {
-                continue;
-            }
+// time until s moving at v hits o standing still, or -1 if it doesn't
+static double sphere_time_of_impact(const sphere *s, const pt3 *v, const sphere *o) {
+    pt3 m = pt3_sub(&s->position, &o->position);
+    double r = s->radius + o->radius;
+    double a = pt3_dot(v, v);
+    double b = 2.0 * pt3_dot(&m, v);
+    double c = pt3_dot(&m, &m) - r * r;
+    // overlapping pairs are calc_velocities()' job
+    if (c < 0 || b >= 0)
+        return -1;
+    double disc = b * b - 4.0 * a * c;
+    if (disc < 0)
+        return -1;
+    return (-b - sqrt(disc)) / (2.0 * a);
+}
+
+/**
+ * moves sphere i through time h, stopping at the first plane or sphere in its way and bouncing off
+ * it. other spheres stand still at wherever they are now during the sweep. returns the impacts.
+ */
+static int sweep_sphere(struct context *ctx, int i, double h) {
+    struct physics_state *ps = ctx->physics;
+    struct broadphase_scratch *scratch = &ps->workers[0].scratch;
+    sphere sp = sphere_soa_get(&ps->soa, i);
+    sphere *s = &sp;
+    int impacts = 0;
+    int last_plane = -1, last_sphere = -1;
 
-            // mass ~ volume = 4/3*pi*r^3
-            double ri = si->radius;
-            double rj = sj->radius;
-            double mi = 4.0 / 3.0 * M_PI * ri * ri * ri;
-            double mj = 4.0 / 3.0 * M_PI * rj * rj * rj;
+    for (double left = h; left > 0 && impacts < MAX_SUBSTEP_IMPACTS; ) {
+        pt3 *v = &s->velocity;
+        double best = left;
+        int hit_plane = -1, hit_sphere = -1;
 
-            double a = pt3_dotv(pt3_mul(&normal, 2.0), vdiff) / (1.0/mi + 1.0/mj);
+        for (int j = 0; j < ctx->num_planes; j++) {
+            double t = plane_time_of_impact(s, v, &ctx->planes[j]);
+            if (j != last_plane && t >= 0 && t < best) {
+                best = t;
+                hit_plane = j;
+            }
+        }
 
-            *vi = pt3_addv(*vi, pt3_mul(&normal, -a / mi));
-            sj->velocity = pt3_addv(sj->velocity, pt3_mul(&normal, a / mj));
+        // neighbours from the broadphase around the swept box
+        pt3 end = pt3_addv(s->position, pt3_mul(v, left));
+        pt3 lo, hi;
+        for (int k = 0; k < 3; k++) {
+            lo.v[k] = fmin(s->position.v[k], end.v[k]) - s->radius;
+            hi.v[k] = fmax(s->position.v[k], end.v[k]) + s->radius;
+        }
+        int n = broadphase_query_box(ps->bp, &lo, &hi, scratch);
+        for (int k = 0; k < n; k++) {
+            int j = scratch->candidates[k];
+            if (j == i || j == last_sphere)
+                continue;
+            sphere o = sphere_soa_get_shape(&ps->soa, j);
+            double t = sphere_time_of_impact(s, v, &o);
+            if (t >= 0 && t < best) {
+                best = t;
+                hit_sphere = j;
+                hit_plane = -1;
+            }
         }
 
-        // for collisions with planes + gravity
-        for (int j = 0; j < ctx->num_planes; j++) {
-            plane *p = &ctx->planes[j];
-            if (intersect_sphere_plane(si, p)) {
-                double d = pt3_dot(vi, &p->normal);
-                if (d < 0) {
-                    *vi = pt3_addv(*vi, pt3_mul(&p->normal, -1.99 * d));
-                }
-            } else {
-                // Apply gravity to velocity
-                // (only if we’re not touching the plane)
-                *vi = pt3_addv(*vi, gravity);
+        s->position = pt3_addv(s->position, pt3_mul(v, best));
+        left -= best;
+        if (hit_plane >= 0) {
+            const plane *p = &ctx->planes[hit_plane];
+            double d = pt3_dot(v, &p->normal);
+            *v = pt3_addv(*v, pt3_mul(&p->normal, -1.99 * d));
+        } else if (hit_sphere >= 0) {
+            sphere o = sphere_soa_get(&ps->soa, hit_sphere);
+            pt3 normal = pt3_sub(&s->position, &o.position);
+            pt3_normalize_mut(&normal);
+            pt3 vdiff = pt3_sub(v, &o.velocity);
+            if (pt3_dot(&vdiff, &normal) < 0) {
+                pt3 dvi, dvj;
+                sphere_impulse(s, &o, &normal, &dvi, &dvj);
+                *v = pt3_addv(*v, dvi);
+                o.velocity = pt3_addv(o.velocity, dvj);
+                sphere_soa_set_velocity(&ps->soa, hit_sphere, &o.velocity);
+                wake(ps, hit_sphere);
             }
+        } else {
+            break;
+        }
+        last_plane = hit_plane;
+        last_sphere = hit_sphere;
+        impacts++;
+    }
+    sphere_soa_set_position(&ps->soa, i, &s->position);
+    sphere_soa_set_velocity(&ps->soa, i, &s->velocity);
+    return impacts;
+}
+
+/**
+ * the spheres the plane pass marked fast are integrated in up to max_substeps substeps of at most
+ * half their radius each. every substep applies that substep's share of gravity and the contacts
+ * with planes the sphere touches, as the plane pass does for a whole step, then sweeps the sphere
+ * through the substep, so it can't pass through a plane or a neighbour between two frames. the rest
+ * of the spheres have already moved.
+ * the broadphase is built with every fast sphere grown to cover its whole path for the step,
+ * straight plus however far gravity can bend it, so it is found wherever it is when another sphere
+ * sweeps past.
+ */
+static void sweep_fast_spheres(struct context *ctx, int nfast) {
+    struct physics_state *ps = ctx->physics;
+    double bend = ctx->num_planes * mag(&gravity) * position_step;
+    sphere_soa_copy_shapes(&ps->swept, &ps->soa);
+    for (int f = 0; f < nfast; f++) {
+        int i = ps->fast_list[f];
+        sphere s = sphere_soa_get(&ps->soa, i);
+        pt3 half = pt3_mul(&s.velocity, 0.5 * position_step);
+        pt3 middle = pt3_addv(s.position, half);
+        sphere_soa_set_position(&ps->swept, i, &middle);
+        ps->swept.r[i] += mag(&half) + bend;
+    }
+    broadphase_build(ps->bp, &ps->swept);
+    for (int f = 0; f < nfast; f++) {
+        int i = ps->fast_list[f];
+        sphere s = sphere_soa_get(&ps->soa, i);
+        double travel = mag(&s.velocity) * position_step / (0.5 * s.radius);
+        double wanted = ceil(travel);
+        int substeps = wanted < ps->max_substeps ? (int)wanted : ps->max_substeps;
+        double h = position_step / substeps;
+        pt3 g = pt3_mul(&gravity, 1.0 / substeps);
+        for (int k = 0; k < substeps; k++) {
+            s = sphere_soa_get(&ps->soa, i);
+            collide_planes_with(ctx, &s, &g);
+            sphere_soa_set_velocity(&ps->soa, i, &s.velocity);
+            ps->num_impacts += sweep_sphere(ctx, i, h);
         }
     }
 }
@@ -65,16 +737,39 @@ void calc_velocities(struct context *ctx) {
 /**
  * this will update sphere positions using the new calculated velocities
  * this must run AFTER calc_velocities() is finished AND after rendering is finished
+ * with substeps enabled, fast spheres are swept instead, see sweep_fast_spheres()
  */
 void update_positions(struct context *ctx) {
-    for (int i = 0; i < ctx->num_spheres; i++) {
-        ctx->spheres[i].position = pt3_addv(
-            ctx->spheres[i].position,
-            pt3_mul(&ctx->spheres[i].velocity, 1.0 / 24.0)
-        );
+    struct physics_state *ps = begin_step(ctx);
+    int nfast = ps->max_substeps > 0 ? list_fast_spheres(ctx) : 0;
+    // the runs of spheres between fast ones
+    for (int lo = 0, f = 0; lo < ctx->num_spheres; f++) {
+        int hi = f < nfast ? ps->fast_list[f] : ctx->num_spheres;
+        soa_integrate(&ps->soa, lo, hi, position_step);
+        lo = hi + 1;
     }
+    ps->num_impacts = 0;
+    if (nfast > 0)
+        sweep_fast_spheres(ctx, nfast);
 }
 
+/**
+ * one whole step, calc_velocities() then update_positions(). when nothing between the two needs
+ * the velocities (no sleeping, no substeps) the plane pass moves the spheres as well, saving a pass
+ * over them.
+ */
+void step_physics(struct context *ctx) {
+    struct physics_state *ps = get_physics_state(ctx);
+    if (ps->sleep_threshold > 0 || ps->max_substeps > 0) {
+        calc_velocities(ctx);
+        update_positions(ctx);
+        return;
+    }
+    ps->integrate_with_planes = 1;
+    calc_velocities(ctx);
+    ps->integrate_with_planes = 0;
+    ps->num_impacts = 0;
+}
 
 // static const double framerate = 25;
 // static const pt3 gravity = {{0, -9.8 / framerate, 0}};
@@ -7,6 +7,24 @@
 void step_physics(struct context *ctx);
 
 void calc_velocities(struct context *ctx);
+void calc_velocities_bruteforce(struct context *ctx);
 void update_positions(struct context *ctx);
+void physics_set_threads(struct context *ctx, int nthreads);
+void physics_set_sleep(struct context *ctx, double threshold, int steps);
+int physics_awake_count(struct context *ctx);
+void physics_get_sleep_state(struct context *ctx, int i, int *asleep, int *still_steps);
+void physics_set_sleep_state(struct context *ctx, int i, int asleep, int still_steps);
+void physics_set_substeps(struct context *ctx, int max_substeps);
+int physics_impact_count(struct context *ctx);
+void free_physics_state(struct context *ctx);
+
+// The physics keeps the positions, velocities and radii of the spheres in arrays of its own from one step to the
+// next (see ray_physics_soa.h), so ctx->spheres falls behind while it steps. physics_sync_spheres() brings them up
+// to date; physics_copy_spheres() and physics_copy_positions() write what they would be elsewhere instead. Code
+// that changes ctx->spheres between steps calls physics_spheres_changed() so the next step starts from them.
+void physics_sync_spheres(struct context *ctx);
+void physics_copy_spheres(struct context *ctx, sphere *out);
+void physics_copy_positions(struct context *ctx, pt3 *out);
+void physics_spheres_changed(struct context *ctx);
 
 #endif	// RAY_PHYSICS_H__
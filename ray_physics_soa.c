@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SOA_AVX2	1
+#else
+#define SOA_AVX2	0
+#endif
+
+#include "ray_physics_soa.h"
+
+// must stay in step with intersect_sphere_plane()
+#define PLANE_CONTACT_SLOP	0.001
+
+// 32 byte aligned, so the kernels' loads don't straddle cache lines more than they must
+static double *soa_array(double *old, int cap, int keep) {
+	double *a = aligned_alloc(32, (sizeof(double) * cap + 31) / 32 * 32);
+	if (old) {
+		memcpy(a, old, sizeof(double) * keep);
+		free(old);
+	}
+	return a;
+}
+
+void sphere_soa_reserve(struct sphere_soa *s, int n) {
+	if (n <= s->cap)
+		return;
+	int cap = s->cap ? 2 * s->cap : 64;
+	if (cap < n)
+		cap = n;
+	double **arrays[] = { &s->px, &s->py, &s->pz, &s->vx, &s->vy, &s->vz, &s->r };
+	for (size_t k = 0; k < sizeof(arrays) / sizeof(arrays[0]); k++)
+		*arrays[k] = soa_array(*arrays[k], cap, s->n);
+	s->cap = cap;
+}
+
+void sphere_soa_free(struct sphere_soa *s) {
+	free(s->px);
+	free(s->py);
+	free(s->pz);
+	free(s->vx);
+	free(s->vy);
+	free(s->vz);
+	free(s->r);
+	memset(s, 0, sizeof(*s));
+}
+
+void sphere_soa_load(struct sphere_soa *s, const sphere *spheres, int n) {
+	sphere_soa_reserve(s, n);
+	s->n = n;
+	for (int i = 0; i < n; i++) {
+		const sphere *sp = &spheres[i];
+		s->px[i] = sp->position.v[0];
+		s->py[i] = sp->position.v[1];
+		s->pz[i] = sp->position.v[2];
+		s->vx[i] = sp->velocity.v[0];
+		s->vy[i] = sp->velocity.v[1];
+		s->vz[i] = sp->velocity.v[2];
+		s->r[i] = sp->radius;
+	}
+}
+
+void sphere_soa_store(const struct sphere_soa *s, const sphere *from, sphere *to) {
+	for (int i = 0; i < s->n; i++) {
+		sphere *sp = &to[i];
+		if (from != to)
+			*sp = from[i];
+		sp->position.v[0] = s->px[i];
+		sp->position.v[1] = s->py[i];
+		sp->position.v[2] = s->pz[i];
+		sp->velocity.v[0] = s->vx[i];
+		sp->velocity.v[1] = s->vy[i];
+		sp->velocity.v[2] = s->vz[i];
+	}
+}
+
+void sphere_soa_copy_shapes(struct sphere_soa *dst, const struct sphere_soa *src) {
+	sphere_soa_reserve(dst, src->n);
+	dst->n = src->n;
+	memcpy(dst->px, src->px, sizeof(double) * src->n);
+	memcpy(dst->py, src->py, sizeof(double) * src->n);
+	memcpy(dst->pz, src->pz, sizeof(double) * src->n);
+	memcpy(dst->r, src->r, sizeof(double) * src->n);
+}
+
+// one sphere through one plane, the scalar version and the tail of the AVX2 one
+static inline void plane_one(struct sphere_soa *s, int i, const plane *p, const pt3 *gravity) {
+	const double *n = p->normal.v;
+	double dist = 0;
+	dist += (s->px[i] - p->position.v[0]) * n[0];
+	dist += (s->py[i] - p->position.v[1]) * n[1];
+	dist += (s->pz[i] - p->position.v[2]) * n[2];
+	if (dist < s->r[i] + PLANE_CONTACT_SLOP) {
+		double d = 0;
+		d += s->vx[i] * n[0];
+		d += s->vy[i] * n[1];
+		d += s->vz[i] * n[2];
+		if (d < 0) {
+			double f = -1.99 * d;
+			s->vx[i] += n[0] * f;
+			s->vy[i] += n[1] * f;
+			s->vz[i] += n[2] * f;
+		}
+	} else {
+		s->vx[i] += gravity->v[0];
+		s->vy[i] += gravity->v[1];
+		s->vz[i] += gravity->v[2];
+	}
+}
+
+static inline void integrate_one(struct sphere_soa *s, int i, double dt) {
+	s->px[i] += s->vx[i] * dt;
+	s->py[i] += s->vy[i] * dt;
+	s->pz[i] += s->vz[i] * dt;
+}
+
+#if SOA_AVX2
+// no FMA on purpose: a fused multiply-add rounds differently from the scalar code. returns where the scalar
+// tail has to take over
+__attribute__((target("avx2")))
+static int collide_planes_avx2(struct sphere_soa *s, int lo, int hi, const plane *planes, int num_planes,
+		const pt3 *gravity, int integrate, double dt) {
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d slop = _mm256_set1_pd(PLANE_CONTACT_SLOP);
+	const __m256d bounce = _mm256_set1_pd(-1.99);
+	const __m256d gx = _mm256_set1_pd(gravity->v[0]);
+	const __m256d gy = _mm256_set1_pd(gravity->v[1]);
+	const __m256d gz = _mm256_set1_pd(gravity->v[2]);
+	const __m256d t = _mm256_set1_pd(dt);
+	int i = lo;
+	for (; i + 4 <= hi; i += 4) {
+		__m256d px = _mm256_loadu_pd(s->px + i), py = _mm256_loadu_pd(s->py + i), pz = _mm256_loadu_pd(s->pz + i);
+		__m256d vx = _mm256_loadu_pd(s->vx + i), vy = _mm256_loadu_pd(s->vy + i), vz = _mm256_loadu_pd(s->vz + i);
+		__m256d reach = _mm256_add_pd(_mm256_loadu_pd(s->r + i), slop);
+		for (int j = 0; j < num_planes; j++) {
+			const plane *p = &planes[j];
+			__m256d nx = _mm256_set1_pd(p->normal.v[0]);
+			__m256d ny = _mm256_set1_pd(p->normal.v[1]);
+			__m256d nz = _mm256_set1_pd(p->normal.v[2]);
+
+			__m256d dist = _mm256_add_pd(zero, _mm256_mul_pd(_mm256_sub_pd(px, _mm256_set1_pd(p->position.v[0])), nx));
+			dist = _mm256_add_pd(dist, _mm256_mul_pd(_mm256_sub_pd(py, _mm256_set1_pd(p->position.v[1])), ny));
+			dist = _mm256_add_pd(dist, _mm256_mul_pd(_mm256_sub_pd(pz, _mm256_set1_pd(p->position.v[2])), nz));
+			__m256d touching = _mm256_cmp_pd(dist, reach, _CMP_LT_OQ);
+
+			__m256d d = _mm256_add_pd(zero, _mm256_mul_pd(vx, nx));
+			d = _mm256_add_pd(d, _mm256_mul_pd(vy, ny));
+			d = _mm256_add_pd(d, _mm256_mul_pd(vz, nz));
+			__m256d approaching = _mm256_and_pd(touching, _mm256_cmp_pd(d, zero, _CMP_LT_OQ));
+			__m256d f = _mm256_mul_pd(bounce, d);
+
+			// touching and approaching: bounce; touching: unchanged; otherwise: gravity
+			__m256d bx = _mm256_add_pd(vx, _mm256_mul_pd(nx, f));
+			__m256d by = _mm256_add_pd(vy, _mm256_mul_pd(ny, f));
+			__m256d bz = _mm256_add_pd(vz, _mm256_mul_pd(nz, f));
+			__m256d fx = _mm256_add_pd(vx, gx), fy = _mm256_add_pd(vy, gy), fz = _mm256_add_pd(vz, gz);
+			vx = _mm256_blendv_pd(_mm256_blendv_pd(fx, vx, touching), bx, approaching);
+			vy = _mm256_blendv_pd(_mm256_blendv_pd(fy, vy, touching), by, approaching);
+			vz = _mm256_blendv_pd(_mm256_blendv_pd(fz, vz, touching), bz, approaching);
+		}
+		_mm256_storeu_pd(s->vx + i, vx);
+		_mm256_storeu_pd(s->vy + i, vy);
+		_mm256_storeu_pd(s->vz + i, vz);
+		if (integrate) {
+			_mm256_storeu_pd(s->px + i, _mm256_add_pd(px, _mm256_mul_pd(vx, t)));
+			_mm256_storeu_pd(s->py + i, _mm256_add_pd(py, _mm256_mul_pd(vy, t)));
+			_mm256_storeu_pd(s->pz + i, _mm256_add_pd(pz, _mm256_mul_pd(vz, t)));
+		}
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static int integrate_avx2(struct sphere_soa *s, int lo, int hi, double dt) {
+	const __m256d t = _mm256_set1_pd(dt);
+	int i = lo;
+	for (; i + 4 <= hi; i += 4) {
+		_mm256_storeu_pd(s->px + i, _mm256_add_pd(_mm256_loadu_pd(s->px + i), _mm256_mul_pd(_mm256_loadu_pd(s->vx + i), t)));
+		_mm256_storeu_pd(s->py + i, _mm256_add_pd(_mm256_loadu_pd(s->py + i), _mm256_mul_pd(_mm256_loadu_pd(s->vy + i), t)));
+		_mm256_storeu_pd(s->pz + i, _mm256_add_pd(_mm256_loadu_pd(s->pz + i), _mm256_mul_pd(_mm256_loadu_pd(s->vz + i), t)));
+	}
+	return i;
+}
+#endif
+
+// -1 until the first soa_have_avx2() looks at the CPU
+static atomic_int have_avx2 = -1;
+static atomic_int avx2_enabled = 1;
+
+int soa_have_avx2(void) {
+#if SOA_AVX2
+	int have = atomic_load_explicit(&have_avx2, memory_order_relaxed);
+	if (have < 0) {
+		have = __builtin_cpu_supports("avx2") != 0;
+		atomic_store_explicit(&have_avx2, have, memory_order_relaxed);
+	}
+	return have && atomic_load_explicit(&avx2_enabled, memory_order_relaxed);
+#else
+	return 0;
+#endif
+}
+
+void soa_use_avx2(int enabled) {
+	atomic_store_explicit(&avx2_enabled, enabled != 0, memory_order_relaxed);
+}
+
+void soa_collide_planes(struct sphere_soa *s, int lo, int hi, const plane *planes, int num_planes, const pt3 *gravity) {
+	int i = lo;
+#if SOA_AVX2
+	if (soa_have_avx2())
+		i = collide_planes_avx2(s, lo, hi, planes, num_planes, gravity, 0, 0);
+#endif
+	for (; i < hi; i++)
+		for (int j = 0; j < num_planes; j++)
+			plane_one(s, i, &planes[j], gravity);
+}
+
+void soa_collide_planes_integrate(struct sphere_soa *s, int lo, int hi, const plane *planes, int num_planes,
+		const pt3 *gravity, double dt) {
+	int i = lo;
+#if SOA_AVX2
+	if (soa_have_avx2())
+		i = collide_planes_avx2(s, lo, hi, planes, num_planes, gravity, 1, dt);
+#endif
+	for (; i < hi; i++) {
+		for (int j = 0; j < num_planes; j++)
+			plane_one(s, i, &planes[j], gravity);
+		integrate_one(s, i, dt);
+	}
+}
+
+void soa_integrate(struct sphere_soa *s, int lo, int hi, double dt) {
+	int i = lo;
+#if SOA_AVX2
+	if (soa_have_avx2())
+		i = integrate_avx2(s, lo, hi, dt);
+#endif
+	for (; i < hi; i++)
+		integrate_one(s, i, dt);
+}
@@ -0,0 +1,79 @@
+#ifndef RAY_PHYSICS_SOA_H__
+#define RAY_PHYSICS_SOA_H__
+
+#include "ray_ast.h"
+
+// The physics state of the spheres as structure of arrays: one array per coordinate of the positions and
+// velocities, and one of radii. The physics keeps its spheres in this form from step to step (see
+// ray_physics.h), so the per-sphere passes load several spheres' worth of one coordinate at once and read
+// nothing but the fields they use; the broadphase and the pairs reach into the same arrays by index.
+// Each kernel does the same floating point operations in the same order as the scalar code in ray_physics.c,
+// without fused multiply-adds, so the results are identical. With AVX2 (checked at run time) they handle 4
+// spheres per instruction.
+
+struct sphere_soa {
+	int n;
+	int cap;
+	double *px, *py, *pz;
+	double *vx, *vy, *vz;
+	double *r;
+};
+
+void sphere_soa_reserve(struct sphere_soa *s, int n);
+void sphere_soa_free(struct sphere_soa *s);
+// n spheres' positions, velocities and radii from spheres
+void sphere_soa_load(struct sphere_soa *s, const sphere *spheres, int n);
+// the spheres in from with the positions and velocities of s, into to (which may be from)
+void sphere_soa_store(const struct sphere_soa *s, const sphere *from, sphere *to);
+// the positions and radii of src, for a broadphase that must see different spheres than the physics state
+void sphere_soa_copy_shapes(struct sphere_soa *dst, const struct sphere_soa *src);
+
+// sphere i as a sphere record, for the code that works on one sphere or pair at a time. only position, velocity
+// and radius are filled in
+static inline sphere sphere_soa_get(const struct sphere_soa *s, int i) {
+	sphere sp = {{{0}}, {{0}}, 0, s->r[i], 0};
+	sp.position.v[0] = s->px[i];
+	sp.position.v[1] = s->py[i];
+	sp.position.v[2] = s->pz[i];
+	sp.velocity.v[0] = s->vx[i];
+	sp.velocity.v[1] = s->vy[i];
+	sp.velocity.v[2] = s->vz[i];
+	return sp;
+}
+
+// only position and radius, for the tests that don't look at velocity: each field left out is one less
+// array, so one less cache line, per neighbour
+static inline sphere sphere_soa_get_shape(const struct sphere_soa *s, int i) {
+	sphere sp = {{{0}}, {{0}}, 0, s->r[i], 0};
+	sp.position.v[0] = s->px[i];
+	sp.position.v[1] = s->py[i];
+	sp.position.v[2] = s->pz[i];
+	return sp;
+}
+
+static inline void sphere_soa_set_velocity(struct sphere_soa *s, int i, const pt3 *v) {
+	s->vx[i] = v->v[0];
+	s->vy[i] = v->v[1];
+	s->vz[i] = v->v[2];
+}
+
+static inline void sphere_soa_set_position(struct sphere_soa *s, int i, const pt3 *p) {
+	s->px[i] = p->v[0];
+	s->py[i] = p->v[1];
+	s->pz[i] = p->v[2];
+}
+
+// The kernels work on spheres [lo, hi).
+// collide_planes(): bounce off every plane a sphere touches, gravity once per plane it doesn't
+void soa_collide_planes(struct sphere_soa *s, int lo, int hi, const plane *planes, int num_planes, const pt3 *gravity);
+// the same, then position += velocity * dt
+void soa_collide_planes_integrate(struct sphere_soa *s, int lo, int hi, const plane *planes, int num_planes,
+		const pt3 *gravity, double dt);
+// position += velocity * dt
+void soa_integrate(struct sphere_soa *s, int lo, int hi, double dt);
+
+// whether the kernels run the AVX2 versions. soa_use_avx2(0) makes them run the scalar ones, for benchmarks
+int soa_have_avx2(void);
+void soa_use_avx2(int enabled);
+
+#endif	// RAY_PHYSICS_SOA_H__
@@ -2,149 +2,688 @@
 #include "ray_render.h"
 #include "ray_ast.h"
 #include "ray_math.h"
+#include "ray_mesh.h"
+
+#if RENDER_SIMD
+#include <immintrin.h>
+#endif
 
 static const pt4 ambient_light = {{0.2, 0.2, 0.2, 1.0}};
 
-// This function should not need to be changed, unless you want to play with the rendering.
-int raytrace(const struct context *ctx, const ray *r, pt4 *ret, int depth) {
+// Primitive kinds a kernel looks at, see raytrace_kernel_for().
+#define TRACE_SPHERES	1
+#define TRACE_PLANES	2
+#define TRACE_INSTANCES	4
+#define TRACE_ALL	(TRACE_SPHERES | TRACE_PLANES | TRACE_INSTANCES)
+
+// Everything below is inlined into each kernel with the kinds and depth constant, so the loops over primitives
+// a scene doesn't have drop out and the bounces unroll.
+#define TRACE_INLINE	static inline __attribute__((always_inline))
+
+struct trace_hit {
+	double t;
+	pt3 normal;
+	const color *c;
+};
+
+// Scalar sphere tests over records [from, n), for the spheres SIMD blocks don't cover. A nearer hit moves
+// *best_t and sets hit.
+#define NEAREST_SPHERE(records, from, n, r, best_t, hit)	do {						\
+	for (int i_ = (from); i_ < (n); i_++) {									\
+		double t_;											\
+		pt3 q_;												\
+		if (intersect_ray_sphere_at(r, &(records)[i_].position, (records)[i_].radius, &t_, &q_) &&	\
+				(*(best_t) < 0 || t_ < *(best_t))) {						\
+			*(best_t) = t_;										\
+			(hit) = i_;										\
+		}												\
+	}													\
+} while (0)
+
+#define ANY_SPHERE(records, from, n, r)	do {									\
+	for (int i_ = (from); i_ < (n); i_++) {									\
+		double t_;											\
+		pt3 q_;												\
+		if (intersect_ray_sphere_at(r, &(records)[i_].position, (records)[i_].radius, &t_, &q_))	\
+			return 1;										\
+	}													\
+} while (0)
+
+#if RENDER_SIMD
+// The hits in mask, a bit per sphere from first on, taken in sphere order as the scalar loop takes them, so ties
+// go the same way.
+static inline int take_sphere_hits(int mask, const double *t, int first, double *best_t, int hit) {
+	for (int k = 0; mask; k++, mask >>= 1) {
+		if ((mask & 1) && (*best_t < 0 || t[k] < *best_t)) {
+			*best_t = t[k];
+			hit = first + k;
+		}
+	}
+	return hit;
+}
+
+_Static_assert(sizeof(struct render_sphere) == 4 * sizeof(double), "render records must be x, y, z, radius");
+
+// Four render records as x, y, z and radius vectors.
+RENDER_TARGET_AVX2 static inline void load_spheres_avx2(const struct render_sphere *s, __m256d *x, __m256d *y,
+		__m256d *z, __m256d *radius) {
+	__m256d a = _mm256_loadu_pd((const double *)&s[0]);	// x0 y0 z0 r0
+	__m256d b = _mm256_loadu_pd((const double *)&s[1]);
+	__m256d c = _mm256_loadu_pd((const double *)&s[2]);
+	__m256d d = _mm256_loadu_pd((const double *)&s[3]);
+	__m256d ab_xz = _mm256_unpacklo_pd(a, b);		// x0 x1 z0 z1
+	__m256d ab_yr = _mm256_unpackhi_pd(a, b);		// y0 y1 r0 r1
+	__m256d cd_xz = _mm256_unpacklo_pd(c, d);
+	__m256d cd_yr = _mm256_unpackhi_pd(c, d);
+	*x = _mm256_permute2f128_pd(ab_xz, cd_xz, 0x20);
+	*z = _mm256_permute2f128_pd(ab_xz, cd_xz, 0x31);
+	*y = _mm256_permute2f128_pd(ab_yr, cd_yr, 0x20);
+	*radius = _mm256_permute2f128_pd(ab_yr, cd_yr, 0x31);
+}
+
+// intersect_ray_sphere_at() on four spheres: the same operations in the same order, so the same distances,
+// which go to *t. Returns a bit per sphere hit.
+RENDER_TARGET_AVX2 static inline int spheres_hit_avx2(const struct render_sphere *s, const __m256d *o,
+		const __m256d *d, __m256d *t) {
+	__m256d x, y, z, radius;
+	load_spheres_avx2(s, &x, &y, &z, &radius);
+	const __m256d zero = _mm256_setzero_pd();
+	__m256d mx = _mm256_sub_pd(o[0], x);
+	__m256d my = _mm256_sub_pd(o[1], y);
+	__m256d mz = _mm256_sub_pd(o[2], z);
+	__m256d b = _mm256_add_pd(zero, _mm256_mul_pd(mx, d[0]));
+	b = _mm256_add_pd(b, _mm256_mul_pd(my, d[1]));
+	b = _mm256_add_pd(b, _mm256_mul_pd(mz, d[2]));
+	__m256d c = _mm256_add_pd(zero, _mm256_mul_pd(mx, mx));
+	c = _mm256_add_pd(c, _mm256_mul_pd(my, my));
+	c = _mm256_add_pd(c, _mm256_mul_pd(mz, mz));
+	c = _mm256_sub_pd(c, _mm256_mul_pd(radius, radius));
+	__m256d discr = _mm256_sub_pd(_mm256_mul_pd(b, b), c);
+	__m256d away = _mm256_and_pd(_mm256_cmp_pd(c, zero, _CMP_GT_OQ), _mm256_cmp_pd(b, zero, _CMP_GT_OQ));
+	__m256d miss = _mm256_or_pd(away, _mm256_cmp_pd(discr, zero, _CMP_LT_OQ));
+	__m256d t1 = _mm256_sub_pd(_mm256_xor_pd(b, _mm256_set1_pd(-0.0)), _mm256_sqrt_pd(discr));
+	*t = _mm256_andnot_pd(_mm256_cmp_pd(t1, zero, _CMP_LT_OQ), t1);
+	return ~_mm256_movemask_pd(miss) & 0xf;
+}
+
+RENDER_TARGET_AVX2 static int nearest_sphere_avx2(const struct render_sphere *s, int n, const ray *r, double *best_t) {
+	__m256d o[3], d[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = _mm256_set1_pd(r->origin.v[k]);
+		d[k] = _mm256_set1_pd(r->direction.v[k]);
+	}
+	int hit = -1;
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d t;
+		int mask = spheres_hit_avx2(s + i, o, d, &t);
+		if (mask) {
+			double ts[4];
+			_mm256_storeu_pd(ts, t);
+			hit = take_sphere_hits(mask, ts, i, best_t, hit);
+		}
+	}
+	NEAREST_SPHERE(s, i, n, r, best_t, hit);
+	return hit;
+}
+
+RENDER_TARGET_AVX2 static int any_sphere_avx2(const struct render_sphere *s, int n, const ray *r) {
+	__m256d o[3], d[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = _mm256_set1_pd(r->origin.v[k]);
+		d[k] = _mm256_set1_pd(r->direction.v[k]);
+	}
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256d t;
+		if (spheres_hit_avx2(s + i, o, d, &t))
+			return 1;
+	}
+	ANY_SPHERE(s, i, n, r);
+	return 0;
+}
+
+// Eight render records as x, y, z and radius vectors.
+RENDER_TARGET_AVX512 static inline void load_spheres_avx512(const struct render_sphere *s, __m512d *x, __m512d *y,
+		__m512d *z, __m512d *radius) {
+	const double *p = (const double *)s;
+	__m512d a = _mm512_loadu_pd(p);				// x0 y0 z0 r0 x1 y1 z1 r1
+	__m512d b = _mm512_loadu_pd(p + 8);
+	__m512d c = _mm512_loadu_pd(p + 16);
+	__m512d d = _mm512_loadu_pd(p + 24);
+	const __m512i xy = _mm512_setr_epi64(0, 4, 8, 12, 1, 5, 9, 13);
+	const __m512i zr = _mm512_setr_epi64(2, 6, 10, 14, 3, 7, 11, 15);
+	const __m512i lo = _mm512_setr_epi64(0, 1, 2, 3, 8, 9, 10, 11);
+	const __m512i hi = _mm512_setr_epi64(4, 5, 6, 7, 12, 13, 14, 15);
+	__m512d ab_xy = _mm512_permutex2var_pd(a, xy, b);	// x0 x1 x2 x3 y0 y1 y2 y3
+	__m512d ab_zr = _mm512_permutex2var_pd(a, zr, b);
+	__m512d cd_xy = _mm512_permutex2var_pd(c, xy, d);
+	__m512d cd_zr = _mm512_permutex2var_pd(c, zr, d);
+	*x = _mm512_permutex2var_pd(ab_xy, lo, cd_xy);
+	*y = _mm512_permutex2var_pd(ab_xy, hi, cd_xy);
+	*z = _mm512_permutex2var_pd(ab_zr, lo, cd_zr);
+	*radius = _mm512_permutex2var_pd(ab_zr, hi, cd_zr);
+}
+
+// spheres_hit_avx2() on eight spheres.
+RENDER_TARGET_AVX512 static inline int spheres_hit_avx512(const struct render_sphere *s, const __m512d *o,
+		const __m512d *d, __m512d *t) {
+	__m512d x, y, z, radius;
+	load_spheres_avx512(s, &x, &y, &z, &radius);
+	const __m512d zero = _mm512_setzero_pd();
+	__m512d mx = _mm512_sub_pd(o[0], x);
+	__m512d my = _mm512_sub_pd(o[1], y);
+	__m512d mz = _mm512_sub_pd(o[2], z);
+	__m512d b = _mm512_add_pd(zero, _mm512_mul_pd(mx, d[0]));
+	b = _mm512_add_pd(b, _mm512_mul_pd(my, d[1]));
+	b = _mm512_add_pd(b, _mm512_mul_pd(mz, d[2]));
+	__m512d c = _mm512_add_pd(zero, _mm512_mul_pd(mx, mx));
+	c = _mm512_add_pd(c, _mm512_mul_pd(my, my));
+	c = _mm512_add_pd(c, _mm512_mul_pd(mz, mz));
+	c = _mm512_sub_pd(c, _mm512_mul_pd(radius, radius));
+	__m512d discr = _mm512_sub_pd(_mm512_mul_pd(b, b), c);
+	__mmask8 away = _mm512_cmp_pd_mask(c, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(b, zero, _CMP_GT_OQ);
+	__mmask8 miss = away | _mm512_cmp_pd_mask(discr, zero, _CMP_LT_OQ);
+	// no _mm512_xor_pd without AVX-512DQ
+	__m512d minus_b = _mm512_castsi512_pd(_mm512_xor_epi64(_mm512_castpd_si512(b), _mm512_set1_epi64(INT64_MIN)));
+	__m512d t1 = _mm512_sub_pd(minus_b, _mm512_sqrt_pd(discr));
+	*t = _mm512_maskz_mov_pd(~_mm512_cmp_pd_mask(t1, zero, _CMP_LT_OQ), t1);
+	return ~miss & 0xff;
+}
+
+RENDER_TARGET_AVX512 static int nearest_sphere_avx512(const struct render_sphere *s, int n, const ray *r,
+		double *best_t) {
+	__m512d o[3], d[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = _mm512_set1_pd(r->origin.v[k]);
+		d[k] = _mm512_set1_pd(r->direction.v[k]);
+	}
+	int hit = -1;
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m512d t;
+		int mask = spheres_hit_avx512(s + i, o, d, &t);
+		if (mask) {
+			double ts[8];
+			_mm512_storeu_pd(ts, t);
+			hit = take_sphere_hits(mask, ts, i, best_t, hit);
+		}
+	}
+	NEAREST_SPHERE(s, i, n, r, best_t, hit);
+	return hit;
+}
+
+RENDER_TARGET_AVX512 static int any_sphere_avx512(const struct render_sphere *s, int n, const ray *r) {
+	__m512d o[3], d[3];
+	for (int k = 0; k < 3; k++) {
+		o[k] = _mm512_set1_pd(r->origin.v[k]);
+		d[k] = _mm512_set1_pd(r->direction.v[k]);
+	}
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m512d t;
+		if (spheres_hit_avx512(s + i, o, d, &t))
+			return 1;
+	}
+	ANY_SPHERE(s, i, n, r);
+	return 0;
+}
+#endif
+
+// Nearest render record r hits before *best_t, with the sphere tests of the given instruction set. Too few
+// spheres to fill a vector are left to the scalar loop, setting up the vectors would cost more than it saves.
+TRACE_INLINE int nearest_render_sphere(const struct render_sphere *s, int n, const ray *r, enum render_isa isa,
+		double *best_t) {
+#if RENDER_SIMD
+	if (isa == RENDER_ISA_AVX512 && n >= 8)
+		return nearest_sphere_avx512(s, n, r, best_t);
+	if (isa >= RENDER_ISA_AVX2 && n >= 4)
+		return nearest_sphere_avx2(s, n, r, best_t);
+#endif
+	int hit = -1;
+	NEAREST_SPHERE(s, 0, n, r, best_t, hit);
+	return hit;
+}
+
+TRACE_INLINE int any_render_sphere(const struct render_sphere *s, int n, const ray *r, enum render_isa isa) {
+#if RENDER_SIMD
+	if (isa == RENDER_ISA_AVX512 && n >= 8)
+		return any_sphere_avx512(s, n, r);
+	if (isa >= RENDER_ISA_AVX2 && n >= 4)
+		return any_sphere_avx2(s, n, r);
+#endif
+	ANY_SPHERE(s, 0, n, r);
+	return 0;
+}
+
+TRACE_INLINE int nearest_hit(const struct context *ctx, const ray *r, int kinds, enum render_isa isa,
+		struct trace_hit *h) {
 	double best_t = -1;
-	pt3 hit = {0};
-	pt3 normal = {0};
 	int sphere_hit_index = -1;
 	int plane_hit_index = -1;
-	for (int i = 0; i < ctx->num_spheres; i++) {
-		const struct sphere *const s = &ctx->spheres[i];
-		double t;
-		pt3 q;
-		if (intersect_ray_sphere(r, s, &t, &q)) {
-			//printf("sphere t %lf best_t %lf\n", t, best_t);
-			if (best_t < 0 || t < best_t) {
-				best_t = t;
-				hit = q;
-				normal = pt3_sub(&q, &s->position);
-				pt3_normalize_mut(&normal); 
-				sphere_hit_index = i;
-			}
-			if (0)
-			printf("ray: %lf %lf %lf hit sphere %d at %lf %lf %lf\n", r->direction.v[0], r->direction.v[1], r->direction.v[2],
-				i, q.v[0], q.v[1], q.v[2] );
-			// pr
-		}	
-	}
+	int instance_hit_index = -1;
+	if ((kinds & TRACE_SPHERES) && ctx->render_spheres)
+		sphere_hit_index = nearest_render_sphere(ctx->render_spheres, ctx->num_spheres, r, isa, &best_t);
+	else if (kinds & TRACE_SPHERES)
+		NEAREST_SPHERE(ctx->spheres, 0, ctx->num_spheres, r, &best_t, sphere_hit_index);
 
-	for (int i = 0; i < ctx->num_planes; i++) {
-		const struct plane *const p = &ctx->planes[i];
+
+	for (int i = 0; (kinds & TRACE_PLANES) && i < ctx->num_planes; i++) {
 		double t;
 		pt3 q;
-		if (intersect_ray_plane(r, p, &t, &q)) {
-			//printf("plane t %lf best_t %lf\n", t, best_t);
+		if (intersect_ray_plane(r, &ctx->planes[i], &t, &q)) {
 			if (best_t < 0 || t < best_t) {
 				best_t = t;
-				hit = q;
-				normal = p->normal;
-				pt3_normalize_mut(&normal); 
 				sphere_hit_index = -1;
 				plane_hit_index = i;
 			}
 		}
 	}
 
-	// if we have an intersection, apply the color, any maybe recurse.
-	const color *c;
-	if (sphere_hit_index >= 0) {
-		c = &ctx->spheres[sphere_hit_index].color;
+	if (kinds & TRACE_INSTANCES) {
+		double t;
+		int i = intersect_ray_instances(ctx, r, best_t < 0 ? INFINITY : best_t, 0, &t, &h->normal);
+		if (i >= 0) {
+			best_t = t;
+			instance_hit_index = i;
+		}
+	}
+
+	// Only the nearest hit needs a normal.
+	if (instance_hit_index >= 0) {
+		h->c = &ctx->materials[ctx->instances[instance_hit_index].material];
+	} else if (sphere_hit_index >= 0) {
+		pt3 hit = ray_project(r, best_t);
+		const pt3 *center = ctx->render_spheres ? &ctx->render_spheres[sphere_hit_index].position
+				: &ctx->spheres[sphere_hit_index].position;
+		h->normal = pt3_sub(&hit, center);
+		pt3_normalize_mut(&h->normal);
+		h->c = &ctx->materials[ctx->spheres[sphere_hit_index].material];
 	} else if (plane_hit_index >= 0) {
-		c = &ctx->planes[plane_hit_index].color;
+		h->normal = ctx->planes[plane_hit_index].normal;
+		pt3_normalize_mut(&h->normal);
+		h->c = &ctx->materials[ctx->planes[plane_hit_index].material];
 	} else {
 		return 0;
 	}
+	h->t = best_t;
+	return 1;
+}
 
-	if (!ret) {
-		// this is a light reachability test.
-		return 1;
+// Light reachability test: whether r hits anything at all, so it stops at the first hit.
+TRACE_INLINE int any_hit(const struct context *ctx, const ray *r, int kinds, enum render_isa isa) {
+	double t;
+	pt3 q;
+	if ((kinds & TRACE_SPHERES) && ctx->render_spheres) {
+		if (any_render_sphere(ctx->render_spheres, ctx->num_spheres, r, isa))
+			return 1;
+	} else if (kinds & TRACE_SPHERES) {
+		ANY_SPHERE(ctx->spheres, 0, ctx->num_spheres, r);
 	}
+	for (int i = 0; (kinds & TRACE_PLANES) && i < ctx->num_planes; i++)
+		if (intersect_ray_plane(r, &ctx->planes[i], &t, &q))
+			return 1;
+	return (kinds & TRACE_INSTANCES) && intersect_ray_instances(ctx, r, INFINITY, 1, &t, &q) >= 0;
+}
 
-	// add ambient term
-	pt4 ambient = pt4_mul_ptwise(&ambient_light, &c->rgba);
-	pt4_add_mut(ret, &ambient);
-	
-	// add a tiny bit to 'hit' to stop zfighting at edges
-	pt3 normal_out_bump = pt3_mul(&normal, 0.00001);
-	pt3 hit_out_bump = pt3_add(&hit, &normal_out_bump);
+// Follows r through up to depth reflections without recursing. A reflection's color is scaled and added to the
+// color of the surface it left once that surface is done, deepest first, in the order the recursive version
+// added them, so pixels come out the same to the bit.
+TRACE_INLINE int trace(const struct context *ctx, const ray *r, pt4 *ret, int depth, int kinds, enum render_isa isa) {
+	pt4 bounce_color[RAYTRACE_MAX_DEPTH + 1];
+	double bounce_scale[RAYTRACE_MAX_DEPTH + 1];
+	ray cur = *r;
+	int levels = 0;
+	for (int d = depth;; d--) {
+		struct trace_hit h;
+		if (!nearest_hit(ctx, &cur, kinds, isa, &h))
+			break;
+		pt4 *out = ret;
+		if (levels > 0) {
+			out = &bounce_color[levels];
+			memset(out, 0, sizeof(*out));
+		}
+		levels++;
+		const color *c = h.c;
+
+		// add ambient term
+		pt4 ambient = pt4_mul_ptwise(&ambient_light, &c->rgba);
+		pt4_add_mut(out, &ambient);
 
-	// dot product of the direction to the surface hit normal.
-	// negative means we're entering a shape, positive means we're leaving a shape (at least in spheres)
-	double nd = pt3_dot(&normal, &r->direction);
+		// add a tiny bit to 'hit' to stop zfighting at edges
+		pt3 hit = ray_project(&cur, h.t);
+		pt3 normal_out_bump = pt3_mul(&h.normal, 0.00001);
+		pt3 hit_out_bump = pt3_add(&hit, &normal_out_bump);
 
-	// fire a ray towards light sources.
-	if (depth > 0) {
-		for (int i = 0; i < ctx->num_lights; i++) {
+		// dot product of the direction to the surface hit normal.
+		// negative means we're entering a shape, positive means we're leaving a shape (at least in spheres)
+		double nd = pt3_dot(&h.normal, &cur.direction);
+
+		// fire a ray towards light sources.
+		for (int i = 0; d > 0 && i < ctx->num_lights; i++) {
 			const light *const l = &ctx->lights[i];
 			pt3 lightdir = pt3_sub(&l->position, &hit);
 			pt3_normalize_mut(&lightdir);
 			ray rlight = {hit_out_bump, lightdir};
-			//printf("light %d to thing\n", i);
-			if (!raytrace(ctx, &rlight, NULL, 0)) {
+			if (!any_hit(ctx, &rlight, kinds, isa)) {
 				// add diffuse & maybe specular term for this light
-				double light_directness = pt3_dot(&normal, &lightdir);
-				//printf("light %d to thing unobstructed, dot %lf\n", i, light_directness);
+				double light_directness = pt3_dot(&h.normal, &lightdir);
 				if (light_directness > 0) {
-					//printf("light directness!\n");
 					double light_distance = pt3_pt3_dist(&l->position, &hit);
 					double ldist_inv_square = 1.0 / light_distance * light_distance;
 					pt4 light_diffuse = pt4_mul(&l->color.rgba, ldist_inv_square * light_directness);
 					pt4 surface_diffuse = pt4_mul_ptwise(&light_diffuse, &c->rgba);
-					pt4_add_mut(ret, &surface_diffuse);
-				}	
+					pt4_add_mut(out, &surface_diffuse);
+				}
 			}
 		}
-	}
 
-	// reflection, if there.
-	if (depth > 0 && c->reflectance > 0 && nd < 0) {
-		pt3 bounce_normal = pt3_mul(&normal, nd * -2);
-		pt3 bounced = pt3_add(&r->direction, &bounce_normal);
+		// reflection, if there.
+		if (!(d > 0 && c->reflectance > 0 && nd < 0))
+			break;
+		pt3 bounce_normal = pt3_mul(&h.normal, nd * -2);
+		pt3 bounced = pt3_add(&cur.direction, &bounce_normal);
 		pt3_normalize_mut(&bounced);
-		ray bounce_ray = {hit_out_bump, bounced};
-		pt4 bounce_color = {0};
-		if (raytrace(ctx, &bounce_ray, &bounce_color, depth - 1)) {
-			pt4 bounce_color_scaled = pt4_mul(&bounce_color, c->reflectance);
-			pt4_add_mut(ret, &bounce_color_scaled);
-		}
+		bounce_scale[levels - 1] = c->reflectance;
+		cur.origin = hit_out_bump;
+		cur.direction = bounced;
+	}
+	for (int l = levels - 1; l > 0; l--) {
+		pt4 bounce_color_scaled = pt4_mul(&bounce_color[l], bounce_scale[l - 1]);
+		pt4_add_mut(l > 1 ? &bounce_color[l - 1] : ret, &bounce_color_scaled);
+	}
+	return levels > 0;
+}
+
+int raytrace(const struct context *ctx, const ray *r, pt4 *ret, int depth) {
+	enum render_isa isa = render_active_isa();
+	if (!ret)
+		return any_hit(ctx, r, TRACE_ALL, isa);
+	return trace(ctx, r, ret, depth < RAYTRACE_MAX_DEPTH ? depth : RAYTRACE_MAX_DEPTH, TRACE_ALL, isa);
+}
+
+// Each kernel is built for its instruction set as a whole, shading included, with the sphere tests of that set.
+// flatten, as with three sets of kernels GCC's unit growth limit would otherwise leave the later ones calling the
+// pt3 helpers out of line.
+#define RENDER_TARGET_SSE2
+#define RAYTRACE_KERNEL(isa, kinds)									\
+RENDER_TARGET_##isa __attribute__((flatten)) static int raytrace_kernel_##isa##_##kinds(const struct context *ctx, const ray *r, pt4 *ret) {	\
+	return trace(ctx, r, ret, RENDER_DEPTH, kinds, RENDER_ISA_##isa);					\
+}
+#define RAYTRACE_KERNELS(isa)										\
+	RAYTRACE_KERNEL(isa, 0) RAYTRACE_KERNEL(isa, 1) RAYTRACE_KERNEL(isa, 2) RAYTRACE_KERNEL(isa, 3)	\
+	RAYTRACE_KERNEL(isa, 4) RAYTRACE_KERNEL(isa, 5) RAYTRACE_KERNEL(isa, 6) RAYTRACE_KERNEL(isa, 7)
+#define KERNEL_TABLE(isa) {										\
+	raytrace_kernel_##isa##_0, raytrace_kernel_##isa##_1, raytrace_kernel_##isa##_2, raytrace_kernel_##isa##_3,	\
+	raytrace_kernel_##isa##_4, raytrace_kernel_##isa##_5, raytrace_kernel_##isa##_6, raytrace_kernel_##isa##_7,	\
+}
+RAYTRACE_KERNELS(SSE2)
+#if RENDER_SIMD
+RAYTRACE_KERNELS(AVX2)
+RAYTRACE_KERNELS(AVX512)
+#endif
+
+static const raytrace_kernel kernels[RENDER_ISA_COUNT][TRACE_ALL + 1] = {
+	KERNEL_TABLE(SSE2),
+#if RENDER_SIMD
+	KERNEL_TABLE(AVX2),
+	KERNEL_TABLE(AVX512),
+#endif
+};
+#undef KERNEL_TABLE
+#undef RAYTRACE_KERNELS
+#undef RAYTRACE_KERNEL
+
+static const char *const kernel_names[TRACE_ALL + 1] = {
+	"empty", "spheres", "planes", "spheres+planes",
+	"meshes", "spheres+meshes", "planes+meshes", "all",
+};
+
+static int scene_kinds(const struct context *ctx) {
+	return (ctx->num_spheres > 0 ? TRACE_SPHERES : 0) | (ctx->num_planes > 0 ? TRACE_PLANES : 0) |
+			(ctx->instance_bvh ? TRACE_INSTANCES : 0);
+}
+
+raytrace_kernel raytrace_kernel_for(const struct context *ctx) {
+	return kernels[render_active_isa()][scene_kinds(ctx)];
+}
+
+const char *raytrace_kernel_name(const struct context *ctx) {
+	return kernel_names[scene_kinds(ctx)];
+}
+
+static const char *const isa_names[RENDER_ISA_COUNT] = {
+	RENDER_SIMD ? "sse2" : "generic", "avx2", "avx512",
+};
+
+// -1 until the first render_active_isa() looks at the CPU
+static atomic_int active_isa = -1;
+
+int render_isa_supported(enum render_isa isa) {
+	switch (isa) {
+	case RENDER_ISA_SSE2:
+		return 1;
+#if RENDER_SIMD
+	case RENDER_ISA_AVX2:
+		return __builtin_cpu_supports("avx2") != 0;
+	case RENDER_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") != 0;
+#endif
+	default:
+		return 0;
 	}
+}
 
-	// refraction, if there. Alpha channel is see-thru-ness.
-	// I couldn't get this working in time.
-	if (0 && depth > 0 && c->rgba.v[3] < 1.0) {
-		pt3 normal_in_bump = pt3_mul(&normal, -0.00001);
-		pt3 hit_in_bump = pt3_add(&hit, &normal_in_bump);
-
-		static const double refractive_proportinality_of_glass = 1.5;	// glass
-		double refractive_proportionality = refractive_proportinality_of_glass;
-		double angle_of_incidence;
-		if (nd > 0) {
-			angle_of_incidence = acos(-nd);
-			refractive_proportionality = 1.0 / refractive_proportionality;
- 		} else {
-			angle_of_incidence = acos(nd);
+const char *render_isa_name(enum render_isa isa) {
+	return isa_names[isa];
+}
+
+enum render_isa render_isa_from_name(const char *name) {
+	for (int i = 0; i < RENDER_ISA_COUNT; i++)
+		if (strcmp(name, isa_names[i]) == 0)
+			return i;
+	return RENDER_ISA_COUNT;
+}
+
+enum render_isa render_active_isa(void) {
+	int isa = atomic_load_explicit(&active_isa, memory_order_relaxed);
+	if (isa < 0) {
+		isa = RENDER_ISA_SSE2;
+		for (int i = RENDER_ISA_COUNT - 1; i > RENDER_ISA_SSE2; i--) {
+			if (render_isa_supported(i)) {
+				isa = i;
+				break;
+			}
 		}
-		double angle_of_refraction = angle_of_incidence * refractive_proportionality;	// roughly, for glass
-		if (angle_of_refraction < M_PI/2) {
-		//printf("nd %lf angle_of_incidence %lf angle_of_refraction %lf\n", nd, angle_of_incidence, angle_of_refraction);
-			// lets refract!
-			pt3 refract_normal = pt3_mul(&normal, nd * refractive_proportionality);	// this isn't snells law but whatever
-			pt3 refracted = pt3_add(&r->direction, &refract_normal);
-			pt3_normalize_mut(&refracted);
-			ray refract_ray = {hit_in_bump, refracted};
-			pt4 refract_color = {0};
-			if (raytrace(ctx, &refract_ray, &refract_color, depth - 1)) {
-				pt4 refract_color_scaled = pt4_mul(&refract_color, 1.0 - c->rgba.v[3]);
-				pt4_add_mut(ret, &refract_color_scaled);
-			}		
+		atomic_store_explicit(&active_isa, isa, memory_order_relaxed);
+	}
+	return isa;
+}
+
+void render_set_isa(enum render_isa isa) {
+	atomic_store_explicit(&active_isa, isa, memory_order_relaxed);
+}
+
+struct frame_progress *new_frame_progress(int height, int band_height) {
+	struct frame_progress *p = malloc(sizeof(*p));
+	p->band_height = band_height;
+	p->num_bands = (height + band_height - 1) / band_height;
+	p->done = malloc(sizeof(*p->done) * p->num_bands);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	frame_progress_reset(p);
+	return p;
+}
+
+void free_frame_progress(struct frame_progress *p) {
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->done);
+	free(p);
+}
+
+// Must not be called while a renderer or encoder is still using p.
+void frame_progress_reset(struct frame_progress *p) {
+	atomic_store(&p->next_band, 0);
+	for (int i = 0; i < p->num_bands; i++)
+		atomic_store(&p->done[i], 0);
+}
+
+void frame_progress_mark_done(struct frame_progress *p, int band) {
+	pthread_mutex_lock(&p->lock);
+	atomic_store_explicit(&p->done[band], 1, memory_order_release);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Blocks until every band overlapping rows [y_lo, y_hi) has been rendered.
+void frame_progress_wait_rows(struct frame_progress *p, int y_lo, int y_hi) {
+	int first = y_lo / p->band_height;
+	int last = (y_hi - 1) / p->band_height;
+	for (int b = first; b <= last; b++) {
+		if (atomic_load_explicit(&p->done[b], memory_order_acquire))
+			continue;
+		pthread_mutex_lock(&p->lock);
+		while (!atomic_load_explicit(&p->done[b], memory_order_acquire))
+			pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+	}
+}
+
+struct render_worker_args {
+	struct framebuffer_pt4 *fb;
+	const struct context *ctx;
+	raytrace_kernel kernel;
+	int image_height;
+	int y_offset;
+	struct frame_progress *progress;
+};
+
+// Renders fb rows [y_lo, y_hi), which are rows y_offset + y_lo onwards of the image.
+static void render_rows(struct framebuffer_pt4 *fb, const struct context *ctx, raytrace_kernel kernel, int image_height,
+		int y_offset, int y_lo, int y_hi) {
+	double left_right_angle;
+	double up_down_angle;
+	int xmax = fb->width;
+	int ymax = image_height;
+	if (xmax > ymax) {
+		left_right_angle = M_PI / 3;
+		up_down_angle    = left_right_angle / xmax * ymax;
+	} else {
+		up_down_angle    = M_PI / 3;
+		left_right_angle = up_down_angle / ymax * xmax;
+	}
+
+	double left_right_start = - left_right_angle / 2.0;
+	double left_right_step  =   left_right_angle  / (xmax - 1);
+	double up_down_start    =   up_down_angle     /  2.0;
+	double up_down_step     =   up_down_angle     / (ymax - 1);
+
+	for (int y = y_lo; y < y_hi; y++) {
+		double yangle = up_down_start - up_down_step * (y + y_offset);
+		for (int x = 0; x < xmax; x++) {
+			double xangle = -(left_right_start + left_right_step * x);
+			pt3 direction = {{sin(xangle), sin(yangle), cos(yangle)*cos(xangle)}};
+			pt3_normalize_mut(&direction);
+			ray r = {{{0,0,-20}}, direction};
+			pt4 px_color = {0};
+			kernel(ctx, &r, &px_color);
+			framebuffer_pt4_set(fb, x, y, px_color);
 		}
 	}
+}
 
-	return 1;
+static void *render_worker(void *arg) {
+	struct render_worker_args *a = arg;
+	struct frame_progress *p = a->progress;
+	int n;
+	while ((n = atomic_fetch_add(&p->next_band, 1)) < p->num_bands) {
+		int band = p->num_bands - 1 - n;
+		int y_lo = band * p->band_height;
+		int y_hi = y_lo + p->band_height;
+		if (y_hi > a->fb->height) y_hi = a->fb->height;
+		render_rows(a->fb, a->ctx, a->kernel, a->image_height, a->y_offset, y_lo, y_hi);
+		frame_progress_mark_done(p, band);
+	}
+	return NULL;
+}
+
+static inline uint64_t hash_doubles(uint64_t h, const double *v, int n) {
+	for (int i = 0; i < n; i++) {
+		uint64_t bits;
+		memcpy(&bits, &v[i], sizeof(bits));
+		h = (h ^ bits) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	return h;
 }
 
+static inline uint64_t hash_color(uint64_t h, const color *c) {
+	h = hash_doubles(h, c->rgba.v, 4);
+	return hash_doubles(h, &c->reflectance, 1);
+}
+
+uint64_t scene_render_hash(const struct context *ctx) {
+	uint64_t h = 0xcbf29ce484222325ull ^ ctx->num_spheres;
+	for (int i = 0; i < ctx->num_spheres; i++) {
+		const sphere *s = &ctx->spheres[i];
+		h = hash_doubles(h, s->position.v, 3);
+		h = hash_doubles(h, &s->radius, 1);
+		h = hash_color(h, &ctx->materials[s->material]);
+	}
+	h = (h ^ ctx->num_planes) * 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < ctx->num_planes; i++) {
+		h = hash_doubles(h, ctx->planes[i].position.v, 3);
+		h = hash_doubles(h, ctx->planes[i].normal.v, 3);
+		h = hash_color(h, &ctx->materials[ctx->planes[i].material]);
+	}
+	h = (h ^ ctx->num_lights) * 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < ctx->num_lights; i++) {
+		h = hash_doubles(h, ctx->lights[i].position.v, 3);
+		h = hash_color(h, &ctx->lights[i].color);
+	}
+	h = (h ^ ctx->num_instances) * 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < ctx->num_instances; i++) {
+		const instance *in = &ctx->instances[i];
+		h = (h ^ in->mesh) * 0x9e3779b97f4a7c15ull;
+		h = hash_doubles(h, in->position.v, 3);
+		h = hash_doubles(h, in->to_world.m, 9);
+		h = hash_color(h, &ctx->materials[in->material]);
+	}
+	return h;
+}
 
+void render_scene(struct framebuffer_pt4 *fb, const struct context *ctx, struct frame_progress *progress, int nthreads) {
+	render_scene_rows(fb, ctx, fb->height, 0, progress, nthreads);
+}
+
+void render_scene_rows(struct framebuffer_pt4 *fb, const struct context *ctx, int image_height, int y_offset,
+		struct frame_progress *progress, int nthreads) {
+	struct frame_progress *local = NULL;
+	if (progress == NULL)
+		progress = local = new_frame_progress(fb->height, RENDER_BAND_HEIGHT);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	struct render_sphere *records = malloc(sizeof(*records) * (ctx->num_spheres > 0 ? ctx->num_spheres : 1));
+	for (int i = 0; i < ctx->num_spheres; i++) {
+		records[i].position = ctx->spheres[i].position;
+		records[i].radius = ctx->spheres[i].radius;
+	}
+	struct context view = *ctx;
+	view.render_spheres = records;
+
+	// Picked once for the frame from what the scene holds.
+	struct render_worker_args args = { fb, &view, raytrace_kernel_for(&view), image_height, y_offset, progress };
+	pthread_t *tids = malloc(sizeof(*tids) * nthreads);
+	for (int i = 1; i < nthreads; i++)
+		pthread_create(&tids[i], NULL, render_worker, &args);
+	render_worker(&args);
+	for (int i = 1; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	free(records);
+
+	if (local)
+		free_frame_progress(local);
+}
@@ -4,6 +4,8 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "ray_ast.h"
 
@@ -16,11 +18,13 @@ struct framebuffer_##t {									\
 };												\
 												\
 static inline struct framebuffer_##t *new_framebuffer_##t(int width, int height) {		\
-	struct framebuffer_##t *ret = malloc(sizeof(*ret) + sizeof(t) * n * width * height);	\
+	/* the pixels start as aligned as t wants, 16 bytes for pt4 under RAY_VEC4 */		\
+	size_t header = (sizeof(struct framebuffer_##t) + _Alignof(t) - 1) & ~(_Alignof(t) - 1);	\
+	struct framebuffer_##t *ret = malloc(header + sizeof(t) * n * width * height);		\
 	ret->width = width;									\
 	ret->height = height;									\
 	ret->channels = n;									\
-	ret->pixels = (void*)(ret + 1);								\
+	ret->pixels = (void*)((char *)ret + header);						\
 	return ret;										\
 }												\
 												\
@@ -49,7 +53,91 @@ static inline uint8_t color_double_to_u8(double d) {
 	return (uint8_t)(d * 255);
 }
 
+// What intersection tests read of a sphere, packed so a ray's pass over every sphere touches half a cache line
+// per sphere. render_scene_rows() makes these for the frame it renders; raytrace() falls back to the full
+// spheres when ctx->render_spheres is NULL.
+struct render_sphere {
+#if RAY_VEC4
+	union {
+		pt3 position;
+		struct {
+			double center_[3];
+			double radius;	// in position's spare lane, so set after position
+		};
+	};
+#else
+	pt3 position;
+	double radius;
+#endif
+};
+
+// Adds what r sees, following up to depth reflections, to ret and returns whether it hits anything; with ret
+// NULL only the latter. Depths past RAYTRACE_MAX_DEPTH are taken as it.
 int raytrace(const struct context *ctx, const ray *r, pt4 *ret, int depth);
 
+#define RAYTRACE_MAX_DEPTH	8
+#define RENDER_DEPTH		3	// reflections a camera ray follows
+
+// raytrace() at RENDER_DEPTH made for the kinds of primitive ctx holds, for every ray of a frame.
+typedef int (*raytrace_kernel)(const struct context *ctx, const ray *r, pt4 *ret);
+raytrace_kernel raytrace_kernel_for(const struct context *ctx);
+const char *raytrace_kernel_name(const struct context *ctx);
+
+// Instruction sets the render kernels, with their intersection tests and shading, and framebuffer conversion are
+// built for. The best one the CPU has is found with cpuid the first time it is asked for; render_set_isa()
+// overrides it. Every set gives the same pixels, to the bit.
+enum render_isa {
+	RENDER_ISA_SSE2,	// the x86-64 baseline, or plain C elsewhere
+	RENDER_ISA_AVX2,
+	RENDER_ISA_AVX512,
+	RENDER_ISA_COUNT
+};
+
+#if defined(__x86_64__)
+#define RENDER_SIMD	1
+#define RENDER_TARGET_AVX2	__attribute__((target("avx2")))
+#define RENDER_TARGET_AVX512	__attribute__((target("avx512f")))
+#else
+#define RENDER_SIMD	0
+#endif
+
+int render_isa_supported(enum render_isa isa);
+const char *render_isa_name(enum render_isa isa);
+// RENDER_ISA_COUNT if name isn't one.
+enum render_isa render_isa_from_name(const char *name);
+enum render_isa render_active_isa(void);
+// Must not be called while frames are being rendered or converted.
+void render_set_isa(enum render_isa isa);
+
+// Frames are rendered in horizontal bands of this many rows. Bands are handed out bottom band first,
+// since that is the order a BMP stores its rows in, so the encoder can start before the frame is done.
+#define RENDER_BAND_HEIGHT 16
+
+// Per-band completion tracking, shared between the render workers and the encoder of one frame.
+struct frame_progress {
+	int num_bands;
+	int band_height;
+	atomic_int next_band;		// next band to hand to a render worker, counting from the bottom
+	atomic_uchar *done;		// one flag per band, set once all of its rows are in the framebuffer
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct frame_progress *new_frame_progress(int height, int band_height);
+void free_frame_progress(struct frame_progress *p);
+void frame_progress_reset(struct frame_progress *p);
+void frame_progress_mark_done(struct frame_progress *p, int band);
+void frame_progress_wait_rows(struct frame_progress *p, int y_lo, int y_hi);
+
+// Hash of everything that decides what a frame looks like: sphere positions, radii and colors, planes and lights
+// (velocities and masses don't matter). Frames with equal hashes render to the same pixels.
+uint64_t scene_render_hash(const struct context *ctx);
+
+// Renders fb using nthreads workers. If progress is non-NULL bands are published to it as they finish.
+void render_scene(struct framebuffer_pt4 *fb, const struct context *ctx, struct frame_progress *progress, int nthreads);
+// Like render_scene, but fb only holds the fb->height rows starting at row y_offset of an image_height tall image.
+void render_scene_rows(struct framebuffer_pt4 *fb, const struct context *ctx, int image_height, int y_offset,
+		struct frame_progress *progress, int nthreads);
+
 #endif	// RAY_RENDER_H__
 
@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ray_scanner.h"
+#include "ray.yacc.generated_h"
+#include "ray.lex.generated_h"
+
+// What the scanner's yyextra points to.
+struct scanner_input {
+	char *buf;		// input read through stdio, if it couldn't be mapped
+	char *map;
+	size_t map_size;
+	int slow_floats;	// convert every float with strtod, see scanner_set_slow_floats()
+	locale_t c_locale;	// for strtod, made when first needed
+};
+
+static int is_digit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+int scanner_init(yyscan_t *scanner) {
+	struct scanner_input *in = calloc(1, sizeof(*in));
+	if (in == NULL || yylex_init_extra(in, scanner) != 0) {
+		free(in);
+		return -1;
+	}
+	return 0;
+}
+
+// flex scans a buffer in place if it ends in two NULs. Regular files are mapped with room for them after the
+// file, over anonymous zeroed pages since it may end on a page boundary; anything else is read into a buffer.
+// The mapping is private and writable because flex puts a NUL after each token while its action runs.
+int scanner_set_input(FILE *f, yyscan_t scanner) {
+	struct scanner_input *in = yyget_extra(scanner);
+	struct stat st;
+	char *text = NULL;
+	size_t len = 0;
+	if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		len = st.st_size;
+		in->map_size = (len + 2 + page - 1) / page * page;
+		in->map = mmap(NULL, in->map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (in->map != MAP_FAILED && mmap(in->map, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+				fileno(f), 0) != MAP_FAILED) {
+			madvise(in->map, len, MADV_SEQUENTIAL);
+			text = in->map;
+		} else {
+			if (in->map != MAP_FAILED)
+				munmap(in->map, in->map_size);
+			in->map = NULL;
+		}
+	}
+	if (text == NULL) {
+		size_t cap = 64 * 1024;
+		len = 0;
+		in->buf = malloc(cap);
+		for (size_t n; in->buf && (n = fread(in->buf + len, 1, cap - 2 - len, f)) > 0; ) {
+			len += n;
+			if (len + 2 == cap)
+				in->buf = realloc(in->buf, cap *= 2);
+		}
+		if (in->buf == NULL || ferror(f))
+			return -1;
+		text = in->buf;
+		text[len] = text[len + 1] = '\0';
+	}
+	if (yy_scan_buffer(text, len + 2, scanner) == NULL)
+		return -1;
+	// yy_scan_buffer() leaves the new buffer's line count unset
+	yyset_lineno(1, scanner);
+	return 0;
+}
+
+void scanner_set_slow_floats(int on, yyscan_t scanner) {
+	((struct scanner_input *)yyget_extra(scanner))->slow_floats = on;
+}
+
+void scanner_destroy(yyscan_t scanner) {
+	struct scanner_input *in = yyget_extra(scanner);
+	yylex_destroy(scanner);
+	if (in->map)
+		munmap(in->map, in->map_size);
+	if (in->c_locale)
+		freelocale(in->c_locale);
+	free(in->buf);
+	free(in);
+}
+
+static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Clinger's fast path: with at most 2^53 as the digits and a power of ten up to 10^22, both are exact doubles
+// and a single multiply or divide rounds correctly, so the result is the one strtod gives. That covers the
+// numbers scenes are written with; returns 0 for the rest.
+static int fast_float(const char *p, size_t len, double *out) {
+	const char *q = p, *end = p + len;
+	int negative = 0;
+	if (*q == '-' || *q == '+')
+		negative = *q++ == '-';
+	uint64_t m = 0;
+	int digits = 0, exp10 = 0;
+	for (int fraction = 0; q < end && (is_digit(*q) || (*q == '.' && !fraction)); q++) {
+		if (*q == '.') {
+			fraction = 1;
+			continue;
+		}
+		if (m != 0 || *q != '0') {
+			if (++digits > 19)
+				return 0;
+			m = m * 10 + (*q - '0');
+		}
+		exp10 -= fraction;
+	}
+	if (q < end) {		// 'e'
+		int e = 0, e_negative = *++q == '-';
+		for (q += e_negative; q < end; q++)
+			if (e < 10000)
+				e = e * 10 + (*q - '0');
+		exp10 += e_negative ? -e : e;
+	}
+	if (m > (1ull << 53))
+		return 0;
+	double v = m;
+	if (m != 0) {
+		if (exp10 < -22 || exp10 > 22)
+			return 0;
+		v = exp10 < 0 ? v / powers_of_ten[-exp10] : v * powers_of_ten[exp10];
+	}
+	*out = negative ? -v : v;
+	return 1;
+}
+
+static double slow_float(struct scanner_input *s, const char *p, size_t len) {
+	if (s->c_locale == 0)
+		s->c_locale = newlocale(LC_ALL_MASK, "C", 0);
+	char text[128];
+	char *copy = len < sizeof(text) ? text : malloc(len + 1);
+	memcpy(copy, p, len);
+	copy[len] = '\0';
+	double v = strtod_l(copy, NULL, s->c_locale);
+	if (copy != text)
+		free(copy);
+	return v;
+}
+
+double scanner_float(yyscan_t scanner, const char *p, size_t len) {
+	struct scanner_input *s = yyget_extra(scanner);
+	double v;
+	if (!s->slow_floats && fast_float(p, len, &v))
+		return v;
+	return slow_float(s, p, len);
+}
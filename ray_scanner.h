@@ -0,0 +1,23 @@
+#ifndef RAY_SCANNER_H__
+#define RAY_SCANNER_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "ray_ast.h"
+
+// Input and number conversion for the flex scanner in ray.lex. scanner_set_input() hands it the whole input at
+// once, mapped, or read up front if it isn't a regular file, and it is scanned in place: identifier tokens point
+// into it and stay valid until scanner_destroy(), as do strings, which are "..." on one line without escapes.
+// Numbers are converted straight from the input.
+
+int scanner_init(yyscan_t *scanner);
+int scanner_set_input(FILE *in, yyscan_t scanner);	// 0 once the input is mapped or read
+void scanner_destroy(yyscan_t scanner);
+
+// The value of the number token p[0..len), exactly as strtod would give it in the C locale.
+double scanner_float(yyscan_t scanner, const char *p, size_t len);
+// Converts every number with strtod instead of only those the fast path can't do exactly, for checking it.
+void scanner_set_slow_floats(int on, yyscan_t scanner);
+
+#endif	// RAY_SCANNER_H__
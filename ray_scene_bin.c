@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ray_scene_bin.h"
+#include "ray_bench.h"
+
+static uint64_t align_up(uint64_t x) {
+	return (x + SCENE_BIN_ALIGN - 1) & ~(uint64_t)(SCENE_BIN_ALIGN - 1);
+}
+
+static int write_section(FILE *f, uint64_t offset, const void *data, size_t size) {
+	static const char zeros[SCENE_BIN_ALIGN];
+	long pad = offset - ftell(f);
+	if (pad > 0 && fwrite(zeros, 1, pad, f) != (size_t)pad)
+		return -1;
+	return size == 0 || fwrite(data, size, 1, f) == 1 ? 0 : -1;
+}
+
+// Sphere and plane records end in padding that copies leave undefined. They are written through a zeroed buffer,
+// field by field, so compiling a scene twice gives the same file.
+#define RECORD_CHUNK	256
+
+static int write_spheres(FILE *f, uint64_t offset, const sphere *spheres, uint32_t n) {
+	int ret = write_section(f, offset, NULL, 0);
+	for (uint32_t i = 0; ret == 0 && i < n; i += RECORD_CHUNK) {
+		sphere chunk[RECORD_CHUNK];
+		uint32_t len = n - i < RECORD_CHUNK ? n - i : RECORD_CHUNK;
+		memset(chunk, 0, sizeof(chunk));
+		for (uint32_t k = 0; k < len; k++) {
+			chunk[k].position = spheres[i + k].position;
+			chunk[k].velocity = spheres[i + k].velocity;
+			chunk[k].mass = spheres[i + k].mass;
+			chunk[k].radius = spheres[i + k].radius;
+			chunk[k].material = spheres[i + k].material;
+		}
+		ret = fwrite(chunk, sizeof(*chunk), len, f) == len ? 0 : -1;
+	}
+	return ret;
+}
+
+static int write_planes(FILE *f, uint64_t offset, const plane *planes, uint32_t n) {
+	int ret = write_section(f, offset, NULL, 0);
+	for (uint32_t i = 0; ret == 0 && i < n; i += RECORD_CHUNK) {
+		plane chunk[RECORD_CHUNK];
+		uint32_t len = n - i < RECORD_CHUNK ? n - i : RECORD_CHUNK;
+		memset(chunk, 0, sizeof(chunk));
+		for (uint32_t k = 0; k < len; k++) {
+			chunk[k].position = planes[i + k].position;
+			chunk[k].normal = planes[i + k].normal;
+			chunk[k].material = planes[i + k].material;
+		}
+		ret = fwrite(chunk, sizeof(*chunk), len, f) == len ? 0 : -1;
+	}
+	return ret;
+}
+
+// Written to a temporary file renamed over path, so renders that have the old file mapped keep seeing it whole.
+int scene_bin_write(const char *path, const struct context *ctx) {
+	// Instances point at mesh files, which have no place in the format yet.
+	if (ctx->num_instances > 0) {
+		fprintf(stderr, "scenes with mesh instances can't be compiled\n");
+		return -1;
+	}
+	struct scene_bin_header hdr = {0};
+	memcpy(hdr.magic, SCENE_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = SCENE_BIN_VERSION;
+	hdr.byte_order = SCENE_BIN_BYTE_ORDER;
+	hdr.sphere_size = sizeof(sphere);
+	hdr.plane_size = sizeof(plane);
+	hdr.light_size = sizeof(light);
+	hdr.material_size = sizeof(color);
+	hdr.num_spheres = ctx->num_spheres;
+	hdr.num_planes = ctx->num_planes;
+	hdr.num_lights = ctx->num_lights;
+	hdr.num_materials = ctx->num_materials;
+	hdr.spheres_offset = align_up(sizeof(hdr));
+	hdr.planes_offset = align_up(hdr.spheres_offset + sizeof(sphere) * hdr.num_spheres);
+	hdr.lights_offset = align_up(hdr.planes_offset + sizeof(plane) * hdr.num_planes);
+	hdr.materials_offset = align_up(hdr.lights_offset + sizeof(light) * hdr.num_lights);
+	hdr.file_size = hdr.materials_offset + sizeof(color) * hdr.num_materials;
+
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "error opening '%s' for writing: %d %s\n", tmp, errno, strerror(errno));
+		return -1;
+	}
+	int ret = write_section(f, 0, &hdr, sizeof(hdr));
+	if (ret == 0)
+		ret = write_spheres(f, hdr.spheres_offset, ctx->spheres, hdr.num_spheres);
+	if (ret == 0)
+		ret = write_planes(f, hdr.planes_offset, ctx->planes, hdr.num_planes);
+	if (ret == 0)
+		ret = write_section(f, hdr.lights_offset, ctx->lights, sizeof(light) * hdr.num_lights);
+	if (ret == 0)
+		ret = write_section(f, hdr.materials_offset, ctx->materials, sizeof(color) * hdr.num_materials);
+	if (fclose(f) != 0)
+		ret = -1;
+	if (ret == 0 && rename(tmp, path) != 0)
+		ret = -1;
+	if (ret != 0) {
+		fprintf(stderr, "error writing compiled scene '%s': %d %s\n", path, errno, strerror(errno));
+		unlink(tmp);
+	}
+	return ret;
+}
+
+static int section_fits(const struct scene_bin_header *hdr, uint64_t offset, uint64_t size, uint32_t count) {
+	return offset % SCENE_BIN_ALIGN == 0 && offset >= sizeof(*hdr) && offset <= hdr->file_size &&
+		(hdr->file_size - offset) / size >= count;
+}
+
+// Spheres and planes index the material table, which rendering trusts, so every index must be in it.
+static int materials_in_range(const uint8_t *map, const struct scene_bin_header *hdr) {
+	const sphere *spheres = (const sphere *)(map + hdr->spheres_offset);
+	for (uint32_t i = 0; i < hdr->num_spheres; i++)
+		if (spheres[i].material >= hdr->num_materials)
+			return 0;
+	const plane *planes = (const plane *)(map + hdr->planes_offset);
+	for (uint32_t i = 0; i < hdr->num_planes; i++)
+		if (planes[i].material >= hdr->num_materials)
+			return 0;
+	return 1;
+}
+
+int scene_bin_load(const char *path, struct context *ctx) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "error opening scene '%s': %d %s\n", path, errno, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	struct scene_bin_header hdr;
+	if (st.st_size < (off_t)sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr.magic, SCENE_BIN_MAGIC, sizeof(hdr.magic)) != 0) {
+		close(fd);
+		return 0;
+	}
+	if (hdr.version != SCENE_BIN_VERSION || hdr.byte_order != SCENE_BIN_BYTE_ORDER ||
+			hdr.sphere_size != sizeof(sphere) || hdr.plane_size != sizeof(plane) || hdr.light_size != sizeof(light) ||
+			hdr.material_size != sizeof(color)) {
+		fprintf(stderr, "'%s' was compiled by an incompatible build, recompile it\n", path);
+		close(fd);
+		return -1;
+	}
+	if (hdr.file_size > (uint64_t)st.st_size ||
+			!section_fits(&hdr, hdr.spheres_offset, sizeof(sphere), hdr.num_spheres) ||
+			!section_fits(&hdr, hdr.planes_offset, sizeof(plane), hdr.num_planes) ||
+			!section_fits(&hdr, hdr.lights_offset, sizeof(light), hdr.num_lights) ||
+			!section_fits(&hdr, hdr.materials_offset, sizeof(color), hdr.num_materials)) {
+		fprintf(stderr, "'%s' is truncated or corrupt\n", path);
+		close(fd);
+		return -1;
+	}
+
+	// Private so physics can move the spheres without touching the file.
+	uint8_t *map = mmap(NULL, hdr.file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "error mapping scene '%s': %d %s\n", path, errno, strerror(errno));
+		return -1;
+	}
+	if (!materials_in_range(map, &hdr)) {
+		fprintf(stderr, "'%s' is truncated or corrupt\n", path);
+		munmap(map, hdr.file_size);
+		return -1;
+	}
+	ctx->map = map;
+	ctx->map_size = hdr.file_size;
+	ctx->num_spheres = hdr.num_spheres;
+	ctx->num_planes = hdr.num_planes;
+	ctx->num_lights = hdr.num_lights;
+	ctx->spheres = hdr.num_spheres ? (sphere *)(map + hdr.spheres_offset) : NULL;
+	ctx->planes = hdr.num_planes ? (plane *)(map + hdr.planes_offset) : NULL;
+	ctx->lights = hdr.num_lights ? (light *)(map + hdr.lights_offset) : NULL;
+	ctx->num_materials = hdr.num_materials;
+	ctx->materials = hdr.num_materials ? (color *)(map + hdr.materials_offset) : NULL;
+	return 1;
+}
+
+int scene_compile_main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: ray compile <scene file> <compiled scene>\n");
+		return 1;
+	}
+	FILE *in = fopen(argv[1], "r");
+	if (in == NULL) {
+		fprintf(stderr, "error opening scene '%s': %d %s\n", argv[1], errno, strerror(errno));
+		return 1;
+	}
+	struct context *ctx = new_context();
+	double t0 = bench_now();
+	int ret = parse_scene(in, argv[1], ctx);
+	fclose(in);
+	if (ret != 0) {
+		fprintf(stderr, "error parsing scene '%s'\n", argv[1]);
+		free_context(ctx);
+		return 1;
+	}
+	double t1 = bench_now();
+	ret = scene_bin_write(argv[2], ctx);
+	if (ret == 0)
+		fprintf(stderr, "compiled %d spheres, %d planes, %d lights and %d materials into '%s' (parse %.3f s, write %.3f s)\n",
+				ctx->num_spheres, ctx->num_planes, ctx->num_lights, ctx->num_materials, argv[2], t1 - t0, bench_now() - t1);
+	free_context(ctx);
+	return ret != 0;
+}
@@ -0,0 +1,55 @@
+#ifndef RAY_SCENE_BIN_H__
+#define RAY_SCENE_BIN_H__
+
+#include <stdint.h>
+
+#include "ray_ast.h"
+
+// Compiled scene, written by `ray compile` so big scenes load without the lexer and parser. The arrays are
+// stored exactly as struct context holds them and used in place from a private mapping: planes and lights stay
+// shared in the page cache between renders of the same scene, sphere pages get copied only once physics writes
+// them. Layout:
+//
+//	struct scene_bin_header
+//	sphere spheres[num_spheres]	at spheres_offset
+//	plane planes[num_planes]	at planes_offset
+//	light lights[num_lights]	at lights_offset
+//	color materials[num_materials]	at materials_offset
+//
+// Every array starts on a SCENE_BIN_ALIGN boundary. The record sizes and byte order are checked on load, so a
+// file compiled by a build with different structs is refused rather than misread.
+
+#define SCENE_BIN_MAGIC		"RSCN"
+#define SCENE_BIN_VERSION	2
+#define SCENE_BIN_BYTE_ORDER	0x01020304
+#define SCENE_BIN_ALIGN		64
+
+struct scene_bin_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t sphere_size;
+	uint32_t plane_size;
+	uint32_t light_size;
+	uint32_t material_size;
+	uint32_t num_spheres;
+	uint32_t num_planes;
+	uint32_t num_lights;
+	uint32_t num_materials;
+	uint32_t reserved;
+	uint64_t spheres_offset;
+	uint64_t planes_offset;
+	uint64_t lights_offset;
+	uint64_t materials_offset;
+	uint64_t file_size;
+};
+
+int scene_bin_write(const char *path, const struct context *ctx);
+// Maps a compiled scene into the empty ctx. Returns 1 if it was loaded, 0 if path is not a compiled scene
+// (so should be parsed as text) and -1 if it is one but can't be used.
+int scene_bin_load(const char *path, struct context *ctx);
+
+// ray compile <scene file> <compiled scene>
+int scene_compile_main(int argc, char **argv);
+
+#endif	// RAY_SCENE_BIN_H__
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+
+#include "ray_snapshot.h"
+
+struct snapshot_ring *new_snapshot_ring(int capacity, int num_spheres) {
+	struct snapshot_ring *r = calloc(1, sizeof(*r));
+	r->capacity = capacity > 0 ? capacity : 1;
+	r->num_spheres = num_spheres;
+	r->slots = malloc(sizeof(*r->slots) * r->capacity * (num_spheres > 0 ? num_spheres : 1));
+	r->released = calloc(r->capacity, 1);
+	r->unchanged = calloc(r->capacity, 1);
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	return r;
+}
+
+void free_snapshot_ring(struct snapshot_ring *r) {
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->slots);
+	free(r->released);
+	free(r->unchanged);
+	free(r);
+}
+
+sphere *snapshot_ring_begin_write(struct snapshot_ring *r) {
+	pthread_mutex_lock(&r->lock);
+	while (r->produced - r->consumed >= r->capacity)
+		pthread_cond_wait(&r->cond, &r->lock);
+	long frame = r->produced;
+	pthread_mutex_unlock(&r->lock);
+	return &r->slots[(frame % r->capacity) * r->num_spheres];
+}
+
+void snapshot_ring_publish(struct snapshot_ring *r, int unchanged) {
+	pthread_mutex_lock(&r->lock);
+	r->released[r->produced % r->capacity] = 0;
+	r->unchanged[r->produced % r->capacity] = unchanged != 0;
+	r->produced++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+const sphere *snapshot_ring_acquire(struct snapshot_ring *r, long frame) {
+	pthread_mutex_lock(&r->lock);
+	while (r->produced <= frame)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	return &r->slots[(frame % r->capacity) * r->num_spheres];
+}
+
+// Only valid between acquiring and releasing frame.
+int snapshot_ring_unchanged(struct snapshot_ring *r, long frame) {
+	return r->unchanged[frame % r->capacity];
+}
+
+void snapshot_ring_release(struct snapshot_ring *r, long frame) {
+	pthread_mutex_lock(&r->lock);
+	r->released[frame % r->capacity] = 1;
+	while (r->consumed < r->produced && r->released[r->consumed % r->capacity])
+		r->consumed++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
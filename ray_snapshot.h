@@ -0,0 +1,45 @@
+#ifndef RAY_SNAPSHOT_H__
+#define RAY_SNAPSHOT_H__
+
+#include <pthread.h>
+
+#include "ray_ast.h"
+
+// Ring of per-frame sphere snapshots between the physics stage and the renderers. Physics publishes the spheres
+// of frame f into the next free slot and may run up to capacity frames ahead; a renderer acquires frame f, reads
+// the immutable snapshot, and releases it. Frames may be released in any order, a slot is reused once every
+// frame before it has been released too.
+struct snapshot_ring {
+	int capacity;
+	int num_spheres;
+	sphere *slots;			// capacity * num_spheres
+	unsigned char *released;	// per slot
+	unsigned char *unchanged;	// per slot, the frame renders exactly like the one before it
+	long produced;			// frames published so far
+	long consumed;			// frames before this have all been released
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct snapshot_ring *new_snapshot_ring(int capacity, int num_spheres);
+void free_snapshot_ring(struct snapshot_ring *r);
+
+// Physics side: wait for a free slot, fill it, publish it as the next frame. unchanged tells the renderers the
+// frame looks the same as the one before it, see scene_render_hash().
+sphere *snapshot_ring_begin_write(struct snapshot_ring *r);
+void snapshot_ring_publish(struct snapshot_ring *r, int unchanged);
+
+// Render side.
+const sphere *snapshot_ring_acquire(struct snapshot_ring *r, long frame);
+int snapshot_ring_unchanged(struct snapshot_ring *r, long frame);
+void snapshot_ring_release(struct snapshot_ring *r, long frame);
+
+// A context that shares everything with ctx except the spheres, which come from a snapshot.
+static inline struct context snapshot_context(const struct context *ctx, const sphere *spheres) {
+	struct context view = *ctx;
+	view.spheres = (sphere *)spheres;
+	view.physics = NULL;
+	return view;
+}
+
+#endif	// RAY_SNAPSHOT_H__
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ray_trajectory.h"
+#include "ray_physics.h"
+#include "ray_bench.h"
+
+struct trajectory *trajectory_create(const char *path, int num_spheres, int num_frames) {
+	struct trajectory *t = calloc(1, sizeof(*t));
+	if ((t->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "error opening trajectory '%s' for writing: %d %s\n", path, errno, strerror(errno));
+		exit(1);
+	}
+
+	size_t frame_size = sizeof(pt3) * num_spheres;
+	t->map_size = sizeof(struct trajectory_file_header) + frame_size * num_frames;
+	if (fallocate(t->fd, 0, 0, t->map_size) != 0 && ftruncate(t->fd, t->map_size) != 0) {
+		fprintf(stderr, "error sizing trajectory '%s' to %zu bytes: %d %s\n", path, t->map_size, errno, strerror(errno));
+		exit(1);
+	}
+	t->map = mmap(NULL, t->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+	if (t->map == MAP_FAILED) {
+		fprintf(stderr, "error mapping trajectory '%s': %d %s\n", path, errno, strerror(errno));
+		exit(1);
+	}
+
+	t->hdr = (struct trajectory_file_header *)t->map;
+	memcpy(t->hdr->magic, TRAJECTORY_MAGIC, sizeof(t->hdr->magic));
+	t->hdr->version = TRAJECTORY_VERSION;
+	t->hdr->num_spheres = num_spheres;
+	t->hdr->num_frames = num_frames;
+	t->hdr->frame_size = frame_size;
+	return t;
+}
+
+struct trajectory *trajectory_open(const char *path) {
+	struct trajectory *t = calloc(1, sizeof(*t));
+	struct stat st;
+	if ((t->fd = open(path, O_RDONLY)) < 0 || fstat(t->fd, &st) != 0) {
+		fprintf(stderr, "error opening trajectory '%s': %d %s\n", path, errno, strerror(errno));
+		trajectory_close(t);
+		return NULL;
+	}
+	t->map_size = st.st_size;
+	if (t->map_size < sizeof(struct trajectory_file_header) ||
+			(t->map = mmap(NULL, t->map_size, PROT_READ, MAP_SHARED, t->fd, 0)) == MAP_FAILED) {
+		fprintf(stderr, "error mapping trajectory '%s'\n", path);
+		t->map = NULL;
+		trajectory_close(t);
+		return NULL;
+	}
+
+	t->hdr = (struct trajectory_file_header *)t->map;
+	if (memcmp(t->hdr->magic, TRAJECTORY_MAGIC, sizeof(t->hdr->magic)) != 0 || t->hdr->version != TRAJECTORY_VERSION ||
+			t->hdr->frame_size != sizeof(pt3) * t->hdr->num_spheres) {
+		fprintf(stderr, "'%s' is not a version %d trajectory\n", path, TRAJECTORY_VERSION);
+		trajectory_close(t);
+		return NULL;
+	}
+	if (sizeof(*t->hdr) + t->hdr->frame_size * t->hdr->num_frames > t->map_size) {
+		fprintf(stderr, "'%s' is truncated\n", path);
+		trajectory_close(t);
+		return NULL;
+	}
+	return t;
+}
+
+// The num_spheres positions of frame, or NULL past the last frame. Writable only for created trajectories.
+pt3 *trajectory_positions(const struct trajectory *t, int frame) {
+	if (frame < 0 || (uint32_t)frame >= t->hdr->num_frames)
+		return NULL;
+	return (pt3 *)(t->map + sizeof(*t->hdr) + t->hdr->frame_size * frame);
+}
+
+void trajectory_close(struct trajectory *t) {
+	if (t->map)
+		munmap(t->map, t->map_size);
+	if (t->fd >= 0)
+		close(t->fd);
+	free(t);
+}
+
+int trajectory_bake(struct context *ctx, const char *path, int num_frames) {
+	struct trajectory *t = trajectory_create(path, ctx->num_spheres, num_frames);
+	double t0 = bench_now();
+	for (int frame = 0; frame < num_frames; frame++) {
+		physics_copy_positions(ctx, trajectory_positions(t, frame));
+		if (frame + 1 < num_frames) {
+			step_physics(ctx);
+		}
+	}
+	double elapsed = bench_now() - t0;
+	fprintf(stderr, "baked %d frames of %d spheres into '%s' in %.3f s (%.3f ms/frame)\n",
+			num_frames, ctx->num_spheres, path, elapsed, elapsed * 1000 / num_frames);
+	trajectory_close(t);
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef RAY_TRAJECTORY_H__
+#define RAY_TRAJECTORY_H__
+
+#include <stdint.h>
+
+#include "ray_ast.h"
+
+// Baked sphere positions for every frame of a run, so a render needs no physics and can start at any frame.
+// Written and read through a shared mapping. Layout:
+//
+//	struct trajectory_file_header
+//	pt3 positions[num_frames][num_spheres]
+//
+// Positions are stored exactly as the physics step left them, so rendering from a trajectory gives the same
+// pixels as simulating.
+
+#define TRAJECTORY_MAGIC	"RTRJ"
+#define TRAJECTORY_VERSION	1
+
+struct trajectory_file_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_spheres;
+	uint32_t num_frames;
+	uint64_t frame_size;
+	uint64_t reserved;
+};
+
+struct trajectory {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	struct trajectory_file_header *hdr;
+};
+
+struct trajectory *trajectory_create(const char *path, int num_spheres, int num_frames);
+struct trajectory *trajectory_open(const char *path);
+pt3 *trajectory_positions(const struct trajectory *t, int frame);
+void trajectory_close(struct trajectory *t);
+
+// Runs only the physics for num_frames frames and stores every frame's positions in a new trajectory at path.
+int trajectory_bake(struct context *ctx, const char *path, int num_frames);
+
+#endif	// RAY_TRAJECTORY_H__